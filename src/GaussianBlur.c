@@ -1,70 +1,177 @@
 #include "GaussianBlur.h"
 
-void GaussianBlur(float *image, const int xRes, const int yRes)
+// The image is blurred in place. Each thread blurs a band of rows, keeping a ring of the (horizontally
+// filtered) rows it needs in a few row buffers, rather than copying the whole image. The rows just
+// outside each band are saved before any thread starts writing, since the neighbouring thread will
+// overwrite them. A row is stored as a flat array of 3*xRes floats, so horizontal neighbours are 3
+// floats apart, and all loops over a row vectorize.
+
+
+// Weights of the separable stencils, applied both horizontally and vertically.
+#if GAUSSIANBLURSIZE == 5
+	#define BLURRADIUS 2
+	static const float blurWeights[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+#elif GAUSSIANBLURSIZE == 3
+	#define BLURRADIUS 1
+	static const float blurWeights[3] = {1.0f/4.0f, 2.0f/4.0f, 1.0f/4.0f};
+#else
+	// 5-point stencil: centre weight 4, up, down, left, right weight 1. Not separable, but needs only
+	// one row either side.
+	#define BLURRADIUS 1
+#endif
+
+#define RINGSIZE (2*BLURRADIUS+1)
+
+
+// Copy row "in" to "out", filtering horizontally if we are using a separable stencil.
+static void FilterRow(float * restrict out, const float * restrict in, const int xRes)
 {
-	// make a copy of the image
-	float *imageCopy;
-	imageCopy = malloc(xRes * yRes * sizeof *imageCopy *3);
-	for (int j = 0; j < yRes; j++) {
-		for (int i = 0; i < xRes; i++) {
-			imageCopy[j*xRes*3 + i*3 + 0] = image[j*xRes*3 + i*3 + 0];
-			imageCopy[j*xRes*3 + i*3 + 1] = image[j*xRes*3 + i*3 + 1];
-			imageCopy[j*xRes*3 + i*3 + 2] = image[j*xRes*3 + i*3 + 2];
+	const int rowLen = 3*xRes;
+#if GAUSSIANBLURSIZE == 3 || GAUSSIANBLURSIZE == 5
+	// Edges, with clamped indices
+	for (int pixel = 0; pixel < xRes; pixel++) {
+		if (pixel == BLURRADIUS && xRes-BLURRADIUS > pixel) {
+			// skip the interior, done below
+			pixel = xRes-BLURRADIUS;
+		}
+		for (int c = 0; c < 3; c++) {
+			float sum = 0.0f;
+			for (int k = -BLURRADIUS; k <= BLURRADIUS; k++) {
+				int neighbour = pixel+k;
+				neighbour = (neighbour < 0) ? 0 : ((neighbour > xRes-1) ? xRes-1 : neighbour);
+				sum += blurWeights[k+BLURRADIUS] * in[neighbour*3 + c];
+			}
+			out[pixel*3 + c] = sum;
 		}
 	}
-
-	// 3x3 gaussian blur:
-	for (int j = 0; j < yRes; j++) {
-		for (int i = 0; i < xRes; i++) {
-			const int ju = (j == yRes-1) ? j : j+1;
-			const int jd = (j == 0) ? j : j-1;
-			const int il = (i == 0) ? i : i-1;
-			const int ir = (i == xRes-1) ? i : i+1;
-/*			image[j*xRes*3 + i*3 + 0] = (+1.0*imageCopy[(j+1)*xRes*3 + (i+1)*3 + 0]
-                                         +2.0*imageCopy[(j+1)*xRes*3 + (i+0)*3 + 0]
-                                         +1.0*imageCopy[(j+1)*xRes*3 + (i-1)*3 + 0]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i+1)*3 + 0]
-                                         +4.0*imageCopy[(j+0)*xRes*3 + (i+0)*3 + 0]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i-1)*3 + 0]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i+1)*3 + 0]
-                                         +2.0*imageCopy[(j-1)*xRes*3 + (i+0)*3 + 0]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i-1)*3 + 0])/16.0;
-			image[j*xRes*3 + i*3 + 1] = (+1.0*imageCopy[(j+1)*xRes*3 + (i+1)*3 + 1]
-                                         +2.0*imageCopy[(j+1)*xRes*3 + (i+0)*3 + 1]
-                                         +1.0*imageCopy[(j+1)*xRes*3 + (i-1)*3 + 1]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i+1)*3 + 1]
-                                         +4.0*imageCopy[(j+0)*xRes*3 + (i+0)*3 + 1]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i-1)*3 + 1]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i+1)*3 + 1]
-                                         +2.0*imageCopy[(j-1)*xRes*3 + (i+0)*3 + 1]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i-1)*3 + 1])/16.0;
-			image[j*xRes*3 + i*3 + 2] = (+1.0*imageCopy[(j+1)*xRes*3 + (i+1)*3 + 2]
-                                         +2.0*imageCopy[(j+1)*xRes*3 + (i+0)*3 + 2]
-                                         +1.0*imageCopy[(j+1)*xRes*3 + (i-1)*3 + 2]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i+1)*3 + 2]
-                                         +4.0*imageCopy[(j+0)*xRes*3 + (i+0)*3 + 2]
-                                         +2.0*imageCopy[(j+0)*xRes*3 + (i-1)*3 + 2]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i+1)*3 + 2]
-                                         +2.0*imageCopy[(j-1)*xRes*3 + (i+0)*3 + 2]
-                                         +1.0*imageCopy[(j-1)*xRes*3 + (i-1)*3 + 2])/16.0;*/
-			image[j*xRes*3 + i*3 + 0] = (   +1.0*imageCopy[ju*xRes*3 + i*3 + 0]
-                                         +1.0*imageCopy[j*xRes*3 + ir*3 + 0]
-                                         +4.0*imageCopy[j*xRes*3 + i*3 + 0]
-                                         +1.0*imageCopy[j*xRes*3 + il*3 + 0]
-                                         +1.0*imageCopy[jd*xRes*3 + i*3 + 0])/8.0;
-			image[j*xRes*3 + i*3 + 1] = (   +1.0*imageCopy[ju*xRes*3 + i*3 + 1]
-                                         +1.0*imageCopy[j*xRes*3 + ir*3 + 1]
-                                         +4.0*imageCopy[j*xRes*3 + i*3 + 1]
-                                         +1.0*imageCopy[j*xRes*3 + il*3 + 1]
-                                         +1.0*imageCopy[jd*xRes*3 + i*3 + 1])/8.0;
-			image[j*xRes*3 + i*3 + 2] = (   +1.0*imageCopy[ju*xRes*3 + i*3 + 2]
-                                         +1.0*imageCopy[j*xRes*3 + ir*3 + 2]
-                                         +4.0*imageCopy[j*xRes*3 + i*3 + 2]
-                                         +1.0*imageCopy[j*xRes*3 + il*3 + 2]
-                                         +1.0*imageCopy[jd*xRes*3 + i*3 + 2])/8.0;
+	// Interior
+	for (int i = 3*BLURRADIUS; i < rowLen - 3*BLURRADIUS; i++) {
+		float sum = 0.0f;
+		for (int k = -BLURRADIUS; k <= BLURRADIUS; k++) {
+			sum += blurWeights[k+BLURRADIUS] * in[i + 3*k];
 		}
+		out[i] = sum;
+	}
+#else
+	for (int i = 0; i < rowLen; i++) {
+		out[i] = in[i];
 	}
+#endif
+}
+
 
-	free(imageCopy);
+// Write blurred row to "out", given the ring of (filtered) rows centred on it. ring[BLURRADIUS] is the
+// centre row.
+static void BlurRow(float * restrict out, float * const ring[RINGSIZE], const int xRes)
+{
+	const int rowLen = 3*xRes;
+#if GAUSSIANBLURSIZE == 3 || GAUSSIANBLURSIZE == 5
+	for (int i = 0; i < rowLen; i++) {
+		float sum = 0.0f;
+		for (int k = 0; k < RINGSIZE; k++) {
+			sum += blurWeights[k] * ring[k][i];
+		}
+		out[i] = sum;
+	}
+#else
+	const float * restrict up = ring[0];
+	const float * restrict centre = ring[1];
+	const float * restrict down = ring[2];
+	// First and last pixels, with clamped indices
+	for (int c = 0; c < 3; c++) {
+		const int l = c;
+		const int r = rowLen-3+c;
+		out[l] = (up[l] + down[l] + centre[l] + centre[l+3] + 4.0f*centre[l]) / 8.0f;
+		out[r] = (up[r] + down[r] + centre[r-3] + centre[r] + 4.0f*centre[r]) / 8.0f;
+	}
+	for (int i = 3; i < rowLen-3; i++) {
+		out[i] = (up[i] + down[i] + centre[i-3] + centre[i+3] + 4.0f*centre[i]) / 8.0f;
+	}
+#endif
 }
 
+
+
+void GaussianBlur(float *image, const int xRes, const int yRes)
+{
+	const size_t rowLen = 3*(size_t)xRes;
+
+	#pragma omp parallel default(none) shared(image) firstprivate(xRes, yRes, rowLen)
+	{
+		const int nThreads = omp_get_num_threads();
+		const int thread = omp_get_thread_num();
+		// This thread's band of rows, [yStart, yEnd)
+		const int yStart = (int)(((long)yRes * thread) / nThreads);
+		const int yEnd = (int)(((long)yRes * (thread+1)) / nThreads);
+
+		// Buffers: the ring of filtered rows, and the filtered rows just above and below the band.
+		float *buffer = malloc((RINGSIZE + 2*BLURRADIUS) * rowLen * sizeof *buffer);
+		float *ringRows[RINGSIZE];
+		for (int k = 0; k < RINGSIZE; k++) {
+			ringRows[k] = &(buffer[k*rowLen]);
+		}
+		float *halo = &(buffer[RINGSIZE*rowLen]);
+
+		// Save the rows outside the band before anyone modifies them. halo row k (0 <= k < BLURRADIUS)
+		// holds row yStart-BLURRADIUS+k, halo row BLURRADIUS+k holds row yEnd+k, clamped to the image.
+		if (yStart < yEnd) {
+			for (int k = 0; k < BLURRADIUS; k++) {
+				int above = yStart-BLURRADIUS+k;
+				above = (above < 0) ? 0 : above;
+				int below = yEnd+k;
+				below = (below > yRes-1) ? yRes-1 : below;
+				FilterRow(&(halo[k*rowLen]), &(image[above*rowLen]), xRes);
+				FilterRow(&(halo[(BLURRADIUS+k)*rowLen]), &(image[below*rowLen]), xRes);
+			}
+		}
+		#pragma omp barrier
+
+		if (yStart < yEnd) {
+			// Fill the ring with the rows above the first output row, and the first row itself
+			for (int k = 0; k < BLURRADIUS; k++) {
+				for (size_t i = 0; i < rowLen; i++) {
+					ringRows[k][i] = halo[k*rowLen + i];
+				}
+			}
+			for (int k = 0; k < BLURRADIUS; k++) {
+				int row = yStart+k;
+				row = (row > yRes-1) ? yRes-1 : row;
+				if (row < yEnd) {
+					FilterRow(ringRows[BLURRADIUS+k], &(image[row*rowLen]), xRes);
+				}
+				else {
+					for (size_t i = 0; i < rowLen; i++) {
+						ringRows[BLURRADIUS+k][i] = halo[(BLURRADIUS+row-yEnd)*rowLen + i];
+					}
+				}
+			}
+
+			for (int y = yStart; y < yEnd; y++) {
+				// Bring in row y+BLURRADIUS. Rows of the band below y are not yet overwritten; rows
+				// beyond the band come from the saved halo.
+				int row = y+BLURRADIUS;
+				row = (row > yRes-1) ? yRes-1 : row;
+				float *newRow = ringRows[RINGSIZE-1];
+				if (row < yEnd) {
+					FilterRow(newRow, &(image[row*rowLen]), xRes);
+				}
+				else {
+					for (size_t i = 0; i < rowLen; i++) {
+						newRow[i] = halo[(BLURRADIUS+row-yEnd)*rowLen + i];
+					}
+				}
+
+				BlurRow(&(image[y*rowLen]), ringRows, xRes);
+
+				// Rotate the ring
+				float *oldest = ringRows[0];
+				for (int k = 0; k < RINGSIZE-1; k++) {
+					ringRows[k] = ringRows[k+1];
+				}
+				ringRows[RINGSIZE-1] = oldest;
+			}
+		}
+
+		free(buffer);
+	}
+}
@@ -1,5 +1,8 @@
-// Gaussian Blur to make detailed sections look nicer
+// Gaussian Blur to make detailed sections look nicer. Stencil chosen by GAUSSIANBLURSIZE in config.h
 
 #include <stdlib.h>
+#include <omp.h>
+
+#include "config.h"
 
 void GaussianBlur(float *image, const int xRes, const int yRes);
@@ -0,0 +1,467 @@
+#include "animation.h"
+
+// A keyframe file lists, one per line,
+//     frame  xCentre  yCentre  zoom  maxIters
+// with frames in increasing order. zoom is the magnification relative to the initial view, as a power of
+// two: the view is 2^-zoom times as wide. Blank lines and lines starting with # are ignored.
+//
+// Between keyframes, zoom and log(maxIters) are interpolated linearly, so that the zoom proceeds at a
+// constant rate. The centre moves in proportion to the change in the width of the view, so that the zoom
+// heads straight for the next keyframe's centre, rather than drifting across the image.
+//
+// Frames are rendered in parallel, one per thread, and written in order as soon as each frame and all
+// those before it are done. The renderers' own parallel loops then run on a single thread. With
+// settings->expMap, frames are instead resampled from an exponential map, see RenderExpMapFrames.
+
+
+typedef struct {
+	int frame;
+	double xCentre;
+	double yCentre;
+	double zoom;
+	double maxIters;
+} keyframeStruct;
+
+
+
+// Read the keyframe file into a newly allocated array, set *nKeyframes. Returns NULL on error.
+static keyframeStruct *ReadKeyframes(const char *keyframeFileName, int *nKeyframes)
+{
+	FILE *fp = fopen(keyframeFileName, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: cannot open keyframe file %s\n", keyframeFileName);
+		return NULL;
+	}
+
+	keyframeStruct *keyframes = NULL;
+	int n = 0;
+	int allocated = 0;
+	char line[1024];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineNumber++;
+		char *start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+			continue;
+		}
+
+		keyframeStruct k;
+		if (sscanf(start, "%d %lf %lf %lf %lf", &k.frame, &k.xCentre, &k.yCentre, &k.zoom, &k.maxIters) != 5
+		 || k.maxIters < 1.0 || (n > 0 && k.frame <= keyframes[n-1].frame)) {
+			fprintf(stderr, "Error: bad keyframe at %s:%d\n", keyframeFileName, lineNumber);
+			free(keyframes);
+			fclose(fp);
+			return NULL;
+		}
+
+		if (n == allocated) {
+			allocated = (allocated == 0) ? 16 : 2*allocated;
+			keyframes = realloc(keyframes, allocated * sizeof *keyframes);
+		}
+		keyframes[n++] = k;
+	}
+	fclose(fp);
+
+	if (n == 0) {
+		fprintf(stderr, "Error: no keyframes in %s\n", keyframeFileName);
+		return NULL;
+	}
+	*nKeyframes = n;
+	return keyframes;
+}
+
+
+
+// Set the view and maxIters of image for the given frame, interpolating between keyframes. width is the
+// width of the view at zoom 0.
+static void SetFrameView(imageStruct *image, const keyframeStruct *keyframes, const int nKeyframes,
+                         const int frame, const double width)
+{
+	// Keyframes a and b either side of the frame. Before the first and after the last, a == b.
+	int b = 0;
+	while (b < nKeyframes-1 && keyframes[b].frame < frame) {
+		b++;
+	}
+	const int a = (b > 0 && keyframes[b].frame > frame) ? b-1 : b;
+	const keyframeStruct *ka = &(keyframes[a]);
+	const keyframeStruct *kb = &(keyframes[b]);
+
+	const double s = (a == b) ? 0.0 : (double)(frame - ka->frame)/(double)(kb->frame - ka->frame);
+	const double zoom = ka->zoom + (kb->zoom - ka->zoom)*s;
+	const double frameWidth = width*exp2(-zoom);
+
+	// Fraction of the way from ka's centre to kb's: the fraction of the change in width, if it changes
+	double t = s;
+	if (ka->zoom != kb->zoom) {
+		const double widthA = width*exp2(-ka->zoom);
+		const double widthB = width*exp2(-kb->zoom);
+		t = (widthA - frameWidth)/(widthA - widthB);
+	}
+	const double xCentre = ka->xCentre + (kb->xCentre - ka->xCentre)*t;
+	const double yCentre = ka->yCentre + (kb->yCentre - ka->yCentre)*t;
+
+	SetView(image, xCentre, yCentre, frameWidth);
+	image->maxIters = (unsigned)(exp(log(ka->maxIters) + (log(kb->maxIters) - log(ka->maxIters))*s) + 0.5);
+}
+
+
+
+// Convert the image's r,g,b pixels to 8-bit output: planar Y, Cb, Cr (BT.601, limited range, no chroma
+// subsampling) for YUV4MPEG2, or interleaved r,g,b.
+static void ConvertFrame(unsigned char * restrict out, const float * restrict pixels, const size_t nPixels,
+                         const int rawRGB)
+{
+	if (rawRGB) {
+		for (size_t i = 0; i < 3*nPixels; i++) {
+			out[i] = (unsigned char)(255.0f*fminf(1.0f, fmaxf(0.0f, pixels[i])) + 0.5f);
+		}
+		return;
+	}
+
+	unsigned char * restrict Y = out;
+	unsigned char * restrict Cb = &(out[nPixels]);
+	unsigned char * restrict Cr = &(out[2*nPixels]);
+	for (size_t i = 0; i < nPixels; i++) {
+		const float r = fminf(1.0f, fmaxf(0.0f, pixels[3*i+0]));
+		const float g = fminf(1.0f, fmaxf(0.0f, pixels[3*i+1]));
+		const float b = fminf(1.0f, fmaxf(0.0f, pixels[3*i+2]));
+		Y[i]  = (unsigned char)( 16.5f + 219.0f*( 0.299f*r    + 0.587f*g    + 0.114f*b));
+		Cb[i] = (unsigned char)(128.5f + 224.0f*(-0.168736f*r - 0.331264f*g + 0.5f*b));
+		Cr[i] = (unsigned char)(128.5f + 224.0f*( 0.5f*r      - 0.418688f*g - 0.081312f*b));
+	}
+}
+
+
+
+// Write a frame to out, with its header for YUV4MPEG2. Returns 1 on error.
+static int WriteFrame(FILE *out, const unsigned char *bytes, const size_t frameBytes, const int rawRGB)
+{
+	return (!rawRGB && fputs("FRAME\n", out) == EOF) || fwrite(bytes, 1, frameBytes, out) != frameBytes
+	    || fflush(out) != 0;
+}
+
+
+
+// Render the frames in parallel, one per thread, and write them in order. Returns 1 on error.
+static int RenderFrames(const imageStruct *settings, const keyframeStruct *keyframes, const int nKeyframes,
+                        void (*RenderFrame)(renderStruct*, imageStruct*), FILE *out, const int rawRGB)
+{
+	const int firstFrame = keyframes[0].frame;
+	const int lastFrame = keyframes[nKeyframes-1].frame;
+	const double width = settings->xRes*settings->xStep;
+	const size_t nPixels = (size_t)settings->xRes * settings->yRes;
+	const size_t frameBytes = 3*nPixels;
+	const double startTime = GetWallTime();
+
+	// Parallelism is over frames: don't let the renderers start their own teams of threads
+	omp_set_max_active_levels(1);
+
+	int failed = 0;
+	FILE *logFile = stderr;
+	#pragma omp parallel default(none) shared(settings,keyframes,out,logFile,failed,RenderFrame) firstprivate(nKeyframes,firstFrame,lastFrame,width,nPixels,frameBytes,rawRGB,startTime)
+	{
+		// Each thread renders whole frames, into its own buffers
+		renderStruct render;
+		render.window = NULL;
+		render.updateTex = 0;
+		render.coordinator = NULL;
+		render.cancel = NULL;
+		render.shaderColouring = 0;
+		imageStruct image = *settings;
+		image.pixels = malloc(3*nPixels * sizeof *(image.pixels));
+		image.escape = malloc(nPixels * sizeof *(image.escape));
+		image.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(image.histogramCDF));
+		unsigned char *bytes = malloc(frameBytes);
+
+		#pragma omp for ordered schedule(dynamic,1)
+		for (int frame = firstFrame; frame <= lastFrame; frame++) {
+			int stop;
+			#pragma omp atomic read
+			stop = failed;
+
+			if (!stop) {
+				SetFrameView(&image, keyframes, nKeyframes, frame, width);
+				RenderFrame(&render, &image);
+				ConvertFrame(bytes, image.pixels, nPixels, rawRGB);
+			}
+
+			#pragma omp ordered
+			{
+				if (!stop) {
+					if (WriteFrame(out, bytes, frameBytes, rawRGB)) {
+						fprintf(logFile, "Error: writing frame %d failed\n", frame);
+						#pragma omp atomic write
+						failed = 1;
+					}
+					else {
+						fprintf(logFile, "   --- frame %d/%d, maxIters %u, %.1lf frames/s\n", frame, lastFrame,
+						        image.maxIters, (frame-firstFrame+1)/(GetWallTime()-startTime));
+					}
+				}
+			}
+		}
+
+		free(image.pixels);
+		free(image.escape);
+		free(image.histogramCDF);
+		free(bytes);
+	}
+
+	return failed;
+}
+
+
+
+// maxIters at the given zoom, interpolating log(maxIters) between the keyframes either side. Keyframe
+// zoom must be non-decreasing.
+static unsigned ZoomMaxIters(const keyframeStruct *keyframes, const int nKeyframes, const double zoom)
+{
+	int b = 0;
+	while (b < nKeyframes-1 && keyframes[b].zoom < zoom) {
+		b++;
+	}
+	const int a = (b > 0 && keyframes[b].zoom > zoom) ? b-1 : b;
+	const keyframeStruct *ka = &(keyframes[a]);
+	const keyframeStruct *kb = &(keyframes[b]);
+
+	double s = (ka->zoom == kb->zoom) ? 0.0 : (zoom - ka->zoom)/(kb->zoom - ka->zoom);
+	s = fmin(1.0, fmax(0.0, s));
+	return (unsigned)(exp(log(ka->maxIters) + (log(kb->maxIters) - log(ka->maxIters))*s) + 0.5);
+}
+
+
+
+// Exponential-map rendering. Rather than rendering each frame, render the plane once, in log-polar
+// coordinates about the centre: a strip whose columns are the angle, W of them around the circle, and
+// whose rows are the log of the distance from the centre, descending in steps of 2pi/W so that the
+// samples are square. Row 0 passes through the corners of the first frame. Each frame is then resampled
+// from the rows between its corners and its centre pixel; zooming in by a factor 2 only needs another
+// W*log(2)/2pi rows.
+//
+// Rows are rendered EXPMAPBAND at a time, when a frame first needs them, with the maxIters of the deepest
+// frame that shows them: the one whose corners they pass through. They are kept, as 8-bit r,g,b, in a
+// ring buffer which holds the rows of one frame, and are dropped once they are outside the frame.
+//
+// Zoom must be non-decreasing, and the centre fixed (the first keyframe's). Distance estimation,
+// histogram colouring and blur depend on the pixel spacing or the whole image, so are not used.
+static int RenderExpMapFrames(const imageStruct *settings, const keyframeStruct *keyframes, const int nKeyframes,
+                              void (*RenderFrame)(renderStruct*, imageStruct*), FILE *out, const int rawRGB)
+{
+	const int firstFrame = keyframes[0].frame;
+	const int lastFrame = keyframes[nKeyframes-1].frame;
+	const double width = settings->xRes*settings->xStep;
+	const unsigned xRes = settings->xRes;
+	const unsigned yRes = settings->yRes;
+	const size_t nPixels = (size_t)xRes * yRes;
+	const size_t frameBytes = 3*nPixels;
+
+	// The frames' view, with the centre fixed
+	keyframeStruct *frameKeys = malloc(nKeyframes * sizeof *frameKeys);
+	int moved = 0;
+	for (int k = 0; k < nKeyframes; k++) {
+		if (k > 0 && keyframes[k].zoom < keyframes[k-1].zoom) {
+			fprintf(stderr, "Error: exponential-map animations cannot zoom out (keyframe %d)\n", keyframes[k].frame);
+			free(frameKeys);
+			return 1;
+		}
+		moved |= (keyframes[k].xCentre != keyframes[0].xCentre || keyframes[k].yCentre != keyframes[0].yCentre);
+		frameKeys[k] = keyframes[k];
+		frameKeys[k].xCentre = keyframes[0].xCentre;
+		frameKeys[k].yCentre = keyframes[0].yCentre;
+	}
+	if (moved) {
+		fprintf(stderr, "Warning: exponential-map animations keep the first keyframe's centre\n");
+	}
+
+	// The strip: W columns, and rows of log distance sMax - i*delta. A frame's corners are diagonal/2
+	// pixels from the centre, so it spans log(diagonal)/delta rows, down to half a pixel.
+	const double twoPi = 2.0*acos(-1.0);
+	const double diagonal = hypot((double)xRes, (double)yRes);
+	const unsigned W = (unsigned)ceil(0.5*twoPi*EXPMAPSAMPLING*diagonal);
+	const double delta = twoPi/W;
+	const double sMax = log(0.5*width*exp2(-keyframes[0].zoom)*diagonal/xRes);
+	const long capacity = (long)ceil(log(diagonal)/delta) + EXPMAPBAND + 4;
+	unsigned char *strip = malloc((size_t)capacity*W*3);
+	long nextRow = 0;
+
+	renderStruct render;
+	render.window = NULL;
+	render.updateTex = 0;
+	render.coordinator = NULL;
+	render.cancel = NULL;
+	render.shaderColouring = 0;
+	imageStruct band = *settings;
+	band.xRes = W;
+	band.yRes = EXPMAPBAND;
+	band.expMap = 1;
+	band.xOrigin = keyframes[0].xCentre;
+	band.yOrigin = keyframes[0].yCentre;
+	band.distanceEstimation = 0;
+	band.orbitDensity = 0;
+	band.histogramColouring = 0;
+	band.gaussianBlur = 0;
+	band.pixels = malloc(3*(size_t)W*EXPMAPBAND * sizeof *(band.pixels));
+	band.escape = malloc((size_t)W*EXPMAPBAND * sizeof *(band.escape));
+	band.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(band.histogramCDF));
+
+	// Every frame is the same map, scaled: each pixel's column of the strip, and its row relative to the
+	// row of distance frameWidth, are fixed
+	float *mapU = malloc(nPixels * sizeof *mapU);
+	float *mapV = malloc(nPixels * sizeof *mapV);
+	const unsigned char **rows = malloc(capacity * sizeof *rows);
+	#pragma omp parallel for default(none) shared(mapU,mapV) firstprivate(xRes,yRes,W,delta,twoPi) schedule(static)
+	for (unsigned y = 0; y < yRes; y++) {
+		const double dy = ((double)y/(double)yRes - 0.5)*((double)yRes/(double)xRes);
+		for (unsigned x = 0; x < xRes; x++) {
+			const double dx = (double)x/(double)xRes - 0.5;
+			double theta = atan2(dy, dx);
+			if (theta < 0.0) {
+				theta += twoPi;
+			}
+			// theta just below 2pi can round up to column W, the same as column 0
+			const float u = (float)(theta/delta);
+			mapU[(size_t)y*xRes+x] = (u < W) ? u : 0.0f;
+			mapV[(size_t)y*xRes+x] = (float)(-log(fmax(0.5/xRes, hypot(dx, dy)))/delta);
+		}
+	}
+
+	imageStruct frameView = *settings;
+	float *pixels = malloc(3*nPixels * sizeof *pixels);
+	unsigned char *bytes = malloc(frameBytes);
+
+	fprintf(stderr, "Exponential map: strip %u wide, %ld rows per frame\n", W, capacity - EXPMAPBAND - 4);
+	const double startTime = GetWallTime();
+	long rowsRendered = 0;
+
+	int failed = 0;
+	for (int frame = firstFrame; frame <= lastFrame && !failed; frame++) {
+		SetFrameView(&frameView, frameKeys, nKeyframes, frame, width);
+		const double frameWidth = frameView.xRes*frameView.xStep;
+
+		// Rows from the corners to half a pixel from the centre
+		const long iTop = (long)fmax(0.0, floor((sMax - log(0.5*frameWidth*diagonal/xRes))/delta));
+		const long iBottom = (long)ceil((sMax - log(0.5*frameWidth/xRes))/delta) + 1;
+
+		while (nextRow <= iBottom) {
+			// Angles 0 to 2pi across, log distances down from sMax - nextRow*delta
+			const double sBottom = sMax - (nextRow+EXPMAPBAND)*delta;
+			SetViewBounds(&band, 0.0, twoPi, sMax - nextRow*delta, sBottom);
+			band.maxIters = ZoomMaxIters(keyframes, nKeyframes, keyframes[0].zoom + (sMax - sBottom)/log(2.0));
+			RenderFrame(&render, &band);
+
+			for (unsigned y = 0; y < EXPMAPBAND; y++) {
+				unsigned char *row = &(strip[(size_t)((nextRow+y) % capacity)*W*3]);
+				const float *bandRow = &(band.pixels[(size_t)y*W*3]);
+				for (unsigned i = 0; i < 3*W; i++) {
+					row[i] = (unsigned char)(255.0f*fminf(1.0f, fmaxf(0.0f, bandRow[i])) + 0.5f);
+				}
+			}
+			nextRow += EXPMAPBAND;
+			rowsRendered += EXPMAPBAND;
+		}
+
+		// Resample the frame from the strip, bilinearly. v is the row relative to iTop.
+		const long nRows = iBottom - iTop + 1;
+		for (long i = 0; i < nRows; i++) {
+			rows[i] = &(strip[(size_t)((iTop+i) % capacity)*W*3]);
+		}
+		const float vFrame = (float)((sMax - log(frameWidth))/delta - iTop);
+		#pragma omp parallel for default(none) shared(rows,pixels,mapU,mapV) firstprivate(xRes,yRes,W,vFrame,nRows) schedule(static)
+		for (unsigned y = 0; y < yRes; y++) {
+			for (unsigned x = 0; x < xRes; x++) {
+				const size_t p = (size_t)y*xRes+x;
+				const float v = fminf((float)(nRows-1), fmaxf(0.0f, vFrame + mapV[p]));
+				const long i0 = (long)v;
+				const long i1 = (i0 < nRows-1) ? i0+1 : i0;
+				const float fv = v - i0;
+				const unsigned j0 = (unsigned)mapU[p];
+				const unsigned j1 = (j0+1 < W) ? j0+1 : 0;
+				const float fu = mapU[p] - j0;
+
+				const unsigned char *row0 = rows[i0];
+				const unsigned char *row1 = rows[i1];
+				for (int c = 0; c < 3; c++) {
+					const float top = row0[3*j0+c] + fu*(row0[3*j1+c] - row0[3*j0+c]);
+					const float bottom = row1[3*j0+c] + fu*(row1[3*j1+c] - row1[3*j0+c]);
+					pixels[3*p+c] = (top + fv*(bottom - top))/255.0f;
+				}
+			}
+		}
+
+		ConvertFrame(bytes, pixels, nPixels, rawRGB);
+		if (WriteFrame(out, bytes, frameBytes, rawRGB)) {
+			fprintf(stderr, "Error: writing frame %d failed\n", frame);
+			failed = 1;
+		}
+		else {
+			fprintf(stderr, "   --- frame %d/%d, maxIters %u, %ld rows rendered, %.1lf frames/s\n", frame, lastFrame,
+			        frameView.maxIters, rowsRendered, (frame-firstFrame+1)/(GetWallTime()-startTime));
+		}
+	}
+
+	free(frameKeys);
+	free(strip);
+	free(mapU);
+	free(mapV);
+	free(rows);
+	free(band.pixels);
+	free(band.escape);
+	free(band.histogramCDF);
+	free(pixels);
+	free(bytes);
+	return failed;
+}
+
+
+
+int RenderAnimation(const imageStruct *settings, const char *keyframeFileName, const char *outputFileName,
+                    const int rawRGB)
+{
+	int nKeyframes;
+	keyframeStruct *keyframes = ReadKeyframes(keyframeFileName, &nKeyframes);
+	if (keyframes == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	FILE *out = stdout;
+	if (strcmp(outputFileName, "-") != 0) {
+		// a named pipe blocks here until the reader opens it
+		out = fopen(outputFileName, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Error: cannot open output %s\n", outputFileName);
+			free(keyframes);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// The OpenCL renderer needs the window's GL context, so offline we always render on the CPU
+#if defined(WITHAVX)
+	void (*RenderFrame)(renderStruct*, imageStruct*) = &RenderMandelbrotAVXCPU;
+#elif defined(WITHGMP)
+	void (*RenderFrame)(renderStruct*, imageStruct*) = &RenderMandelbrotGMPCPU;
+#elif defined(WITHFIXED)
+	void (*RenderFrame)(renderStruct*, imageStruct*) = &RenderMandelbrotFixedCPU;
+#else
+	void (*RenderFrame)(renderStruct*, imageStruct*) = &RenderMandelbrotCPU;
+#endif
+
+	if (!rawRGB) {
+		fprintf(out, "YUV4MPEG2 W%u H%u F%d:1 Ip A1:1 C444\n", settings->xRes, settings->yRes, ANIMATIONFPS);
+	}
+	fprintf(stderr, "Rendering frames %d to %d (%u x %u) to %s...\n", keyframes[0].frame,
+	        keyframes[nKeyframes-1].frame, settings->xRes, settings->yRes, outputFileName);
+
+	int failed;
+	if (settings->expMap) {
+		failed = RenderExpMapFrames(settings, keyframes, nKeyframes, RenderFrame, out, rawRGB);
+	}
+	else {
+		failed = RenderFrames(settings, keyframes, nKeyframes, RenderFrame, out, rawRGB);
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(keyframes);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+// Offline rendering of keyframed zoom animations, streamed as video to a file or pipe. See animation.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "mandelbrot.h"
+#include "config.h"
+
+// Render the animation described by the keyframe file, and write it to outputFileName ("-" for stdout) as
+// a YUV4MPEG2 stream, or as raw 8-bit r,g,b frames if rawRGB. settings gives the resolution and colouring
+// options, and the initial view, relative to which the keyframes' zoom is measured. Returns EXIT_SUCCESS
+// or EXIT_FAILURE.
+int RenderAnimation(const imageStruct *settings, const char *keyframeFileName, const char *outputFileName,
+                    const int rawRGB);
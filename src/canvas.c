@@ -0,0 +1,310 @@
+#include "canvas.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// The canvas file holds the image's escape counts then its r,g,b pixels, as floats, in the layout of
+// image->escape and image->pixels, which the renderers write straight into. Tiles of escape counts are
+// rendered in order, and once a tile is synced to disk its number is appended to the journal, and the
+// journal synced. The first line of the journal describes the image; if it doesn't match, the canvas is
+// started afresh. Once every tile is done, the whole image is coloured at once, so that histogram
+// colouring, supersampling and blur are the same as for a render in one piece. That is quick, and done
+// again if interrupted, so it isn't journalled.
+//
+// Nothing but the current tile need be in memory: the kernel writes back the rest of the mapping, and
+// drops it from the page cache as it needs to. The colouring streams through the canvas too, but for a
+// byte per pixel of supersampling's edge map.
+
+
+
+// The journal's first line: everything which determines the image
+static void CanvasDescription(char *description, const size_t n, const imageStruct *image)
+{
+	snprintf(description, n, "canvas %u %u %.17g %.17g %.17g %.17g %.17g %.17g %u %d %d %d %d %d %.17g %d %d %.17g %.17g %d\n",
+	         image->xRes, image->yRes, image->xCentre, image->xCentreLo, image->yCentre, image->yCentreLo,
+	         image->xStep, image->yStep, image->maxIters,
+	         image->distanceEstimation, image->orbitDensity, image->histogramColouring, image->gaussianBlur, image->supersample,
+	         image->colourPeriod, FORMULA, MULTIBROTPOWER, JULIARE, JULIAIM, CANVASTILEROWS);
+}
+
+
+
+// Read image's resolution, view and options back from the description, if it is for this build's
+// formula. Returns 0, or -1 if it isn't a description, or is for another formula.
+static int ReadCanvasDescription(const char *description, imageStruct *image)
+{
+	imageStruct described = *image;
+	int formula, power, tileRows;
+	double juliaRe, juliaIm;
+	if (sscanf(description, "canvas %u %u %lf %lf %lf %lf %lf %lf %u %d %d %d %d %d %lf %d %d %lf %lf %d",
+	           &described.xRes, &described.yRes, &described.xCentre, &described.xCentreLo, &described.yCentre, &described.yCentreLo,
+	           &described.xStep, &described.yStep, &described.maxIters,
+	           &described.distanceEstimation, &described.orbitDensity, &described.histogramColouring, &described.gaussianBlur, &described.supersample,
+	           &described.colourPeriod, &formula, &power, &juliaRe, &juliaIm, &tileRows) != 20) {
+		return -1;
+	}
+	// Everything else must be as this build would write it
+	char check[512];
+	CanvasDescription(check, sizeof check, &described);
+	if (strcmp(check, description) != 0) {
+		return -1;
+	}
+	*image = described;
+	return 0;
+}
+
+
+
+// The journal of canvas "name.canvas" is "name.journal", and of any other canvas, its name with
+// ".journal" added
+static char *JournalFileName(const char *fileName)
+{
+	const size_t n = strlen(fileName);
+	const size_t stem = (n > 7 && strcmp(fileName + n-7, ".canvas") == 0) ? n-7 : n;
+	char *journalFileName = malloc(stem + sizeof ".journal");
+	memcpy(journalFileName, fileName, stem);
+	strcpy(journalFileName + stem, ".journal");
+	return journalFileName;
+}
+
+
+
+// msync the pages of the mapping holding bytes start to start+n
+static int SyncRange(const canvasStruct *canvas, const void *start, const size_t n)
+{
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t offset = (size_t)((const char*)start - (const char*)canvas->map);
+	const size_t pageStart = offset - offset%pageSize;
+	return msync((char*)canvas->map + pageStart, offset + n - pageStart, MS_SYNC);
+}
+
+
+
+int OpenCanvas(canvasStruct *canvas, const imageStruct *image, const char *fileName)
+{
+	canvas->fileName = fileName;
+	canvas->journalFileName = JournalFileName(fileName);
+	const size_t nPixels = (size_t)image->xRes * image->yRes;
+	canvas->mapSize = 4*nPixels * sizeof(float);
+	canvas->tiles = (image->yRes + CANVASTILEROWS-1)/CANVASTILEROWS;
+	canvas->tileDone = calloc(canvas->tiles, sizeof *(canvas->tileDone));
+	char description[512];
+	CanvasDescription(description, sizeof description, image);
+
+	// Resume if the journal is for this image, and the canvas is still there
+	int resume = 0;
+	FILE *journal = fopen(canvas->journalFileName, "r");
+	struct stat canvasStat;
+	if (journal != NULL) {
+		char line[512];
+		if (fgets(line, sizeof line, journal) != NULL && strcmp(line, description) == 0
+		 && stat(fileName, &canvasStat) == 0 && (size_t)canvasStat.st_size == canvas->mapSize) {
+			resume = 1;
+			// Lines of tiles done. A line cut short by a crash has no newline, and is ignored.
+			unsigned tile;
+			char end;
+			while (fgets(line, sizeof line, journal) != NULL) {
+				if (sscanf(line, "%u%c", &tile, &end) == 2 && end == '\n' && tile < canvas->tiles) {
+					canvas->tileDone[tile] = 1;
+				}
+			}
+		}
+		fclose(journal);
+	}
+
+	canvas->fd = open(fileName, resume ? O_RDWR : (O_RDWR|O_CREAT|O_TRUNC), 0644);
+	if (canvas->fd < 0 || (!resume && ftruncate(canvas->fd, (off_t)canvas->mapSize) != 0)) {
+		fprintf(stderr, "Error: cannot create canvas %s (%.2lfMB)\n", fileName, canvas->mapSize/1024.0/1024.0);
+		if (canvas->fd >= 0) {
+			close(canvas->fd);
+		}
+		free(canvas->tileDone);
+		free(canvas->journalFileName);
+		return -1;
+	}
+	canvas->map = mmap(NULL, canvas->mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, canvas->fd, 0);
+	if (canvas->map == MAP_FAILED) {
+		fprintf(stderr, "Error: cannot map canvas %s\n", fileName);
+		close(canvas->fd);
+		free(canvas->tileDone);
+		free(canvas->journalFileName);
+		return -1;
+	}
+	canvas->escape = canvas->map;
+	canvas->pixels = canvas->escape + nPixels;
+
+	canvas->journal = fopen(canvas->journalFileName, resume ? "a" : "w");
+	if (canvas->journal == NULL || (!resume && (fputs(description, canvas->journal) == EOF
+	                                         || fflush(canvas->journal) != 0 || fsync(fileno(canvas->journal)) != 0))) {
+		fprintf(stderr, "Error: cannot write journal %s\n", canvas->journalFileName);
+		if (canvas->journal != NULL) {
+			fclose(canvas->journal);
+		}
+		munmap(canvas->map, canvas->mapSize);
+		close(canvas->fd);
+		free(canvas->tileDone);
+		free(canvas->journalFileName);
+		return -1;
+	}
+
+	printf("   --- canvas %s: %.2lfMB", fileName, canvas->mapSize/1024.0/1024.0);
+	if (resume) {
+		unsigned done = 0;
+		for (unsigned t = 0; t < canvas->tiles; t++) {
+			done += canvas->tileDone[t];
+		}
+		printf(", resuming with %u/%u tiles done", done, canvas->tiles);
+	}
+	printf("\n");
+	return 0;
+}
+
+
+
+void RenderCanvas(canvasStruct *canvas, renderStruct *render, imageStruct *image,
+                  void (*RenderMandelbrot)(renderStruct*, imageStruct*))
+{
+	image->escape = canvas->escape;
+	image->pixels = canvas->pixels;
+	// Tiles are escape counts only, until the end
+	const int shaderColouring = render->shaderColouring;
+	render->shaderColouring = 1;
+
+	for (unsigned t = 0; t < canvas->tiles; t++) {
+		if (canvas->tileDone[t]) {
+			continue;
+		}
+		printf("   --- computing tile %u/%u...\n", t+1, canvas->tiles);
+
+		// Rows t*CANVASTILEROWS onwards, rendered in place. The final tile may have fewer.
+		const unsigned rowStart = t*CANVASTILEROWS;
+		imageStruct tile = *image;
+		CropRows(&tile, rowStart, (image->yRes - rowStart < CANVASTILEROWS) ? image->yRes - rowStart : CANVASTILEROWS);
+		tile.escape = &(image->escape[(size_t)rowStart*image->xRes]);
+		tile.pixels = &(image->pixels[(size_t)rowStart*image->xRes*3]);
+
+		if (render->coordinator != NULL) {
+			RenderDistributed(render->coordinator, &tile);
+		}
+		else {
+			RenderMandelbrot(render, &tile);
+		}
+
+		// The tile must be on disk before the journal says so
+		const size_t tilePixels = (size_t)tile.xRes * tile.yRes;
+		if (SyncRange(canvas, tile.escape, tilePixels * sizeof *(tile.escape)) != 0
+		 || fprintf(canvas->journal, "%u\n", t) < 0 || fflush(canvas->journal) != 0
+		 || fsync(fileno(canvas->journal)) != 0) {
+			fprintf(stderr, "Error: cannot sync canvas tile %u, it will be rendered again if resumed\n", t);
+		}
+		canvas->tileDone[t] = 1;
+	}
+
+	printf("   --- colouring...\n");
+	render->shaderColouring = 0;
+	RecolourMandelbrotCPU(render, image);
+	render->shaderColouring = shaderColouring;
+}
+
+
+
+void CloseCanvas(canvasStruct *canvas, const int remove)
+{
+	fclose(canvas->journal);
+	munmap(canvas->map, canvas->mapSize);
+	close(canvas->fd);
+	free(canvas->tileDone);
+	if (remove) {
+		unlink(canvas->journalFileName);
+		unlink(canvas->fileName);
+	}
+	free(canvas->journalFileName);
+}
+
+
+
+int ResumeCanvas(const char *fileName, imageStruct *settings, const char *outputFileName)
+{
+	// The image is whatever the journal describes
+	canvasStruct canvas;
+	canvas.journalFileName = JournalFileName(fileName);
+	FILE *journal = fopen(canvas.journalFileName, "r");
+	char description[512];
+	if (journal == NULL || fgets(description, sizeof description, journal) == NULL
+	 || ReadCanvasDescription(description, settings) != 0) {
+		fprintf(stderr, "Error: %s is missing, or not a journal of this build's formula\n", canvas.journalFileName);
+		if (journal != NULL) {
+			fclose(journal);
+		}
+		free(canvas.journalFileName);
+		return EXIT_FAILURE;
+	}
+	fclose(journal);
+	free(canvas.journalFileName);
+
+	FILE *out = stdout;
+	if (strcmp(outputFileName, "-") != 0) {
+		out = fopen(outputFileName, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Error: cannot open output %s\n", outputFileName);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// As for animations, the OpenCL renderer needs a window, so the tiles are rendered on the CPU
+#if defined(WITHAVX)
+	void (*RenderMandelbrot)(renderStruct*, imageStruct*) = &RenderMandelbrotAVXCPU;
+#elif defined(WITHGMP)
+	void (*RenderMandelbrot)(renderStruct*, imageStruct*) = &RenderMandelbrotGMPCPU;
+#elif defined(WITHFIXED)
+	void (*RenderMandelbrot)(renderStruct*, imageStruct*) = &RenderMandelbrotFixedCPU;
+#else
+	void (*RenderMandelbrot)(renderStruct*, imageStruct*) = &RenderMandelbrotCPU;
+#endif
+	renderStruct render;
+	render.window = NULL;
+	render.updateTex = 0;
+	render.coordinator = NULL;
+	render.cancel = NULL;
+	render.shaderColouring = 0;
+	settings->histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(settings->histogramCDF));
+	settings->orbits = NULL;
+	settings->orbitIters = 0;
+	settings->expMap = 0;
+
+	int failed = 1;
+	if (OpenCanvas(&canvas, settings, fileName) == 0) {
+		printf("Rendering %u x %u, maxIters %u...\n", settings->xRes, settings->yRes, settings->maxIters);
+		const double startTime = GetWallTime();
+		RenderCanvas(&canvas, &render, settings, RenderMandelbrot);
+		printf("   --- done. Total time: %lfs\n", GetWallTime()-startTime);
+
+		// A row at a time, as the canvas needn't fit in memory
+		const size_t rowBytes = 3*(size_t)settings->xRes;
+		unsigned char *bytes = malloc(rowBytes);
+		failed = (fprintf(out, "P6\n%u %u\n255\n", settings->xRes, settings->yRes) < 0);
+		for (unsigned y = 0; y < settings->yRes && !failed; y++) {
+			const float *row = &(settings->pixels[y*rowBytes]);
+			for (size_t i = 0; i < rowBytes; i++) {
+				bytes[i] = (unsigned char)(255.0f*fminf(1.0f, fmaxf(0.0f, row[i])) + 0.5f);
+			}
+			failed = (fwrite(bytes, 1, rowBytes, out) != rowBytes);
+		}
+		if (fflush(out) != 0 || failed) {
+			fprintf(stderr, "Error: writing %s failed\n", outputFileName);
+			failed = 1;
+		}
+		free(bytes);
+		// Keep the canvas if the image couldn't be saved
+		CloseCanvas(&canvas, !failed);
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(settings->histogramCDF);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+// File-backed canvas for high resolution renders, which can be larger than memory, and resumed if
+// interrupted. See canvas.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mandelbrot.h"
+#include "config.h"
+#include "distributed.h"
+
+// Map a canvas for image (its resolution, view and options) from fileName, creating it, or reopening it
+// and reading its journal if it is from an interrupted render of the same image. The journal of
+// "name.canvas" is "name.journal". fileName must outlive the canvas. Returns 0, or -1 on error.
+int OpenCanvas(canvasStruct *canvas, const imageStruct *image, const char *fileName);
+
+// Render the escape counts of the tiles of image not yet done, into the canvas, with RenderMandelbrot or
+// the render's coordinator, then colour the whole image. image->pixels and image->escape are set to the
+// canvas, and image->histogramCDF is used.
+void RenderCanvas(canvasStruct *canvas, renderStruct *render, imageStruct *image,
+                  void (*RenderMandelbrot)(renderStruct*, imageStruct*));
+
+// Unmap the canvas, and remove its files if remove is 1.
+void CloseCanvas(canvasStruct *canvas, const int remove);
+
+// Finish the interrupted render in canvas fileName, of whatever image its journal describes, on the CPU,
+// and write it to outputFileName ("-" for stdout) as a binary PPM. settings gives the palette. The
+// canvas is removed once the image is written. Returns EXIT_SUCCESS or EXIT_FAILURE.
+int ResumeCanvas(const char *fileName, imageStruct *settings, const char *outputFileName);
@@ -9,6 +9,30 @@
 // Resolution multiplier to use for high-resolution render, to save as bitmap
 #define HIGHRESOLUTIONMULTIPLIER 20
 
+// Frame rate of offline animations (--animate, see animation.c), given in the YUV4MPEG2 header
+#define ANIMATIONFPS 30
+
+// Exponential-map animations (--expmap): angular samples of the log-polar strip per pixel, at the corners of
+// the frame, and the number of rows of the strip rendered at a time
+#define EXPMAPSAMPLING 1.0
+#define EXPMAPBAND 64
+
+// Distributed high resolution renders (--listen, --worker, see distributed.c). Tiles are sized to take
+// about DISTRIBUTEDTILESECONDS at the worker's rate so far (DISTRIBUTEDFIRSTROWS rows until it is known),
+// and also handed to another worker if not back within DISTRIBUTEDTIMEOUTFACTOR times that, or
+// DISTRIBUTEDMINTIMEOUT seconds if longer, doubled for each time the rows were resubmitted before. With
+// no worker to take tiles for DISTRIBUTEDMINTIMEOUT seconds, the coordinator renders them itself.
+#define DISTRIBUTEDTILESECONDS 10.0
+#define DISTRIBUTEDFIRSTROWS 16
+#define DISTRIBUTEDTIMEOUTFACTOR 10.0
+#define DISTRIBUTEDMINTIMEOUT 60.0
+
+// High resolution renders without OpenCL are rendered in tiles of CANVASTILEROWS rows into a canvas file,
+// mapped into memory, and each tile is noted in a journal (highres.journal) once it is on disk. An
+// interrupted render of the same view resumes from the journal. Both files are removed once the image is saved.
+#define CANVASFILENAME "highres.canvas"
+#define CANVASTILEROWS 64
+
 
 // For smooth zoom in and out, the initial number of interpolated frames to render.
 // Auto adjusted to maintain framerate
@@ -25,17 +49,118 @@
 // a drag, and pan the image:
 #define DRAGPIXELS 4
 
+// Without OpenCL, frames of drags and smooth zooms are rendered at a reduced resolution, chosen from the
+// time per pixel of recent frames to take about DYNAMICFRAMETIME seconds, then at full resolution once
+// input stops. DYNAMICMINSCALE is the smallest fraction of the full resolution, in each axis.
+#define DYNAMICFRAMETIME 0.016
+#define DYNAMICMINSCALE 0.125
+
 // Minimum value for max iteration count
 #define MINITERS 60
 
+// Initial value for automatic max iteration count, can be toggled at runtime. A grid of
+// AUTOITERSSAMPLES points across is iterated up to AUTOITERSPROBE iterations, doubling until no more
+// than a fraction AUTOITERSTAIL of the points escape at the higher limits, up to AUTOITERSMAX
+// iterations or AUTOITERSWORK iterations in total. maxIters is then set so that only a fraction
+// AUTOITERSTAIL of the points escape later, from a histogram of escape counts with
+// AUTOITERSBINSPEROCTAVE bins per factor of two.
+#define DEFAULTAUTOITERS 1
+#define AUTOITERSSAMPLES 96
+#define AUTOITERSPROBE 256
+#define AUTOITERSMAX (1<<24)
+#define AUTOITERSWORK 1e9
+#define AUTOITERSTAIL 0.002
+#define AUTOITERSBINSPEROCTAVE 8
+// escape counts up to 2^32
+#define AUTOITERSBINS (32*AUTOITERSBINSPEROCTAVE)
+
 // Initial value for gaussian blur after mandelbrot computation, can be toggled at runtime
-#define DEFAULTGAUSSIANBLUR 1
+#define DEFAULTGAUSSIANBLUR 0
+// Blur stencil: 0 for the 5-point (centre and nearest neighbours) stencil, 3 or 5 for a
+// separable 3x3 or 5x5 gaussian
+#define GAUSSIANBLURSIZE 0
+
+// Initial value for adaptive supersampling, can be toggled at runtime. Pixels whose colour differs
+// from a neighbour's by more than SUPERSAMPLETHRESHOLD (sum over r,g,b) are recomputed as the average
+// of SUPERSAMPLEN x SUPERSAMPLEN jittered samples.
+#define DEFAULTSUPERSAMPLE 1
+#define SUPERSAMPLEN 4
+#define SUPERSAMPLETHRESHOLD 0.1f
 
 // Number of colour steps
 #define DEFAULTCOLOURPERIOD 128
 
-// Test if point is inside cardioid or period-2 bulb, and if so, bail early
+// Colour palette: PALETTESTOPS r,g,b colours equally spaced around the colour cycle, interpolated
+// linearly. Pixels are coloured from a table of PALETTELUTSIZE colours built from these.
+#define PALETTESTOPS 4
+#define PALETTE { 0.0f, 0.0f, 0.0f,  \
+                  0.0f, 0.5f, 1.0f,  \
+                  1.0f, 1.0f, 1.0f,  \
+                  1.0f, 0.5f, 0.0f }
+#define PALETTELUTSIZE 1024
+
+// Initial value for distance estimation, can be toggled at runtime. Pixels are then coloured by their
+// estimated distance to the set (from the derivative dz/dc), from black at the boundary to the middle
+// of the palette DISTANCEWIDTH pixels away, rather than by escape count. Points are iterated until
+// |z|^2 > DISTANCEBAILOUT, as the estimate is poor close to the usual escape radius of 2.
+#define DEFAULTDISTANCEESTIMATION 0
+#define DISTANCEWIDTH 4.0f
+#define DISTANCEBAILOUT 1.0e6
+
+// Initial value for orbit density (Buddhabrot) rendering, can be toggled at runtime. Pixels are then
+// coloured by the density of the orbits of escaping points, ORBITDENSITYSAMPLES of them per pixel, taken
+// from the square |Re|,|Im| < ORBITDENSITYRADIUS. They are chosen by importance: the square is divided into
+// a grid of up to ORBITDENSITYGRID x ORBITDENSITYGRID cells, each probed with ORBITDENSITYPROBES points, and
+// cells are sampled in proportion to the number of their probes' orbit points which land in the view, plus
+// ORBITDENSITYFLOOR times the average, so that every cell is sampled. The grid is made coarser for small
+// renders, so that probing takes no more than ORBITDENSITYPROBEFRACTION of the samples. Samples are taken
+// in batches of ORBITDENSITYBATCH.
+#define DEFAULTORBITDENSITY 0
+#define ORBITDENSITYSAMPLES 4.0
+#define ORBITDENSITYRADIUS 2.0
+#define ORBITDENSITYGRID 256
+#define ORBITDENSITYPROBES 4
+#define ORBITDENSITYFLOOR 0.1
+#define ORBITDENSITYPROBEFRACTION 0.25
+#define ORBITDENSITYBATCH 4096
+
+// Initial value for histogram colouring, can be toggled at runtime. Colours are then chosen by the
+// cumulative distribution of the escape counts of the frame, binned into HISTOGRAMBINS bins, cycling
+// through the gradient HISTOGRAMCYCLES times, rather than every colourPeriod iterations.
+#define DEFAULTHISTOGRAMCOLOURING 0
+#define HISTOGRAMBINS 1024
+#define HISTOGRAMCYCLES 2
+
+// Formula iterated, fixed at compile time: FORMULA_MANDELBROT (z^2 + c), FORMULA_MULTIBROT
+// (z^MULTIBROTPOWER + c), FORMULA_BURNINGSHIP ((|Re z| + i|Im z|)^2 + c) or FORMULA_JULIA (the Julia set
+// of z^2 + JULIARE + i*JULIAIM). See formula.h. Override with eg. -DFORMULA=FORMULA_JULIA.
+#ifndef FORMULA
+	#define FORMULA FORMULA_MANDELBROT
+#endif
+#ifndef MULTIBROTPOWER
+	#define MULTIBROTPOWER 3
+#endif
+#ifndef JULIARE
+	#define JULIARE -0.8
+#endif
+#ifndef JULIAIM
+	#define JULIAIM 0.156
+#endif
+
+// Test if point is inside cardioid, period-2 bulb, or one of the larger period-3 and period-4 bulbs,
+// and if so, bail early
 #define EARLYBAIL 1
+// Discs inside the period-3 and period-4 bulbs used by the test: centre (x, +-y) and radius squared.
+// The centres are the bulbs' nuclei; the radii are small enough that the whole disc is inside.
+#define BULB3X -0.12256116687665361
+#define BULB3Y 0.74486176661974423
+#define BULB3RSQ 0.0081
+#define BULB4X -1.3107026413368328
+#define BULB4Y 0.0
+#define BULB4RSQ 0.003136
+#define BULB4BX 0.28227139076691394
+#define BULB4BY 0.53006061757852529
+#define BULB4BRSQ 0.001681
 
 
 // // GMP
@@ -43,8 +168,40 @@
 #define GMPPRECISION 256
 
 
+// // AVX
+// Number of independent vectors the AVX kernel iterates together, hiding the latency of the chain of
+// dependent mul/adds in each iteration. Chosen for the target (-march) at compile time, by the number
+// of vector registers it has: with 16, more than 2 spill; override with -DAVXINTERLEAVE=n (at most 8).
+#ifndef AVXINTERLEAVE
+	#if defined(__AVX512F__)
+		#define AVXINTERLEAVE 4
+	#else
+		#define AVXINTERLEAVE 2
+	#endif
+#endif
+// Iterations each pixel is first given in a plain vector loop, before the ones still going are queued for
+// the refilling lanes
+#define AVXSHORTITERS 16
+
+
 // // OpenCL
 // workgroup size:
 #define OPENCLLOCALSIZE 64
 // attempt opengl opencl interop?
 #define TRYINTEROP 1
+// Devices without cl_khr_fp64 use a float-float (emulated double) kernel. Uncomment to use it always.
+//#define OPENCLFORCEEMULATEDOUBLE 1
+// Uncomment to use the persistent-threads render kernel, which balances work dynamically between
+// work-items. It hasn't been benchmarked against the one pixel per work-item kernel, so is off.
+//#define OPENCLPERSISTENT 1
+// work-groups launched per compute unit by the persistent-threads kernel
+#define OPENCLPERSISTENTGROUPS 4
+// number of pixels a work-item takes from the work queue at once
+#define OPENCLPERSISTENTBATCH 4
+// iterations between checks for finished pixels
+#define OPENCLPERSISTENTSTEPS 32
+// number of work-groups, each with its own histogram in local memory, used for histogram colouring
+#define OPENCLHISTOGRAMGROUPS 64
+// number of density buffers in global memory for orbit density renders, each shared by a share of the
+// work-groups, which add to it atomically, and then merged. Fewer are used if they don't fit.
+#define OPENCLORBITDENSITYBUFFERS 8
@@ -0,0 +1,682 @@
+#include "distributed.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// The coordinator listens, and workers connect to it, so workers can be started and stopped at any time.
+// Messages are arrays of doubles, in the hosts' native byte order (which must therefore match):
+//
+//  - worker -> coordinator, on connecting: HELLOLEN doubles, DISTRIBUTEDMAGIC and the formula it was
+//    built for, which must be the coordinator's.
+//  - coordinator -> worker: a tile, JOBLEN doubles. The tile is a band of rows of the image, and the
+//    message gives its view and options.
+//  - worker -> coordinator: RESULTLEN doubles, the tile's job number, first row and number of rows,
+//    then its escape counts, as floats.
+//
+// The coordinator sizes each worker's tiles by its throughput so far, so that fast and slow workers
+// all return tiles every DISTRIBUTEDTILESECONDS or so, and shares out what is left near the end. Tiles of
+// workers which disconnect are handed to other workers. So are tiles which take much longer than
+// expected, but their worker keeps rendering them, and whichever copy is back first is used. If no worker
+// can take tiles for a while, the coordinator renders them itself.
+//
+// Workers return escape counts rather than colours, and the caller colours the whole image at once, so
+// that histogram colouring, supersampling and blur don't change from one tile to the next.
+
+#define DISTRIBUTEDMAGIC 1296195380.0
+#define HELLOLEN 5
+#define JOBLEN 13
+#define RESULTLEN 3
+
+
+// Rows of the image not yet handed out, as a stack of ranges: a resubmitted tile goes on top, so that it
+// is handed out next.
+typedef struct {
+	unsigned *ranges;	// first row, number of rows, and the times they have been resubmitted
+	int n;
+	int allocated;
+	unsigned rows;
+} pendingStruct;
+
+
+
+static void PushRows(pendingStruct *pending, const unsigned rowStart, const unsigned rows,
+                     const unsigned resubmissions)
+{
+	if (pending->n == pending->allocated) {
+		pending->allocated = (pending->allocated == 0) ? 16 : 2*pending->allocated;
+		pending->ranges = realloc(pending->ranges, 3*pending->allocated * sizeof *(pending->ranges));
+	}
+	pending->ranges[3*pending->n+0] = rowStart;
+	pending->ranges[3*pending->n+1] = rows;
+	pending->ranges[3*pending->n+2] = resubmissions;
+	pending->n++;
+	pending->rows += rows;
+}
+
+
+
+// Take up to maxRows consecutive rows from the top of pending, skipping rows which are done (by the
+// worker of a tile which was resubmitted). Sets *rowStart and *resubmissions, and returns the number of
+// rows, or 0 if there are none left.
+static unsigned TakeRows(pendingStruct *pending, const unsigned char *rowDone, const unsigned maxRows,
+                         unsigned *rowStart, unsigned *resubmissions)
+{
+	while (pending->n > 0) {
+		unsigned *top = &(pending->ranges[3*(pending->n-1)]);
+		while (top[1] > 0 && rowDone[top[0]]) {
+			top[0]++;
+			top[1]--;
+			pending->rows--;
+		}
+		unsigned rows = 0;
+		while (rows < maxRows && rows < top[1] && !rowDone[top[0]+rows]) {
+			rows++;
+		}
+		*rowStart = top[0];
+		*resubmissions = top[2];
+		top[0] += rows;
+		top[1] -= rows;
+		pending->rows -= rows;
+		if (top[1] == 0) {
+			pending->n--;
+		}
+		if (rows > 0) {
+			return rows;
+		}
+	}
+	return 0;
+}
+
+
+
+// As for animations, tiles are always rendered on the CPU
+static void RenderTileCPU(renderStruct *render, imageStruct *image)
+{
+#if defined(WITHAVX)
+	RenderMandelbrotAVXCPU(render, image);
+#elif defined(WITHGMP)
+	RenderMandelbrotGMPCPU(render, image);
+#elif defined(WITHFIXED)
+	RenderMandelbrotFixedCPU(render, image);
+#else
+	RenderMandelbrotCPU(render, image);
+#endif
+}
+
+
+
+// A render of escape counts only, off screen and uncancelled, for tiles
+static void InitialiseTileRender(renderStruct *render)
+{
+	render->window = NULL;
+	render->updateTex = 0;
+	render->coordinator = NULL;
+	render->cancel = NULL;
+	render->shaderColouring = 1;
+}
+
+
+
+// Render the escape counts of rows rowStart to rowStart+rows-1 of image here, into image->escape
+static void RenderRowsHere(const imageStruct *image, const unsigned rowStart, const unsigned rows)
+{
+	renderStruct render;
+	InitialiseTileRender(&render);
+
+	imageStruct tile = *image;
+	CropRows(&tile, rowStart, rows);
+	tile.escape = &(image->escape[(size_t)rowStart*image->xRes]);
+	tile.pixels = NULL;
+	tile.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(tile.histogramCDF));
+	tile.orbits = NULL;
+	tile.orbitIters = 0;
+	RenderTileCPU(&render, &tile);
+	free(tile.histogramCDF);
+}
+
+
+
+// Open a socket listening at, or connected to, address. Returns the socket, or -1 on error.
+static int OpenSocket(const char *address, const int listening)
+{
+	int fd = -1;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		if (strlen(address+5) < sizeof addr.sun_path) {
+			strcpy(addr.sun_path, address+5);
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		}
+		if (fd >= 0 && listening) {
+			// a socket left by an earlier coordinator
+			unlink(addr.sun_path);
+		}
+		if (fd >= 0 && (listening ? (bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, SOMAXCONN) != 0)
+		                          : connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	else {
+		// host:port. Split at the last colon, and allow [] around IPv6 addresses.
+		const char *colon = strrchr(address, ':');
+		char host[256];
+		size_t hostLen = (colon == NULL) ? 0 : (size_t)(colon - address);
+		const char *hostStart = address;
+		if (hostLen >= 2 && address[0] == '[' && address[hostLen-1] == ']') {
+			hostStart++;
+			hostLen -= 2;
+		}
+		struct addrinfo *result = NULL;
+		if (colon != NULL && hostLen < sizeof host) {
+			memcpy(host, hostStart, hostLen);
+			host[hostLen] = '\0';
+			struct addrinfo hints;
+			memset(&hints, 0, sizeof hints);
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = listening ? AI_PASSIVE : 0;
+			const int err = getaddrinfo((hostLen > 0) ? host : NULL, colon+1, &hints, &result);
+			if (err != 0) {
+				fprintf(stderr, "Error: %s: %s\n", address, gai_strerror(err));
+				result = NULL;
+			}
+		}
+
+		for (struct addrinfo *ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0) {
+				continue;
+			}
+			const int one = 1;
+			if (listening) {
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+			}
+			else {
+				// results are sent as a header then the escape counts: don't let them wait for an ack
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+			}
+			if (listening ? (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0)
+			              : connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (result != NULL) {
+			freeaddrinfo(result);
+		}
+	}
+
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot %s %s\n", listening ? "listen on" : "connect to", address);
+	}
+	return fd;
+}
+
+
+
+// Read n bytes. Returns 0, 1 at end of file before any were read, or -1 on error.
+static int ReadAll(const int fd, void *buffer, const size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		const ssize_t r = read(fd, (char*)buffer + done, n - done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return (r == 0 && done == 0) ? 1 : -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+
+
+// Write n bytes. Returns 0, or -1 on error.
+static int WriteAll(const int fd, const void *buffer, const size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		const ssize_t w = write(fd, (const char*)buffer + done, n - done);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		}
+		if (w <= 0) {
+			return -1;
+		}
+		done += w;
+	}
+	return 0;
+}
+
+
+
+int OpenCoordinator(coordinatorStruct *coordinator, const char *address)
+{
+	// a worker which goes away would otherwise kill us when we next send to it
+	signal(SIGPIPE, SIG_IGN);
+
+	coordinator->listenFd = OpenSocket(address, 1);
+	coordinator->nWorkers = 0;
+	coordinator->workers = NULL;
+	coordinator->nextJob = 0;
+	if (coordinator->listenFd < 0) {
+		return -1;
+	}
+	printf("Listening for workers on %s\n", address);
+	return 0;
+}
+
+
+
+void CloseCoordinator(coordinatorStruct *coordinator)
+{
+	for (int i = 0; i < coordinator->nWorkers; i++) {
+		close(coordinator->workers[i].fd);
+	}
+	close(coordinator->listenFd);
+	free(coordinator->workers);
+	coordinator->nWorkers = 0;
+	coordinator->workers = NULL;
+}
+
+
+
+// Close the connection to worker i and forget it, resubmitting its tile (unless it already has been).
+static void DropWorker(coordinatorStruct *coordinator, const int i, pendingStruct *pending)
+{
+	workerStruct *w = &(coordinator->workers[i]);
+	close(w->fd);
+	if (w->state == WORKERBUSY && !w->overdue) {
+		PushRows(pending, w->rowStart, w->rows, w->resubmissions);
+	}
+	coordinator->nWorkers--;
+	memmove(w, w+1, (coordinator->nWorkers - i) * sizeof *w);
+}
+
+
+
+// 1 if worker w's tile is of this image, whose first job was firstJob, rather than a late one of an
+// earlier image, whose rows may not even be in this one
+static int CurrentTile(const workerStruct *w, const unsigned firstJob, const unsigned yRes)
+{
+	return w->job >= firstJob && w->rowStart < yRes && w->rows <= yRes - w->rowStart;
+}
+
+
+
+// Receive what has arrived from a worker: the tile's escape counts go straight into escape, unless it
+// isn't a tile of this image, when they are thrown away. Returns 1 when its hello or a tile is complete,
+// 0 if it is not yet, or -1 on error or if the worker has gone away.
+static int ReceiveFromWorker(workerStruct *w, float *escape, const unsigned xRes, const unsigned yRes,
+                             const unsigned firstJob)
+{
+	if (w->state == WORKERIDLE) {
+		return -1;
+	}
+	const size_t headerBytes = ((w->state == WORKERHELLO) ? HELLOLEN : RESULTLEN) * sizeof(double);
+	const size_t tileBytes = (w->state == WORKERHELLO) ? 0 : (size_t)w->rows*xRes * sizeof *escape;
+
+	char *buffer;
+	size_t n;
+	char discard[4096];
+	if (w->received < headerBytes) {
+		buffer = (char*)(w->header) + w->received;
+		n = headerBytes - w->received;
+	}
+	else if (CurrentTile(w, firstJob, yRes)) {
+		buffer = (char*)&(escape[(size_t)w->rowStart*xRes]) + (w->received - headerBytes);
+		n = headerBytes + tileBytes - w->received;
+	}
+	else {
+		buffer = discard;
+		n = headerBytes + tileBytes - w->received;
+		n = (n < sizeof discard) ? n : sizeof discard;
+	}
+	const ssize_t r = read(w->fd, buffer, n);
+	if (r <= 0) {
+		return (r < 0 && errno == EINTR) ? 0 : -1;
+	}
+	w->received += r;
+
+	if (w->received == headerBytes) {
+		if (w->state == WORKERHELLO) {
+			if (w->header[0] != DISTRIBUTEDMAGIC || w->header[1] != FORMULA || w->header[2] != MULTIBROTPOWER
+			 || w->header[3] != JULIARE || w->header[4] != JULIAIM) {
+				fprintf(stderr, "Error: worker is not built for this formula, or has a different byte order\n");
+				return -1;
+			}
+			return 1;
+		}
+		if (w->header[0] != w->job || w->header[1] != w->rowStart || w->header[2] != w->rows) {
+			fprintf(stderr, "Error: worker returned the wrong tile\n");
+			return -1;
+		}
+	}
+	return (w->received == headerBytes + tileBytes) ? 1 : 0;
+}
+
+
+
+void RenderDistributed(coordinatorStruct *coordinator, imageStruct *image)
+{
+	const unsigned xRes = image->xRes;
+	const unsigned yRes = image->yRes;
+	pendingStruct pending = {NULL, 0, 0, 0};
+	PushRows(&pending, 0, yRes, 0);
+	// A row is done once the first copy of its tile is back
+	unsigned char *rowDone = calloc(yRes, sizeof *rowDone);
+	// Workers still rendering overdue tiles of an earlier image are neither waited for nor resubmitted, and
+	// their tiles are thrown away when they come
+	const unsigned firstJob = coordinator->nextJob;
+	for (int i = 0; i < coordinator->nWorkers; i++) {
+		coordinator->workers[i].overdue |= (coordinator->workers[i].state == WORKERBUSY);
+	}
+	unsigned rowsDone = 0;
+	int waiting = 0;
+	const double startTime = GetWallTime();
+	// Since when no worker has been able to take tiles, and the coordinator's own rate
+	double aloneSince = startTime;
+	double localRate = 0.0;
+	struct pollfd *fds = NULL;
+
+	while (rowsDone < yRes) {
+		double now = GetWallTime();
+
+		// Hand overdue tiles to other workers too. Each resubmission doubles the time allowed.
+		for (int i = 0; i < coordinator->nWorkers; i++) {
+			workerStruct *w = &(coordinator->workers[i]);
+			if (w->state == WORKERBUSY && !w->overdue && now > w->deadline) {
+				printf("   --- worker is overdue, resubmitting rows %u-%u\n", w->rowStart, w->rowStart+w->rows-1);
+				PushRows(&pending, w->rowStart, w->rows, w->resubmissions+1);
+				w->overdue = 1;
+			}
+		}
+
+		// Hand out tiles to idle workers
+		for (int i = coordinator->nWorkers-1; i >= 0 && pending.rows > 0; i--) {
+			workerStruct *w = &(coordinator->workers[i]);
+			if (w->state != WORKERIDLE) {
+				continue;
+			}
+
+			// About DISTRIBUTEDTILESECONDS of work, but no more than half of each worker's share of what
+			// is left, so that they finish together
+			unsigned rows = DISTRIBUTEDFIRSTROWS;
+			if (w->rate > 0.0) {
+				rows = (unsigned)fmax(1.0, w->rate*DISTRIBUTEDTILESECONDS/xRes);
+			}
+			const unsigned share = (pending.rows + 2*coordinator->nWorkers - 1)/(2*coordinator->nWorkers);
+			rows = TakeRows(&pending, rowDone, (rows < share) ? rows : share, &(w->rowStart), &(w->resubmissions));
+			if (rows == 0) {
+				break;
+			}
+
+			w->job = coordinator->nextJob++;
+			w->rows = rows;
+			w->startTime = now;
+			w->deadline = now + ldexp(fmax(DISTRIBUTEDMINTIMEOUT,
+			                               (w->rate > 0.0) ? DISTRIBUTEDTIMEOUTFACTOR*rows*xRes/w->rate : 0.0),
+			                          (int)w->resubmissions);
+			w->received = 0;
+			w->overdue = 0;
+			w->state = WORKERBUSY;
+
+			// The tile's view: rows rowStart to rowStart+rows-1 of the image
+			imageStruct tile = *image;
+			CropRows(&tile, w->rowStart, rows);
+			const double job[JOBLEN] = {w->job, w->rowStart, rows, xRes, image->maxIters, image->distanceEstimation,
+			                            tile.xCentre, tile.xCentreLo, tile.yCentre, tile.yCentreLo,
+			                            tile.xStep, tile.yStep, image->orbitDensity};
+			if (WriteAll(w->fd, job, sizeof job) != 0) {
+				DropWorker(coordinator, i, &pending);
+			}
+		}
+
+		// With no worker to take tiles for DISTRIBUTEDMINTIMEOUT seconds, render one here. Workers which
+		// connect meanwhile are seen to once it is done.
+		int available = 0, renderedHere = 0;
+		for (int i = 0; i < coordinator->nWorkers; i++) {
+			const workerStruct *w = &(coordinator->workers[i]);
+			available |= (w->state == WORKERIDLE || (w->state == WORKERBUSY && !w->overdue));
+		}
+		if (available) {
+			aloneSince = now;
+			waiting = 0;
+		}
+		else if (now - aloneSince > DISTRIBUTEDMINTIMEOUT && pending.rows > 0) {
+			const unsigned maxRows = (localRate > 0.0) ? (unsigned)fmax(1.0, localRate*DISTRIBUTEDTILESECONDS/xRes)
+			                                           : DISTRIBUTEDFIRSTROWS;
+			unsigned rowStart, resubmissions;
+			const unsigned rows = TakeRows(&pending, rowDone, maxRows, &rowStart, &resubmissions);
+			if (rows > 0) {
+				const double tileStart = GetWallTime();
+				RenderRowsHere(image, rowStart, rows);
+				localRate = (double)rows*xRes/(GetWallTime() - tileStart);
+				renderedHere = 1;
+				for (unsigned row = rowStart; row < rowStart+rows; row++) {
+					rowsDone += !rowDone[row];
+					rowDone[row] = 1;
+				}
+				printf("   --- rows %u-%u done here, %u/%u, %.1lfs\n", rowStart, rowStart+rows-1,
+				       rowsDone, yRes, GetWallTime() - startTime);
+			}
+		}
+		else if (!waiting) {
+			printf("   --- waiting for workers, rendering here after %.0lfs...\n", DISTRIBUTEDMINTIMEOUT);
+			waiting = 1;
+		}
+
+		// Wait for new workers, and results
+		fds = realloc(fds, (coordinator->nWorkers+1) * sizeof *fds);
+		fds[0].fd = coordinator->listenFd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < coordinator->nWorkers; i++) {
+			fds[i+1].fd = coordinator->workers[i].fd;
+			fds[i+1].events = POLLIN;
+		}
+		const int nFds = coordinator->nWorkers+1;
+		if (poll(fds, nFds, renderedHere ? 0 : 1000) <= 0) {
+			continue;
+		}
+		now = GetWallTime();
+
+		for (int i = nFds-2; i >= 0; i--) {
+			if (!(fds[i+1].revents & (POLLIN|POLLHUP|POLLERR))) {
+				continue;
+			}
+			workerStruct *w = &(coordinator->workers[i]);
+			const int r = ReceiveFromWorker(w, image->escape, xRes, yRes, firstJob);
+			if (r < 0) {
+				if (w->state == WORKERBUSY && !w->overdue) {
+					printf("   --- worker went away, resubmitting rows %u-%u\n", w->rowStart, w->rowStart+w->rows-1);
+				}
+				DropWorker(coordinator, i, &pending);
+			}
+			else if (r == 1 && w->state == WORKERHELLO) {
+				w->state = WORKERIDLE;
+				printf("   --- worker connected\n");
+			}
+			else if (r == 1 && !CurrentTile(w, firstJob, yRes)) {
+				w->state = WORKERIDLE;
+				printf("   --- late tile of an earlier image thrown away\n");
+			}
+			else if (r == 1) {
+				// A late tile lowers the worker's rate, and so the size of its next tiles
+				const double rate = (double)w->rows*xRes/(now - w->startTime);
+				w->rate = (w->rate > 0.0) ? 0.5*(w->rate + rate) : rate;
+				w->state = WORKERIDLE;
+				for (unsigned row = w->rowStart; row < w->rowStart+w->rows; row++) {
+					rowsDone += !rowDone[row];
+					rowDone[row] = 1;
+				}
+				printf("   --- rows %u-%u done, %u/%u, %d workers, %.1lfs\n", w->rowStart, w->rowStart+w->rows-1,
+				       rowsDone, yRes, coordinator->nWorkers, now - startTime);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			const int fd = accept(coordinator->listenFd, NULL, NULL);
+			if (fd >= 0) {
+				const int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+				coordinator->workers = realloc(coordinator->workers,
+				                               (coordinator->nWorkers+1) * sizeof *(coordinator->workers));
+				workerStruct *w = &(coordinator->workers[coordinator->nWorkers++]);
+				memset(w, 0, sizeof *w);
+				w->fd = fd;
+				w->state = WORKERHELLO;
+			}
+		}
+	}
+
+	free(fds);
+	free(pending.ranges);
+	free(rowDone);
+}
+
+
+
+int RunCoordinator(const char *address, imageStruct *image, const char *outputFileName)
+{
+	coordinatorStruct coordinator;
+	if (OpenCoordinator(&coordinator, address) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	FILE *out = stdout;
+	if (strcmp(outputFileName, "-") != 0) {
+		out = fopen(outputFileName, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Error: cannot open output %s\n", outputFileName);
+			CloseCoordinator(&coordinator);
+			return EXIT_FAILURE;
+		}
+	}
+
+	const size_t nPixels = (size_t)image->xRes * image->yRes;
+	image->pixels = malloc(3*nPixels * sizeof *(image->pixels));
+	image->escape = malloc(nPixels * sizeof *(image->escape));
+	image->histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(image->histogramCDF));
+	unsigned char *bytes = malloc(3*nPixels);
+
+	printf("Rendering %u x %u, maxIters %u...\n", image->xRes, image->yRes, image->maxIters);
+	const double startTime = GetWallTime();
+	RenderDistributed(&coordinator, image);
+	CloseCoordinator(&coordinator);
+	renderStruct render;
+	InitialiseTileRender(&render);
+	render.shaderColouring = 0;
+	RecolourMandelbrotCPU(&render, image);
+	printf("   --- done. Total time: %lfs\n", GetWallTime()-startTime);
+
+	for (size_t i = 0; i < 3*nPixels; i++) {
+		bytes[i] = (unsigned char)(255.0f*fminf(1.0f, fmaxf(0.0f, image->pixels[i])) + 0.5f);
+	}
+	// rows in the same order as on screen, and in the 'h' render
+	int failed = (fprintf(out, "P6\n%u %u\n255\n", image->xRes, image->yRes) < 0)
+	          || (fwrite(bytes, 1, 3*nPixels, out) != 3*nPixels);
+	if (fflush(out) != 0 || failed) {
+		fprintf(stderr, "Error: writing %s failed\n", outputFileName);
+		failed = 1;
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(image->pixels);
+	free(image->escape);
+	free(image->histogramCDF);
+	free(bytes);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+int RunWorker(const char *address, const imageStruct *settings)
+{
+	// let failed writes to a closed connection return an error, rather than killing us
+	signal(SIGPIPE, SIG_IGN);
+
+	const int fd = OpenSocket(address, 0);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+	const double hello[HELLOLEN] = {DISTRIBUTEDMAGIC, FORMULA, MULTIBROTPOWER, JULIARE, JULIAIM};
+	if (WriteAll(fd, hello, sizeof hello) != 0) {
+		fprintf(stderr, "Error: cannot send to %s\n", address);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Connected to %s, waiting for tiles...\n", address);
+
+	renderStruct render;
+	InitialiseTileRender(&render);
+	imageStruct image = *settings;
+	image.pixels = NULL;
+	image.escape = NULL;
+	image.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(image.histogramCDF));
+	size_t allocated = 0;
+
+	int status;
+	double job[JOBLEN];
+	while ((status = ReadAll(fd, job, sizeof job)) == 0) {
+		if (!(job[2] >= 1.0 && job[3] >= 1.0 && job[2]*job[3] < 1e12)) {
+			fprintf(stderr, "Error: bad tile from %s\n", address);
+			status = -1;
+			break;
+		}
+		image.yRes = (unsigned)job[2];
+		image.xRes = (unsigned)job[3];
+		image.maxIters = (unsigned)job[4];
+		image.distanceEstimation = (int)job[5];
+		image.xCentre = job[6];
+		image.xCentreLo = job[7];
+		image.yCentre = job[8];
+		image.yCentreLo = job[9];
+		image.xStep = job[10];
+		image.yStep = job[11];
+		image.orbitDensity = (int)job[12];
+		image.expMap = 0;
+
+		const size_t nPixels = (size_t)image.xRes * image.yRes;
+		if (nPixels > allocated) {
+			free(image.escape);
+			image.escape = malloc(nPixels * sizeof *(image.escape));
+			allocated = nPixels;
+		}
+
+		const double startTime = GetWallTime();
+		RenderTileCPU(&render, &image);
+
+		const double result[RESULTLEN] = {job[0], job[1], job[2]};
+		if (WriteAll(fd, result, sizeof result) != 0
+		 || WriteAll(fd, image.escape, nPixels * sizeof *(image.escape)) != 0) {
+			fprintf(stderr, "Error: cannot send to %s\n", address);
+			status = -1;
+			break;
+		}
+		fprintf(stderr, "   --- rows %.0lf-%.0lf, %.2lfs\n", job[1], job[1]+job[2]-1.0, GetWallTime()-startTime);
+	}
+	if (status == 1) {
+		fprintf(stderr, "Coordinator closed the connection.\n");
+	}
+
+	close(fd);
+	free(image.escape);
+	free(image.histogramCDF);
+	return (status == 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
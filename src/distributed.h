@@ -0,0 +1,34 @@
+// Distributed high resolution renders: a coordinator hands out tiles of the image to worker processes,
+// over TCP or Unix sockets, on this or other hosts. See distributed.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mandelbrot.h"
+#include "config.h"
+
+// workerStruct states: waiting for its hello message, idle, or rendering a tile
+#define WORKERHELLO 0
+#define WORKERIDLE 1
+#define WORKERBUSY 2
+
+// Listen for workers at address, "host:port" (host may be empty, for all interfaces) or "unix:path".
+// Returns 0, or -1 on error.
+int OpenCoordinator(coordinatorStruct *coordinator, const char *address);
+
+// Render image->pixels, xRes*yRes*3 floats, in tiles rendered by the coordinator's workers. Workers can
+// connect or go away at any time. Returns when the image is complete.
+void RenderDistributed(coordinatorStruct *coordinator, imageStruct *image);
+
+// Close the connections to the workers, which then exit.
+void CloseCoordinator(coordinatorStruct *coordinator);
+
+// Render the view in image with workers connecting to address, and write it to outputFileName ("-" for
+// stdout) as a binary PPM. Returns EXIT_SUCCESS or EXIT_FAILURE.
+int RunCoordinator(const char *address, imageStruct *image, const char *outputFileName);
+
+// Connect to the coordinator at address, and render tiles for it until it closes the connection.
+// settings gives the palette. Returns EXIT_SUCCESS or EXIT_FAILURE.
+int RunWorker(const char *address, const imageStruct *settings);
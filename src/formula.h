@@ -0,0 +1,308 @@
+#ifndef FORMULA_H
+#define FORMULA_H
+
+// The iteration z -> f(z) + c, for each formula and each back end. The formula is fixed at compile time
+// by FORMULA (see config.h), so the inner loops never branch on it. This file is included by both the
+// host code and the OpenCL kernel; the host passes the formula to the kernel build as -D options.
+//
+// Each formula defines:
+//  - FORMULA_POWER: the degree of f, for smoothing escape counts.
+//  - FORMULA_Z0(p, zero), FORMULA_C(p, julia): initial z and parameter c for the point p of the plane.
+//    For the Mandelbrot family z0 = zero and c = p; for Julia sets z0 = p and c is fixed.
+//  - FORMULA_DZ0, FORMULA_DC: initial derivative, and the constant added to it each iteration. The
+//    derivative is dz/dc for the Mandelbrot family, dz/dz0 for Julia sets.
+//  - FORMULA_STEP(u, v, uSq, vSq, cRe, cIm): one iteration in double precision, of z = u + i*v, also
+//    updating the squares uSq, vSq.
+//  - FORMULA_DSTEP(type, u, v, du, dv): one iteration of the derivative du + i*dv, of the given type,
+//    from z before it is updated.
+//  - FORMULA_STEP_AVX(vu, vv, vuSq, vvSq, vuv, vcRe, vcIm), FORMULA_DSTEP_AVX(vu, vv, vdu, vdv): as
+//    above for 4 doubles; vuv = u*v is also kept up to date.
+//  - FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm): float-float version, for the OpenCL kernel.
+//  - FORMULA_STEP_GMP(mu, mv, muSq, mvSq, mcRe, mcIm, t1, t2, t3, t4): multiple precision version, with
+//    four temporaries.
+//  - FORMULA_STEP_FIXED(u, v, uSq, vSq, cRe, cIm): 128 bit fixed point version, with FixedMul. It leaves
+//    the squares to the caller, which only takes them while |u|,|v| <= 2, as they could overflow.
+//  - FORMULA_FIXEDBITS: the fractional bits of the fixed point numbers. The rest must hold the sign and
+//    integer part of f(z) + c and its intermediate values, for |z| <= 2.
+//
+// Only the Mandelbrot set has the cardioid and bulb tests, so EARLYBAIL is undefined for the others.
+
+#define FORMULA_MANDELBROT 0
+#define FORMULA_MULTIBROT 1
+#define FORMULA_BURNINGSHIP 2
+#define FORMULA_JULIA 3
+
+
+
+#if FORMULA == FORMULA_MANDELBROT || FORMULA == FORMULA_JULIA
+// z^2 + c
+#define FORMULA_POWER 2
+
+#define FORMULA_STEP(u, v, uSq, vSq, cRe, cIm) do { \
+	const double uNew_ = (uSq)-(vSq) + (cRe); \
+	(v) = 2.0*(u)*(v) + (cIm); \
+	(u) = uNew_; \
+	(uSq) = (u)*(u); \
+	(vSq) = (v)*(v); \
+} while (0)
+
+#define FORMULA_DSTEP(type, u, v, du, dv) do { \
+	const type re_ = (u)*(du) - (v)*(dv); \
+	const type im_ = (u)*(dv) + (v)*(du); \
+	(du) = re_ + re_ + FORMULA_DC; \
+	(dv) = im_ + im_; \
+} while (0)
+
+#define FORMULA_STEP_AVX(vu, vv, vuSq, vvSq, vuv, vcRe, vcIm) do { \
+	(vv) = _mm256_add_pd(_mm256_add_pd((vuv), (vuv)), (vcIm)); \
+	(vu) = _mm256_add_pd(_mm256_sub_pd((vuSq), (vvSq)), (vcRe)); \
+	(vuSq) = _mm256_mul_pd((vu), (vu)); \
+	(vvSq) = _mm256_mul_pd((vv), (vv)); \
+	(vuv) = _mm256_mul_pd((vu), (vv)); \
+} while (0)
+
+#define FORMULA_DSTEP_AVX(vu, vv, vdu, vdv) do { \
+	const __m256d vre_ = _mm256_sub_pd(_mm256_mul_pd((vu), (vdu)), _mm256_mul_pd((vv), (vdv))); \
+	const __m256d vim_ = _mm256_add_pd(_mm256_mul_pd((vu), (vdv)), _mm256_mul_pd((vv), (vdu))); \
+	(vdu) = _mm256_add_pd(_mm256_add_pd(vre_, vre_), _mm256_set1_pd(FORMULA_DC)); \
+	(vdv) = _mm256_add_pd(vim_, vim_); \
+} while (0)
+
+// multiplication by 2 is exact
+#define FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm) do { \
+	const float2 uNew_ = FFAdd(FFSub((uSq), (vSq)), (cRe)); \
+	(v) = FFAdd(FFMulF(FFMul((u), (v)), 2.0f), (cIm)); \
+	(u) = uNew_; \
+	(uSq) = FFSqr(u); \
+	(vSq) = FFSqr(v); \
+} while (0)
+
+#define FORMULA_STEP_GMP(mu, mv, muSq, mvSq, mcRe, mcIm, t1, t2, t3, t4) do { \
+	mpf_sub((t1), (muSq), (mvSq)); \
+	mpf_add((t1), (t1), (mcRe)); \
+	mpf_mul((t2), (mu), (mv)); \
+	mpf_mul_2exp((t2), (t2), 1); \
+	mpf_add((mv), (t2), (mcIm)); \
+	mpf_set((mu), (t1)); \
+	mpf_mul((muSq), (mu), (mu)); \
+	mpf_mul((mvSq), (mv), (mv)); \
+} while (0)
+
+// |f(z) + c| < 8, so 4.124: a sign bit and 3 integer bits
+#define FORMULA_FIXEDBITS 124
+
+#define FORMULA_STEP_FIXED(u, v, uSq, vSq, cRe, cIm) do { \
+	const fixedPoint uNew_ = (uSq)-(vSq) + (cRe); \
+	(v) = 2*FixedMul((u), (v)) + (cIm); \
+	(u) = uNew_; \
+} while (0)
+
+
+
+#elif FORMULA == FORMULA_MULTIBROT
+// z^MULTIBROTPOWER + c, for MULTIBROTPOWER >= 2. The powers are computed by repeated multiplication,
+// starting from z^2 which the squares give us, in loops of fixed length which the compiler unrolls.
+#define FORMULA_POWER MULTIBROTPOWER
+
+#define FORMULA_STEP(u, v, uSq, vSq, cRe, cIm) do { \
+	double pu_ = (uSq)-(vSq), pv_ = 2.0*(u)*(v); \
+	for (int k_ = 2; k_ < MULTIBROTPOWER; k_++) { \
+		const double t_ = pu_*(u) - pv_*(v); \
+		pv_ = pu_*(v) + pv_*(u); \
+		pu_ = t_; \
+	} \
+	(u) = pu_ + (cRe); \
+	(v) = pv_ + (cIm); \
+	(uSq) = (u)*(u); \
+	(vSq) = (v)*(v); \
+} while (0)
+
+// dz = MULTIBROTPOWER * z^(MULTIBROTPOWER-1) * dz + FORMULA_DC
+#define FORMULA_DSTEP(type, u, v, du, dv) do { \
+	type pu_ = 1, pv_ = 0; \
+	for (int k_ = 1; k_ < MULTIBROTPOWER; k_++) { \
+		const type t_ = pu_*(u) - pv_*(v); \
+		pv_ = pu_*(v) + pv_*(u); \
+		pu_ = t_; \
+	} \
+	const type re_ = pu_*(du) - pv_*(dv); \
+	const type im_ = pu_*(dv) + pv_*(du); \
+	(du) = MULTIBROTPOWER*re_ + FORMULA_DC; \
+	(dv) = MULTIBROTPOWER*im_; \
+} while (0)
+
+#define FORMULA_STEP_AVX(vu, vv, vuSq, vvSq, vuv, vcRe, vcIm) do { \
+	__m256d vpu_ = _mm256_sub_pd((vuSq), (vvSq)), vpv_ = _mm256_add_pd((vuv), (vuv)); \
+	for (int k_ = 2; k_ < MULTIBROTPOWER; k_++) { \
+		const __m256d vt_ = _mm256_sub_pd(_mm256_mul_pd(vpu_, (vu)), _mm256_mul_pd(vpv_, (vv))); \
+		vpv_ = _mm256_add_pd(_mm256_mul_pd(vpu_, (vv)), _mm256_mul_pd(vpv_, (vu))); \
+		vpu_ = vt_; \
+	} \
+	(vu) = _mm256_add_pd(vpu_, (vcRe)); \
+	(vv) = _mm256_add_pd(vpv_, (vcIm)); \
+	(vuSq) = _mm256_mul_pd((vu), (vu)); \
+	(vvSq) = _mm256_mul_pd((vv), (vv)); \
+	(vuv) = _mm256_mul_pd((vu), (vv)); \
+} while (0)
+
+#define FORMULA_DSTEP_AVX(vu, vv, vdu, vdv) do { \
+	__m256d vpu_ = _mm256_set1_pd(1.0), vpv_ = _mm256_setzero_pd(); \
+	for (int k_ = 1; k_ < MULTIBROTPOWER; k_++) { \
+		const __m256d vt_ = _mm256_sub_pd(_mm256_mul_pd(vpu_, (vu)), _mm256_mul_pd(vpv_, (vv))); \
+		vpv_ = _mm256_add_pd(_mm256_mul_pd(vpu_, (vv)), _mm256_mul_pd(vpv_, (vu))); \
+		vpu_ = vt_; \
+	} \
+	const __m256d vre_ = _mm256_sub_pd(_mm256_mul_pd(vpu_, (vdu)), _mm256_mul_pd(vpv_, (vdv))); \
+	const __m256d vim_ = _mm256_add_pd(_mm256_mul_pd(vpu_, (vdv)), _mm256_mul_pd(vpv_, (vdu))); \
+	(vdu) = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(MULTIBROTPOWER), vre_), _mm256_set1_pd(FORMULA_DC)); \
+	(vdv) = _mm256_mul_pd(_mm256_set1_pd(MULTIBROTPOWER), vim_); \
+} while (0)
+
+#define FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm) do { \
+	float2 pu_ = FFSub((uSq), (vSq)), pv_ = FFMulF(FFMul((u), (v)), 2.0f); \
+	for (int k_ = 2; k_ < MULTIBROTPOWER; k_++) { \
+		const float2 t_ = FFSub(FFMul(pu_, (u)), FFMul(pv_, (v))); \
+		pv_ = FFAdd(FFMul(pu_, (v)), FFMul(pv_, (u))); \
+		pu_ = t_; \
+	} \
+	(u) = FFAdd(pu_, (cRe)); \
+	(v) = FFAdd(pv_, (cIm)); \
+	(uSq) = FFSqr(u); \
+	(vSq) = FFSqr(v); \
+} while (0)
+
+// t1 + i*t2 holds the power of z, t3 and t4 are scratch
+#define FORMULA_STEP_GMP(mu, mv, muSq, mvSq, mcRe, mcIm, t1, t2, t3, t4) do { \
+	mpf_sub((t1), (muSq), (mvSq)); \
+	mpf_mul((t2), (mu), (mv)); \
+	mpf_mul_2exp((t2), (t2), 1); \
+	for (int k_ = 2; k_ < MULTIBROTPOWER; k_++) { \
+		mpf_mul((t3), (t1), (mu)); \
+		mpf_mul((t4), (t2), (mv)); \
+		mpf_sub((t3), (t3), (t4)); \
+		mpf_mul((t4), (t1), (mv)); \
+		mpf_mul((t1), (t2), (mu)); \
+		mpf_add((t2), (t4), (t1)); \
+		mpf_set((t1), (t3)); \
+	} \
+	mpf_add((mu), (t1), (mcRe)); \
+	mpf_add((mv), (t2), (mcIm)); \
+	mpf_mul((muSq), (mu), (mu)); \
+	mpf_mul((mvSq), (mv), (mv)); \
+} while (0)
+
+// The parts of z^k are less than 2^k, and of the products summed into them, 2^(k+1)
+#define FORMULA_FIXEDBITS (126-MULTIBROTPOWER)
+
+#define FORMULA_STEP_FIXED(u, v, uSq, vSq, cRe, cIm) do { \
+	fixedPoint pu_ = (uSq)-(vSq), pv_ = 2*FixedMul((u), (v)); \
+	for (int k_ = 2; k_ < MULTIBROTPOWER; k_++) { \
+		const fixedPoint t_ = FixedMul(pu_, (u)) - FixedMul(pv_, (v)); \
+		pv_ = FixedMul(pu_, (v)) + FixedMul(pv_, (u)); \
+		pu_ = t_; \
+	} \
+	(u) = pu_ + (cRe); \
+	(v) = pv_ + (cIm); \
+} while (0)
+
+
+
+#elif FORMULA == FORMULA_BURNINGSHIP
+// (|Re z| + i|Im z|)^2 + c
+#define FORMULA_POWER 2
+
+#define FORMULA_STEP(u, v, uSq, vSq, cRe, cIm) do { \
+	const double uNew_ = (uSq)-(vSq) + (cRe); \
+	(v) = 2.0*fabs((u)*(v)) + (cIm); \
+	(u) = uNew_; \
+	(uSq) = (u)*(u); \
+	(vSq) = (v)*(v); \
+} while (0)
+
+// The derivative of |u| is sign(u)*du
+#define FORMULA_DSTEP(type, u, v, du, dv) do { \
+	const type a_ = fabs(u); \
+	const type b_ = fabs(v); \
+	const type da_ = ((u) < 0) ? -(du) : (du); \
+	const type db_ = ((v) < 0) ? -(dv) : (dv); \
+	const type re_ = a_*da_ - b_*db_; \
+	const type im_ = a_*db_ + b_*da_; \
+	(du) = re_ + re_ + FORMULA_DC; \
+	(dv) = im_ + im_; \
+} while (0)
+
+#define FORMULA_STEP_AVX(vu, vv, vuSq, vvSq, vuv, vcRe, vcIm) do { \
+	const __m256d vabsuv_ = _mm256_andnot_pd(_mm256_set1_pd(-0.0), (vuv)); \
+	(vv) = _mm256_add_pd(_mm256_add_pd(vabsuv_, vabsuv_), (vcIm)); \
+	(vu) = _mm256_add_pd(_mm256_sub_pd((vuSq), (vvSq)), (vcRe)); \
+	(vuSq) = _mm256_mul_pd((vu), (vu)); \
+	(vvSq) = _mm256_mul_pd((vv), (vv)); \
+	(vuv) = _mm256_mul_pd((vu), (vv)); \
+} while (0)
+
+#define FORMULA_DSTEP_AVX(vu, vv, vdu, vdv) do { \
+	const __m256d vsign_ = _mm256_set1_pd(-0.0); \
+	const __m256d va_ = _mm256_andnot_pd(vsign_, (vu)); \
+	const __m256d vb_ = _mm256_andnot_pd(vsign_, (vv)); \
+	const __m256d vda_ = _mm256_xor_pd((vdu), _mm256_and_pd(vsign_, (vu))); \
+	const __m256d vdb_ = _mm256_xor_pd((vdv), _mm256_and_pd(vsign_, (vv))); \
+	const __m256d vre_ = _mm256_sub_pd(_mm256_mul_pd(va_, vda_), _mm256_mul_pd(vb_, vdb_)); \
+	const __m256d vim_ = _mm256_add_pd(_mm256_mul_pd(va_, vdb_), _mm256_mul_pd(vb_, vda_)); \
+	(vdu) = _mm256_add_pd(_mm256_add_pd(vre_, vre_), _mm256_set1_pd(FORMULA_DC)); \
+	(vdv) = _mm256_add_pd(vim_, vim_); \
+} while (0)
+
+#define FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm) do { \
+	const float2 uNew_ = FFAdd(FFSub((uSq), (vSq)), (cRe)); \
+	float2 uv_ = FFMul((u), (v)); \
+	uv_ = (uv_.x < 0.0f) ? -uv_ : uv_; \
+	(v) = FFAdd(FFMulF(uv_, 2.0f), (cIm)); \
+	(u) = uNew_; \
+	(uSq) = FFSqr(u); \
+	(vSq) = FFSqr(v); \
+} while (0)
+
+#define FORMULA_STEP_GMP(mu, mv, muSq, mvSq, mcRe, mcIm, t1, t2, t3, t4) do { \
+	mpf_sub((t1), (muSq), (mvSq)); \
+	mpf_add((t1), (t1), (mcRe)); \
+	mpf_mul((t2), (mu), (mv)); \
+	mpf_abs((t2), (t2)); \
+	mpf_mul_2exp((t2), (t2), 1); \
+	mpf_add((mv), (t2), (mcIm)); \
+	mpf_set((mu), (t1)); \
+	mpf_mul((muSq), (mu), (mu)); \
+	mpf_mul((mvSq), (mv), (mv)); \
+} while (0)
+
+#define FORMULA_FIXEDBITS 124
+
+#define FORMULA_STEP_FIXED(u, v, uSq, vSq, cRe, cIm) do { \
+	const fixedPoint uNew_ = (uSq)-(vSq) + (cRe); \
+	const fixedPoint uv_ = FixedMul((u), (v)); \
+	(v) = 2*((uv_ < 0) ? -uv_ : uv_) + (cIm); \
+	(u) = uNew_; \
+} while (0)
+
+#else
+	#error "Unknown FORMULA"
+#endif
+
+
+
+#if FORMULA == FORMULA_JULIA
+	#define FORMULA_Z0(p, zero) (p)
+	#define FORMULA_C(p, julia) (julia)
+	#define FORMULA_DZ0 1
+	#define FORMULA_DC 0
+#else
+	#define FORMULA_Z0(p, zero) (zero)
+	#define FORMULA_C(p, julia) (p)
+	#define FORMULA_DZ0 0
+	#define FORMULA_DC 1
+#endif
+
+#if FORMULA != FORMULA_MANDELBROT
+	#undef EARLYBAIL
+#endif
+
+#endif
@@ -31,6 +31,10 @@
 #include "mandelbrot.h"
 #include "config.h"
 #include "GetWallTime.h"
+#include "animation.h"
+#include "distributed.h"
+#include "canvas.h"
+#include "renderthread.h"
 
 #ifdef WITHFREEIMAGE
 	#include <FreeImage.h>
@@ -42,13 +46,13 @@
 typedef void (*RenderMandelbrotPtr)(renderStruct *render, imageStruct *image);
 
 // Test fps for a given range/zoom, render at least 10 frames or run for 1 second
-void RunBenchmark(renderStruct *render, imageStruct *image, RenderMandelbrotPtr RenderMandelbrot);
+void RunBenchmark(renderThreadStruct *thread, imageStruct *image);
 
 // Set initial values for render ranges, number of iterations.
 void SetInitialValues(imageStruct *image);
 
 // Smoothly zoom from one configuration to another, drawing interpolated frames.
-void SmoothZoom(renderStruct *render, imageStruct *image, RenderMandelbrotPtr RenderMandelbrot,
+void SmoothZoom(renderThreadStruct *thread, imageStruct *image,
                 const double xReleasePos, const double yReleasePos,
                 const double zoomFactor, const double itersFactor);
 
@@ -71,15 +75,128 @@ char *kernelFileName = "src/mandelbrotKernel.cl";
 #endif
 
 
-int main(void)
+int main(int argc, char **argv)
 {
+	// Command line options. With --animate, render a keyframed zoom offline (see animation.c) rather
+	// than opening a window. With --worker, render tiles for a coordinator started with --listen (see
+	// distributed.c), which is headless if given --output. With --resume, finish an interrupted high
+	// resolution render from its canvas (see canvas.c).
+	const char *keyframeFileName = NULL;
+	const char *outputFileName = NULL;
+	const char *listenAddress = NULL;
+	const char *workerAddress = NULL;
+	const char *canvasFileName = NULL;
+	unsigned offlineXRes = XRESOLUTION;
+	unsigned offlineYRes = YRESOLUTION;
+	int rawRGB = 0;
+	int expMap = 0;
+	int haveView = 0;
+	double view[4];
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--animate") == 0 && i+1 < argc) {
+			keyframeFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i+1 < argc) {
+			outputFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--size") == 0 && i+1 < argc
+		      && sscanf(argv[i+1], "%ux%u", &offlineXRes, &offlineYRes) == 2
+		      && offlineXRes > 0 && offlineYRes > 0) {
+			i++;
+		}
+		else if (strcmp(argv[i], "--raw") == 0) {
+			rawRGB = 1;
+		}
+		else if (strcmp(argv[i], "--expmap") == 0) {
+			expMap = 1;
+		}
+		else if (strcmp(argv[i], "--listen") == 0 && i+1 < argc) {
+			listenAddress = argv[++i];
+		}
+		else if (strcmp(argv[i], "--worker") == 0 && i+1 < argc) {
+			workerAddress = argv[++i];
+		}
+		else if (strcmp(argv[i], "--resume") == 0 && i+1 < argc) {
+			canvasFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--view") == 0 && i+4 < argc
+		      && sscanf(argv[i+1], "%lf", &view[0]) == 1 && sscanf(argv[i+2], "%lf", &view[1]) == 1
+		      && sscanf(argv[i+3], "%lf", &view[2]) == 1 && sscanf(argv[i+4], "%lf", &view[3]) == 1
+		      && view[3] >= 1.0) {
+			haveView = 1;
+			i += 4;
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--animate keyframes [--output file] [--size WxH] [--raw] [--expmap]]\n"
+			                "       %s --listen address [--output file [--size WxH] [--view x y zoom maxIters]]\n"
+			                "       %s --worker address\n"
+			                "       %s --resume canvas [--output file]\n"
+			                "   Without --animate, run interactively. With it, render the keyframed zoom and\n"
+			                "   write it as YUV4MPEG2 (or raw rgb24 with --raw) to file, or stdout by default.\n"
+			                "   --expmap resamples the frames from one exponential map of the zoom, which is\n"
+			                "   much faster, but the centre is fixed and the zoom must not go back out.\n"
+			                "   With --listen, 'h' renders are split between workers started with --worker,\n"
+			                "   connecting to address, host:port or unix:path. With --output, render the view\n"
+			                "   (the initial one, or as a keyframe) that way as a PPM image, without a window.\n"
+			                "   --resume finishes an interrupted 'h' render, eg. of highres.canvas, and writes\n"
+			                "   it as a PPM image.\n",
+			        argv[0], argv[0], argv[0], argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+#ifdef WITHOPENCL
+	if (listenAddress != NULL && outputFileName == NULL) {
+		fprintf(stderr, "Error: the OpenCL build only coordinates workers with --output\n");
+		return EXIT_FAILURE;
+	}
+#endif
+	if (keyframeFileName != NULL || workerAddress != NULL || canvasFileName != NULL
+	 || (listenAddress != NULL && outputFileName != NULL)) {
+		imageStruct image;
+		image.xRes = offlineXRes;
+		image.yRes = offlineYRes;
+		SetInitialValues(&image);
+		image.expMap = expMap;
+		image.paletteLUT = malloc(3*(PALETTELUTSIZE+2) * sizeof *(image.paletteLUT));
+		BuildPaletteLUT(image.paletteLUT);
+		if (haveView) {
+			// as a keyframe: centre, zoom relative to the initial view as a power of two, and maxIters
+			SetView(&image, view[0], view[1], image.xRes*image.xStep*exp2(-view[2]));
+			image.maxIters = (unsigned)view[3];
+		}
+		if (outputFileName == NULL) {
+			outputFileName = "-";
+		}
+
+		int status;
+		if (workerAddress != NULL) {
+			status = RunWorker(workerAddress, &image);
+		}
+		else if (canvasFileName != NULL) {
+			status = ResumeCanvas(canvasFileName, &image, outputFileName);
+		}
+		else if (keyframeFileName != NULL) {
+			status = RenderAnimation(&image, keyframeFileName, outputFileName, rawRGB);
+		}
+		else {
+			status = RunCoordinator(listenAddress, &image, outputFileName);
+		}
+		free(image.paletteLUT);
+		return status;
+	}
+
 	printf("\n"
 	       "Controls:  - Left/Right Click to zoom in/out, centring on cursor position.\n"
 	       "           - Left Click and Drag to pan.\n"
 	       "           - r to reset view.\n"
 	       "           - q,w to decrease, increase max iteration count\n"
+	       "           - i to toggle automatic max iteration count\n"
 	       "           - a,s to decrease, increase colour period\n"
+	       "           - c to toggle histogram colouring\n"
+	       "           - d to toggle distance estimation\n"
+	       "           - o to toggle orbit density (Buddhabrot) rendering\n"
 	       "           - g to toggle Gaussian Blur after computation\n"
+	       "           - e to toggle adaptive supersampling of edges\n"
 	       "           - b to run some benchmarks.\n"
 	       "           - p to show a double-precision limited zoom.\n"
 	       "           - h to save a high resolution image of the current view to current directory.\n"
@@ -91,13 +208,19 @@ int main(void)
 	RenderMandelbrotPtr RenderMandelbrot = &RenderMandelbrotOpenCL;
 #elif defined(WITHAVX)
 	RenderMandelbrotPtr RenderMandelbrot = &RenderMandelbrotAVXCPU;
-	// AVX double prec vector width (4) must divide horizontal (x) resolution
-	assert(XRESOLUTION % 4 == 0);
 #elif defined(WITHGMP)
 	RenderMandelbrotPtr RenderMandelbrot = &RenderMandelbrotGMPCPU;
+#elif defined(WITHFIXED)
+	RenderMandelbrotPtr RenderMandelbrot = &RenderMandelbrotFixedCPU;
 #else
 	RenderMandelbrotPtr RenderMandelbrot = &RenderMandelbrotCPU;
 #endif
+	// If only the colouring changes, we can recolour the escape counts of the last render instead
+#ifdef WITHOPENCL
+	RenderMandelbrotPtr RecolourMandelbrot = &RecolourMandelbrotOpenCL;
+#else
+	RenderMandelbrotPtr RecolourMandelbrot = &RecolourMandelbrotCPU;
+#endif
 
 
 	// Define and initialize structs
@@ -110,8 +233,25 @@ int main(void)
 	SetInitialValues(&image);
 	// Update OpenGL texture on render. This is disabled when rendering high resolution images
 	render.updateTex = 1;
+	// Renders on this thread are never cancelled
+	render.cancel = NULL;
+	render.shaderColouring = 0;
+	// With --listen, high resolution renders are split between workers
+	coordinatorStruct coordinator;
+	render.coordinator = NULL;
+	if (listenAddress != NULL) {
+		if (OpenCoordinator(&coordinator, listenAddress) != 0) {
+			return EXIT_FAILURE;
+		}
+		render.coordinator = &coordinator;
+	}
 	// Allocate host memory, used to set up OpenGL texture, even if we are using interop OpenCL
 	image.pixels = malloc(image.xRes * image.yRes * sizeof *(image.pixels) *3);
+	// Escape counts, from which pixels are coloured
+	image.escape = malloc(image.xRes * image.yRes * sizeof *(image.escape));
+	image.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(image.histogramCDF));
+	image.paletteLUT = malloc(3*(PALETTELUTSIZE+2) * sizeof *(image.paletteLUT));
+	BuildPaletteLUT(image.paletteLUT);
 
 
 	// OpenGL variables and setup
@@ -134,6 +274,8 @@ int main(void)
 	// Initially set variable that controls interop of OpenGL and OpenCL to 0, set to 1 if
 	// interop device found successfully
 	render.glclInterop = 0;
+	// Set to 1 if the chosen device doesn't support double precision
+	render.emulateDouble = 0;
 
 	if (InitialiseCLEnvironment(&platform, &device_id, &program, &render) == EXIT_FAILURE) {
 		printf("Error initialising OpenCL environment\n");
@@ -142,11 +284,27 @@ int main(void)
 	size_t sizeBytes = image.xRes * image.yRes * 3 * sizeof(float);
 	render.pixelsDevice = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, sizeBytes, NULL, &err);
 	// if we aren't using interop, allocate another buffer on the device for output, on the pointer
-	// for the texture
+	// for the texture. This is allocated in host-accessible memory, and mapped rather than copied
+	// back to the host each frame; on CPU devices and integrated GPUs mapping is then free.
 	if (render.glclInterop == 0) {
-		render.pixelsTex = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, sizeBytes, NULL, &err);
+		render.pixelsTex = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeBytes, NULL, &err);
+		CheckOpenCLError(err, __LINE__);
 	}
 
+	// Escape counts, and buffers for histogram colouring
+	render.escapeDevice = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, image.xRes * image.yRes * sizeof(float), NULL, &err);
+	CheckOpenCLError(err, __LINE__);
+	render.escapeRange = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, 2 * sizeof(cl_int), NULL, &err);
+	CheckOpenCLError(err, __LINE__);
+	render.histograms = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE,
+	                                   OPENCLHISTOGRAMGROUPS * HISTOGRAMBINS * sizeof(cl_uint), NULL, &err);
+	CheckOpenCLError(err, __LINE__);
+	render.histogramCDF = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, (HISTOGRAMBINS+1) * sizeof(cl_float), NULL, &err);
+	CheckOpenCLError(err, __LINE__);
+	render.paletteLUT = clCreateBuffer(render.contextCL, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                   3*(PALETTELUTSIZE+2) * sizeof(cl_float), image.paletteLUT, &err);
+	CheckOpenCLError(err, __LINE__);
+
 	// finish texture initialization so that we can use with OpenCL if glclInterop
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.xRes, image.yRes, 0, GL_RGB, GL_FLOAT, image.pixels);
 	// Configure image from OpenGL texture "tex"
@@ -163,19 +321,60 @@ int main(void)
 	CheckOpenCLError(err, __LINE__);
 	render.gaussianBlurKernel2 = clCreateKernel(program, "gaussianBlurKernel2", &err);
 	CheckOpenCLError(err, __LINE__);
+	render.colourKernel = clCreateKernel(program, "colourKernel", &err);
+	CheckOpenCLError(err, __LINE__);
+	render.escapeRangeKernel = clCreateKernel(program, "escapeRangeKernel", &err);
+	CheckOpenCLError(err, __LINE__);
+	render.histogramKernel = clCreateKernel(program, "histogramKernel", &err);
+	CheckOpenCLError(err, __LINE__);
+	render.histogramCDFKernel = clCreateKernel(program, "histogramCDFKernel", &err);
+	CheckOpenCLError(err, __LINE__);
+#ifdef OPENCLPERSISTENT
+	// The persistent kernel is only built with double precision
+	if (!render.emulateDouble) {
+		render.renderMandelbrotPersistentKernel = clCreateKernel(program, "renderMandelbrotPersistentKernel", &err);
+		CheckOpenCLError(err, __LINE__);
+		// Work queue counter for the persistent kernel, reset before each launch
+		render.workCounter = clCreateBuffer(render.contextCL, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &err);
+		CheckOpenCLError(err, __LINE__);
+	}
+#endif
+	// The orbit density kernels are only built with double precision
+	if (!render.emulateDouble) {
+		render.orbitDensityKernel = clCreateKernel(program, "orbitDensityKernel", &err);
+		CheckOpenCLError(err, __LINE__);
+		render.orbitDensityMergeKernel = clCreateKernel(program, "orbitDensityMergeKernel", &err);
+		CheckOpenCLError(err, __LINE__);
+		render.orbitCells = clCreateBuffer(render.contextCL, CL_MEM_READ_ONLY,
+		                                   (2*ORBITDENSITYGRID*ORBITDENSITYGRID+1) * sizeof(cl_float), NULL, &err);
+		CheckOpenCLError(err, __LINE__);
+	}
+	render.orbitDensities = NULL;
+	render.orbitDensitiesSize = 0;
 #endif
 
 
+	// Render on a thread of its own (see renderthread.c), so that input is handled however long a frame takes
+	renderThreadStruct renderThread;
+	if (StartRenderThread(&renderThread, &render, &image, RenderMandelbrot, RecolourMandelbrot) != 0) {
+		return EXIT_FAILURE;
+	}
+
+
 	// Start main loop: Update until we encounter user input. Look for Esc key (quit), left and right mount
 	// buttons (zoom in on cursor position, zoom out on cursor position), "r" -- reset back to initial coords,
 	// "b" -- run some benchmarks, "p" -- display a double precision limited zoom.
-	// Re-render the Mandelbrot set as and when we need, in the user input conditionals.
+	// Request a new frame as and when we need, in the user input conditionals. Frames are presented as
+	// they are finished: the render thread wakes us from glfwWaitEvents.
 
 	// Initial render:
-	RenderMandelbrot(&render, &image);
+	RequestRender(&renderThread, &image, REQUESTRENDER);
 
 	while (!glfwWindowShouldClose(render.window)) {
 
+		// update the texture, if a new frame is finished
+		PresentFrame(&renderThread, &image);
+
 		// draw
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 		// Swap buffers
@@ -212,31 +411,35 @@ int main(void)
 				if (fabs(xReleasePos-xPressPos) > DRAGPIXELS || fabs(yReleasePos-yPressPos) > DRAGPIXELS) {
 					// Set shift variable. Don't zoom after button release if this is 1
 					shift = 1;
-					// Determine shift in mandelbrot coords
-					double xShift = (xReleasePos-xPressPos)/(double)image.xRes*(image.xMax-image.xMin);
-					double yShift = (yReleasePos-yPressPos)/(double)image.yRes*(image.yMax-image.yMin);
-
-					// Add shift to boundaries
-					image.xMin = image.xMin - xShift;
-					image.xMax = image.xMax - xShift;
-					image.yMin = image.yMin - yShift;
-					image.yMax = image.yMax - yShift;
+					// Determine shift in mandelbrot coords, and move the view by it
+					double xShift = (xReleasePos-xPressPos)*image.xStep;
+					double yShift = (yReleasePos-yPressPos)*image.yStep;
+					MoveView(&image, -xShift, -yShift);
 
 					// Update "current" (press) position
 					xPressPos = xReleasePos;
 					yPressPos = yReleasePos;
 
-					// Re-render and draw
-					RenderMandelbrot(&render, &image);
+					// Re-render, cancelling the render of the last position if it isn't finished. maxIters
+					// is kept while dragging, and chosen once the drag ends.
+					RequestRender(&renderThread, &image, REQUESTRENDER | REQUESTINTERACTIVE);
+				}
+
+				// Draw whatever is newest, and wait for the mouse to move, or the next frame
+				if (PresentFrame(&renderThread, &image)) {
 					glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 					glfwSwapBuffers(render.window);
 				}
-				glfwPollEvents();
+				glfwWaitEvents();
 			}
 
-			// else, zoom in smoothly over ZOOMSTEPS frames
-			if (!shift) {
-				SmoothZoom(&render, &image, RenderMandelbrot, xReleasePos, yReleasePos, ZOOMFACTOR, ITERSFACTOR);
+			// With automatic maxIters, the render thread chooses it for where the drag ended, as that
+			// takes a while too. Else, zoom in smoothly over ZOOMSTEPS frames.
+			if (shift && image.autoIters) {
+				RequestRender(&renderThread, &image, REQUESTAUTOITERS);
+			}
+			else if (!shift) {
+				SmoothZoom(&renderThread, &image, xReleasePos, yReleasePos, ZOOMFACTOR, ITERSFACTOR);
 			}
 		}
 
@@ -252,7 +455,7 @@ int main(void)
 			glfwGetCursorPos(render.window, &xReleasePos, &yReleasePos);
 
 			// Zooming out, so use 1/FACTORs.
-			SmoothZoom(&render, &image, RenderMandelbrot, xReleasePos, yReleasePos, 1.0/ZOOMFACTOR, 1.0/ITERSFACTOR);
+			SmoothZoom(&renderThread, &image, xReleasePos, yReleasePos, 1.0/ZOOMFACTOR, 1.0/ITERSFACTOR);
 		}
 
 
@@ -263,7 +466,7 @@ int main(void)
 			}
 			printf("Resetting...\n");
 			SetInitialValues(&image);
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRENDER);
 		}
 
 
@@ -280,7 +483,44 @@ int main(void)
 				printf("Toggling Gaussian Blur On...\n");
 				image.gaussianBlur = 1;
 			}
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRECOLOUR);
+		}
+
+
+		// if user presses "e", toggle adaptive supersampling
+		else if (glfwGetKey(render.window, GLFW_KEY_E) == GLFW_PRESS) {
+			while (glfwGetKey(render.window, GLFW_KEY_E) != GLFW_RELEASE) {
+				glfwPollEvents();
+			}
+			if (image.supersample == 1) {
+				printf("Toggling Supersampling Off...\n");
+				image.supersample = 0;
+			}
+			else {
+				printf("Toggling Supersampling On...\n");
+				image.supersample = 1;
+			}
+			RequestRender(&renderThread, &image, REQUESTRECOLOUR);
+		}
+
+
+		// if user presses "i", toggle automatic maxIters
+		else if (glfwGetKey(render.window, GLFW_KEY_I) == GLFW_PRESS) {
+			while (glfwGetKey(render.window, GLFW_KEY_I) != GLFW_RELEASE) {
+				glfwPollEvents();
+			}
+			if (image.autoIters == 1) {
+				printf("Toggling Automatic Max Iteration Count Off...\n");
+				image.autoIters = 0;
+			}
+			else {
+				image.autoIters = 1;
+				unsigned maxIters = AutoMaxIters(&render, &image);
+				printf("Toggling Automatic Max Iteration Count On... max iteration count %d to %u\n",
+				       image.maxIters, maxIters);
+				image.maxIters = maxIters;
+				RequestRender(&renderThread, &image, REQUESTRENDER);
+			}
 		}
 
 
@@ -291,7 +531,7 @@ int main(void)
 			}
 			printf("Decreasing max iteration count from %d to %d\n", image.maxIters, (int)(image.maxIters/ITERSFACTOR));
 			image.maxIters /= ITERSFACTOR;
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRENDER);
 		}
 		// if user presses "w", increase max iteration count
 		else if (glfwGetKey(render.window, GLFW_KEY_W) == GLFW_PRESS) {
@@ -300,7 +540,60 @@ int main(void)
 			}
 			printf("Increasing max iteration count from %d to %d\n", image.maxIters, (int)(image.maxIters*ITERSFACTOR));
 			image.maxIters *= ITERSFACTOR;
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRENDER);
+		}
+
+
+		// if user presses "c", toggle histogram colouring
+		else if (glfwGetKey(render.window, GLFW_KEY_C) == GLFW_PRESS) {
+			while (glfwGetKey(render.window, GLFW_KEY_C) != GLFW_RELEASE) {
+				glfwPollEvents();
+			}
+			if (image.histogramColouring == 1) {
+				printf("Toggling Histogram Colouring Off...\n");
+				image.histogramColouring = 0;
+			}
+			else {
+				printf("Toggling Histogram Colouring On...\n");
+				image.histogramColouring = 1;
+			}
+			RequestRender(&renderThread, &image, REQUESTRECOLOUR);
+		}
+
+
+		// if user presses "d", toggle distance estimation. The escape values change meaning, so re-render.
+		else if (glfwGetKey(render.window, GLFW_KEY_D) == GLFW_PRESS) {
+			while (glfwGetKey(render.window, GLFW_KEY_D) != GLFW_RELEASE) {
+				glfwPollEvents();
+			}
+			if (image.distanceEstimation == 1) {
+				printf("Toggling Distance Estimation Off...\n");
+				image.distanceEstimation = 0;
+			}
+			else {
+				printf("Toggling Distance Estimation On...\n");
+				image.distanceEstimation = 1;
+				image.orbitDensity = 0;
+			}
+			RequestRender(&renderThread, &image, REQUESTRENDER);
+		}
+
+
+		// if user presses "o", toggle orbit density rendering
+		else if (glfwGetKey(render.window, GLFW_KEY_O) == GLFW_PRESS) {
+			while (glfwGetKey(render.window, GLFW_KEY_O) != GLFW_RELEASE) {
+				glfwPollEvents();
+			}
+			if (image.orbitDensity == 1) {
+				printf("Toggling Orbit Density Off...\n");
+				image.orbitDensity = 0;
+			}
+			else {
+				printf("Toggling Orbit Density On...\n");
+				image.orbitDensity = 1;
+				image.distanceEstimation = 0;
+			}
+			RequestRender(&renderThread, &image, REQUESTRENDER);
 		}
 
 
@@ -311,7 +604,7 @@ int main(void)
 			}
 			printf("Decreasing colour period from %.0lf to %.0lf\n", image.colourPeriod, fmax(32, image.colourPeriod-32));
 			image.colourPeriod = fmax(32, image.colourPeriod-32);
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRECOLOUR);
 		}
 		// if user presses "s", increase colour period
 		else if (glfwGetKey(render.window, GLFW_KEY_S) == GLFW_PRESS) {
@@ -320,7 +613,7 @@ int main(void)
 			}
 			printf("Increasing colour period from %.0lf to %.0lf\n", image.colourPeriod, image.colourPeriod+32);
 			image.colourPeriod += 32;
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRECOLOUR);
 		}
 
 
@@ -334,36 +627,27 @@ int main(void)
 
 			printf("Whole fractal:\n");
 			SetInitialValues(&image);
-			RunBenchmark(&render, &image, RenderMandelbrot);
+			RunBenchmark(&renderThread, &image);
 
 			printf("Early Bail-out:\n");
-			image.xMin = -0.8153143016681144;
-			image.xMax = -0.6839170011300622;
-			image.yMin = -0.0365167077914237;
-			image.yMax =  0.0373942737612310;
+			SetViewBounds(&image, -0.8153143016681144, -0.6839170011300622, -0.0365167077914237, 0.0373942737612310);
 			image.maxIters = 112;
-			RunBenchmark(&render, &image, RenderMandelbrot);
+			RunBenchmark(&renderThread, &image);
 
 			printf("Spiral:\n");
-			image.xMin = -0.8673755781976442;
-			image.xMax = -0.8673711898931797;
-			image.yMin = -0.2156059883952151;
-			image.yMax = -0.2156035199739536;
+			SetViewBounds(&image, -0.8673755781976442, -0.8673711898931797, -0.2156059883952151, -0.2156035199739536);
 			image.maxIters = 1757;
-			RunBenchmark(&render, &image, RenderMandelbrot);
+			RunBenchmark(&renderThread, &image);
 
 			printf("Highly zoomed:\n");
-			image.xMin = -0.8712903154956539;
-			image.xMax = -0.8712903108993595;
-			image.yMin = -0.2293516610223087;
-			image.yMax = -0.2293516584368930;
+			SetViewBounds(&image, -0.8712903154956539, -0.8712903108993595, -0.2293516610223087, -0.2293516584368930);
 			image.maxIters = 10750;
-			RunBenchmark(&render, &image, RenderMandelbrot);
+			RunBenchmark(&renderThread, &image);
 
 			printf("Complete.\n");
 		// Re-render with original coords
 			SetInitialValues(&image);
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRENDER);
 		}
 
 
@@ -373,12 +657,9 @@ int main(void)
 				glfwPollEvents();
 			}
 			printf("Precision test...\n");
-			image.xMin = -1.25334325335487362;
-			image.xMax = -1.25334325335481678;
-			image.yMin = -0.34446232396119353;
-			image.yMax = -0.34446232396116155;
+			SetViewBounds(&image, -1.25334325335487362, -1.25334325335481678, -0.34446232396119353, -0.34446232396116155);
 			image.maxIters = 1389952;
-			RenderMandelbrot(&render, &image);
+			RequestRender(&renderThread, &image, REQUESTRENDER);
 		}
 
 
@@ -388,6 +669,9 @@ int main(void)
 			while (glfwGetKey(render.window, GLFW_KEY_H) != GLFW_RELEASE) {
 				glfwPollEvents();
 			}
+			// Wait for the render of the view on screen to finish, at full resolution if the last frame was
+			// reduced, so that the render thread is idle and the high resolution render has the machine
+			WaitForFrame(&renderThread, &image, 1);
 			double startTime = GetWallTime();
 			printf("Saving high resolution (%d x %d) image...\n",
 			       image.xRes*HIGHRESOLUTIONMULTIPLIER, image.yRes*HIGHRESOLUTIONMULTIPLIER);
@@ -399,6 +683,10 @@ int main(void)
 
 
 	// clean up
+	StopRenderThread(&renderThread);
+	if (render.coordinator != NULL) {
+		CloseCoordinator(render.coordinator);
+	}
 #ifdef WITHOPENCL
 	CleanUpCLEnvironment(&platform, &device_id, &(render.contextCL), &(render.queue), &program);
 #endif
@@ -416,12 +704,15 @@ int main(void)
 
 	// Free dynamically allocated memory
 	free(image.pixels);
+	free(image.escape);
+	free(image.histogramCDF);
+	free(image.paletteLUT);
 	return 0;
 }
 
 
 
-void RunBenchmark(renderStruct *render, imageStruct *image, RenderMandelbrotPtr RenderMandelbrot)
+void RunBenchmark(renderThreadStruct *thread, imageStruct *image)
 {
 	double startTime = GetWallTime();
 	int framesRendered = 0;
@@ -431,9 +722,10 @@ void RunBenchmark(renderStruct *render, imageStruct *image, RenderMandelbrotPtr
 
 	while ( (framesRendered < 20) || (GetWallTime() - startTime < 5.0) ) {
 
-		RenderMandelbrot(render, image);
+		RequestRender(thread, image, REQUESTRENDER);
+		WaitForFrame(thread, image, 1);
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-		glfwSwapBuffers(render->window);
+		glfwSwapBuffers(thread->glRender->window);
 		framesRendered++;
 	}
 
@@ -446,41 +738,48 @@ void RunBenchmark(renderStruct *render, imageStruct *image, RenderMandelbrotPtr
 
 
 
-void SmoothZoom(renderStruct *render, imageStruct *image, RenderMandelbrotPtr RenderMandelbrot,
+void SmoothZoom(renderThreadStruct *thread, imageStruct *image,
                 const double xReleasePos, const double yReleasePos,
                 const double zoomFactor, const double itersFactor)
 {
-	// Determine new centre
-	const double xCentreNew = (xReleasePos/(double)image->xRes*(image->xMax-image->xMin) + image->xMin);
-	const double yCentreNew = (yReleasePos/(double)image->yRes*(image->yMax-image->yMin) + image->yMin);
-
-	// Store old min, max values, determine new min, max values
-	const double xMinOld = image->xMin;
-	const double xMaxOld = image->xMax;
-	const double yMinOld = image->yMin;
-	const double yMaxOld = image->yMax;
-	const double xMinNew = xCentreNew - (image->xMax-image->xMin)/2.0/zoomFactor;
-	const double xMaxNew = xCentreNew + (image->xMax-image->xMin)/2.0/zoomFactor;
-	const double yMinNew = yCentreNew - (image->yMax-image->yMin)/2.0/zoomFactor;
-	const double yMaxNew = yCentreNew + (image->yMax-image->yMin)/2.0/zoomFactor;
-	// Store old maxIters value
+	// Store old view, determine the new one: centred on the release position, with the pixel spacing
+	// divided by zoomFactor
+	const imageStruct old = *image;
+	const double xShift = (xReleasePos - 0.5*image->xRes)*image->xStep;
+	const double yShift = (yReleasePos - 0.5*image->yRes)*image->yStep;
+	const double xStepNew = image->xStep/zoomFactor;
+	const double yStepNew = image->yStep/zoomFactor;
+	// Store old maxIters value, determine new value
 	const int maxItersOld = image->maxIters;
+	double maxItersNew = maxItersOld*itersFactor;
+	if (image->autoIters) {
+		imageStruct zoomed = old;
+		MoveView(&zoomed, xShift, yShift);
+		zoomed.xStep = xStepNew;
+		zoomed.yStep = yStepNew;
+		maxItersNew = AutoMaxIters(thread->glRender, &zoomed);
+	}
 
 
 	// Zoom into new position in ZOOMSTEPS steps, interpolating between old and new boundaries.
 	double time = GetWallTime();
 	for (int i = 1; i <= image->zoomSteps; i++) {
 		double t = INTERPFUNC((double)i/(double)image->zoomSteps);
-		image->xMin = xMinOld + (xMinNew - xMinOld)*t;
-		image->xMax = xMaxOld + (xMaxNew - xMaxOld)*t;
-		image->yMin = yMinOld + (yMinNew - yMinOld)*t;
-		image->yMax = yMaxOld + (yMaxNew - yMaxOld)*t;
-		image->maxIters = maxItersOld + (itersFactor-1.0)*maxItersOld*t;
-
-		// Re-render mandelbrot set and draw
-		RenderMandelbrot(render, image);
+		image->xCentre = old.xCentre;
+		image->xCentreLo = old.xCentreLo;
+		image->yCentre = old.yCentre;
+		image->yCentreLo = old.yCentreLo;
+		MoveView(image, xShift*t, yShift*t);
+		image->xStep = old.xStep + (xStepNew - old.xStep)*t;
+		image->yStep = old.yStep + (yStepNew - old.yStep)*t;
+		image->maxIters = maxItersOld + (maxItersNew-maxItersOld)*t;
+
+		// Re-render mandelbrot set and draw. Every frame is shown, so wait for each. They are rendered
+		// at reduced resolution if need be, and the last is then rendered at full resolution.
+		RequestRender(thread, image, REQUESTRENDER | REQUESTINTERACTIVE);
+		WaitForFrame(thread, image, 0);
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-		glfwSwapBuffers(render->window);
+		glfwSwapBuffers(thread->glRender->window);
 	}
 
 	// Want zoom to take ~half a second, so if it is taking too much or too little time,
@@ -512,11 +811,12 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	free(image->pixels);
 	// CAREFUL: these sizes can easily overflow a 32bit int. Use uint64_t
 	uint64_t allocSize = image->xRes * image->yRes * sizeof*(image->pixels) *3;
-	printf("   --- reallocating host pixels array: %.2lfMB\n", allocSize/1024.0/1024.0);
-	image->pixels = malloc(allocSize);
 
 
 #ifdef WITHOPENCL
+	printf("   --- reallocating host pixels array: %.2lfMB\n", allocSize/1024.0/1024.0);
+	image->pixels = malloc(allocSize);
+
 	// Here, it is likely that the array(s) of colour values will not fit in device global memory.
 	// We have to render the frame in tiles, each of which fits.
 	//
@@ -537,9 +837,11 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	uint64_t fullTileSize = maxAllocRows * rowSize;
 
 	// Allocate tile-sized global memory arrays on device.
-	// Store handle to OpenGL texture so it can be recovered later.
-	// The struct variable will be reassigned, this makes running the kernels simpler.
+	// Store handle to OpenGL texture so it can be recovered later, and the escape counts of the view on
+	// screen, which the next recolour uses.
+	// The struct variables will be reassigned, this makes running the kernels simpler.
 	cl_mem keepPixelsTex = render->pixelsTex;
+	cl_mem keepEscapeDevice = render->escapeDevice;
 	// Release the existing pixels array
 	err = clReleaseMemObject(render->pixelsDevice);
 	CheckOpenCLError(err, __LINE__);
@@ -549,35 +851,29 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	CheckOpenCLError(err, __LINE__);
 	render->pixelsTex = clCreateBuffer(render->contextCL, CL_MEM_READ_WRITE, fullTileSize, NULL, &err);
 	CheckOpenCLError(err, __LINE__);
+	render->escapeDevice = clCreateBuffer(render->contextCL, CL_MEM_READ_WRITE, fullTileSize/3, NULL, &err);
+	CheckOpenCLError(err, __LINE__);
 
-	// Store full image resolution and boundaries, we will adjust the values in the struct
+	// Store full image resolution and view, we will adjust the values in the struct
 	int yResFull = image->yRes;
-	double yMinFull = image->yMin;
-	double yMaxFull = image->yMax;
+	const double yCentreFull = image->yCentre;
+	const double yCentreLoFull = image->yCentreLo;
 
 
 	// Render tiles, and copy data back to the host array
 	for (int t = 0; t < tiles; t++) {
 		printf("   --- computing tile %d/%d...\n", t+1, tiles);
 
-		// Set tile resolution. Each has maxAllocRows apart from the last,
-		// which might have fewer as it contains the remainder.
-		image->yRes = maxAllocRows;
-		if (t == tiles-1) {
-			image->yRes = yResFull % maxAllocRows;
-		}
+		// Set tile resolution and view: rows t*maxAllocRows onwards. Each has maxAllocRows apart from
+		// the last, which might have fewer as it contains the remainder.
+		image->yRes = yResFull;
+		image->yCentre = yCentreFull;
+		image->yCentreLo = yCentreLoFull;
+		CropRows(image, t*maxAllocRows, (t == tiles-1) ? yResFull - t*maxAllocRows : maxAllocRows);
 		// Reset global size, as the resolution has changed
 		render->globalSize = image->yRes * image->xRes;
 		assert(render->globalSize % render->localSize == 0);
 
-		// Set tile boundaries. We are computing a fraction maxAllocRows/yResFull of the full
-		//image, starting at the beginning of the t-th tile. The final tile uses xMaxFull for xMax.
-		image->yMin = yMinFull + t*((double)maxAllocRows/(double)yResFull)*(yMaxFull-yMinFull);
-		image->yMax = yMinFull + (t+1)*((double)maxAllocRows/(double)yResFull)*(yMaxFull-yMinFull);
-		if (t == tiles-1) {
-			image->yMax = yMaxFull;
-		}
-
 		// Render
 		RenderMandelbrot(render, image);
 
@@ -592,15 +888,35 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 		CheckOpenCLError(err, __LINE__);
 	}
 
-	// Reset image boundaries and resolution
+	// Reset image view and resolution
 	image->yRes = yResFull;
-	image->yMin = yMinFull;
-	image->yMax = yMaxFull;
+	image->yCentre = yCentreFull;
+	image->yCentreLo = yCentreLoFull;
 
 
 #else
-	// If not using OpenCL, simply render directly onto the reallocated image->pixels array
-	RenderMandelbrot(render, image);
+	// If not using OpenCL, render tile by tile into a canvas file (see canvas.c), which needn't fit in
+	// memory, and resumes if interrupted. Failing that, render directly onto a reallocated
+	// image->pixels array. Either way, the workers may do the rendering. The escape counts of the view on
+	// screen are kept, for the next recolour.
+	float *keepEscape = image->escape;
+	canvasStruct canvas;
+	const int haveCanvas = (OpenCanvas(&canvas, image, CANVASFILENAME) == 0);
+	if (haveCanvas) {
+		RenderCanvas(&canvas, render, image, RenderMandelbrot);
+	}
+	else {
+		printf("   --- reallocating host pixels array: %.2lfMB\n", allocSize/1024.0/1024.0);
+		image->pixels = malloc(allocSize);
+		image->escape = malloc(image->xRes * image->yRes * sizeof *(image->escape));
+		if (render->coordinator != NULL) {
+			RenderDistributed(render->coordinator, image);
+			RecolourMandelbrotCPU(render, image);
+		}
+		else {
+			RenderMandelbrot(render, image);
+		}
+	}
 #endif
 
 
@@ -618,7 +934,10 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	}
 	FIBITMAP* img = FreeImage_ConvertFromRawBits(rawPixels, image->xRes, image->yRes, 3*image->xRes,
 	                                             24, 0x000000, 0x000000, 0x000000, TRUE);
-	FreeImage_Save(FIF_PNG, img, "test.png", 0);
+	const int saved = FreeImage_Save(FIF_PNG, img, "test.png", 0);
+	if (!saved) {
+		fprintf(stderr, "Error: cannot save test.png\n");
+	}
 	FreeImage_Unload(img);
 	free(rawPixels);
 
@@ -627,7 +946,18 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	image->xRes = image->xRes/HIGHRESOLUTIONMULTIPLIER;
 	image->yRes = image->yRes/HIGHRESOLUTIONMULTIPLIER;
 	render->updateTex = 1;
+#ifdef WITHOPENCL
 	free(image->pixels);
+#else
+	// Keep the canvas if the image couldn't be saved
+	if (haveCanvas) {
+		CloseCanvas(&canvas, saved);
+	}
+	else {
+		free(image->pixels);
+		free(image->escape);
+	}
+#endif
 	image->pixels = malloc(image->xRes * image->yRes * sizeof *(image->pixels) *3);
 
 #ifdef WITHOPENCL
@@ -639,9 +969,13 @@ void HighResolutionRender(renderStruct *render, imageStruct *image, RenderMandel
 	size_t allocSizeOrig = image->xRes * image->yRes * 3 * sizeof *(image->pixels);
 	render->pixelsDevice = clCreateBuffer(render->contextCL, CL_MEM_READ_WRITE, allocSizeOrig, NULL, &err);
 	CheckOpenCLError(err, __LINE__);
+	clReleaseMemObject(render->escapeDevice);
+	render->escapeDevice = keepEscapeDevice;
 	// Reset global size, as the resolution has changed
 	render->globalSize = image->yRes * image->xRes;
 	assert(render->globalSize % render->localSize == 0);
+#else
+	image->escape = keepEscape;
 #endif
 
 }
@@ -749,6 +1083,9 @@ int SetUpOpenGL(GLFWwindow **window, const int xRes, const int yRes,
 
 	glLinkProgram(*shaderProgram);
 	glUseProgram(*shaderProgram);
+	// The fraction of the texture which the frame fills, in x and y. Less than 1 for reduced resolution
+	// frames in immutable texture storage (see renderthread.c).
+	glUniform2f(glGetUniformLocation(*shaderProgram, "texScale"), 1.0f, 1.0f);
 
 	// set attributes
 	GLint posAttrib = glGetAttribLocation(*shaderProgram, "position");
@@ -778,22 +1115,38 @@ void SetInitialValues(imageStruct *image)
 {
 	// max iteration count. This needs to increase as we zoom in to maintain detail
 	image->maxIters = MINITERS;
+	image->autoIters = DEFAULTAUTOITERS;
 
-	// mandelbrot coordinates
-	image->xMin = -2.5;
-	image->xMax =  1.5;
-	// set y limits based on aspect ratio
-	image->yMin = -(image->xMax-image->xMin)/2.0*((double)image->yRes/(double)image->xRes);
-	image->yMax =  (image->xMax-image->xMin)/2.0*((double)image->yRes/(double)image->xRes);
+	// mandelbrot coordinates: -2.5 to 1.5 in x, and y limits based on aspect ratio
+	SetView(image, -0.5, 0.0, 4.0);
+	image->expMap = 0;
+	image->xOrigin = 0.0;
+	image->yOrigin = 0.0;
+
+	// Only the render thread keeps the orbits of unfinished pixels
+	image->orbits = NULL;
+	image->orbitIters = 0;
 
 	// Gaussian blur after computation
 	image->gaussianBlur = DEFAULTGAUSSIANBLUR;
 
+	// Adaptive supersampling of edge pixels after computation
+	image->supersample = DEFAULTSUPERSAMPLE;
+
 	// Intermediate frames for SmoothZoom function
 	image->zoomSteps = INITIALZOOMSTEPS;
 
 	// Number of iterations in colour cycle
 	image->colourPeriod = DEFAULTCOLOURPERIOD;
+
+	// Colour by histogram of escape counts, or colourPeriod
+	image->histogramColouring = DEFAULTHISTOGRAMCOLOURING;
+
+	// Colour by distance estimate, or escape count
+	image->distanceEstimation = DEFAULTDISTANCEESTIMATION;
+
+	// Colour by density of escaping orbits, or escape count
+	image->orbitDensity = DEFAULTORBITDENSITY;
 }
 
 
@@ -905,26 +1258,25 @@ int InitialiseCLEnvironment(cl_platform_id **platform, cl_device_id ***device_id
 	}
 
 	if (render->glclInterop) {
-		// Check the device we've found supports double precision
+		// Check whether the device we've found supports double precision. If not, we can still use it,
+		// with the float-float kernel.
 		clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, sizeof(deviceInfo), deviceInfo, NULL);
 		if (strstr(deviceInfo, "cl_khr_fp64") == NULL) {
-			printf("---OpenCL: Interop device doesn't support double precision! We cannot use it.\n");
-		}
-		else {
-			cl_context_properties properties[] = {
-				CL_GL_CONTEXT_KHR, (cl_context_properties) glfwGetGLXContext(render->window),
-				CL_GLX_DISPLAY_KHR, (cl_context_properties) glfwGetX11Display(),
-				CL_CONTEXT_PLATFORM, (cl_context_properties) (*platform)[checkPlatform],
-				0};
-			render->contextCL = clCreateContext(properties, 1, &device, NULL, 0, &err);
-			CheckOpenCLError(err, __LINE__);
+			printf("---OpenCL: Interop device doesn't support double precision! Using float-float kernel.\n");
+			render->emulateDouble = 1;
 		}
+		cl_context_properties properties[] = {
+			CL_GL_CONTEXT_KHR, (cl_context_properties) glfwGetGLXContext(render->window),
+			CL_GLX_DISPLAY_KHR, (cl_context_properties) glfwGetX11Display(),
+			CL_CONTEXT_PLATFORM, (cl_context_properties) (*platform)[checkPlatform],
+			0};
+		render->contextCL = clCreateContext(properties, 1, &device, NULL, 0, &err);
+		CheckOpenCLError(err, __LINE__);
 	}
 #endif
 
-	// if render->glclInterop is 0, either we are not trying to use it, we couldn't find an interop
-	// device, or we found an interop device but it doesn't support double precision.
-	// In these cases, have the user choose a platform and device manually.
+	// if render->glclInterop is 0, either we are not trying to use it, or we couldn't find an interop
+	// device. In these cases, have the user choose a platform and device manually.
 	if (!(render->glclInterop)) {
 		printf("Choose a platform and device.\n");
 		checkPlatform = numPlatforms;
@@ -942,16 +1294,16 @@ int InitialiseCLEnvironment(cl_platform_id **platform, cl_device_id ***device_id
 			scanf("%u", &chooseDevice);
 			if (chooseDevice >= numDevices[checkPlatform]) {
 				printf("Invalid Device choice.\n");
-			} else {
-				// Check the device we've chosen supports double precision
-				clGetDeviceInfo((*device_id)[checkPlatform][chooseDevice], CL_DEVICE_EXTENSIONS, sizeof(deviceInfo), deviceInfo, NULL);
-				if (strstr(deviceInfo, "cl_khr_fp64") == NULL) {
-					printf("---OpenCL: Interop device doesn't support double precision! We cannot use it.\n");
-					chooseDevice = numDevices[checkPlatform];
-				}
 			}
 		}
 
+		// Check whether the device we've chosen supports double precision
+		clGetDeviceInfo((*device_id)[checkPlatform][chooseDevice], CL_DEVICE_EXTENSIONS, sizeof(deviceInfo), deviceInfo, NULL);
+		if (strstr(deviceInfo, "cl_khr_fp64") == NULL) {
+			printf("---OpenCL: Device doesn't support double precision! Using float-float kernel.\n");
+			render->emulateDouble = 1;
+		}
+
 		// Create non-interop context
 		render->contextCL = clCreateContext(NULL, 1, &((*device_id)[checkPlatform][chooseDevice]), NULL, NULL, &err);
 		device = (*device_id)[checkPlatform][chooseDevice];
@@ -964,6 +1316,9 @@ int InitialiseCLEnvironment(cl_platform_id **platform, cl_device_id ***device_id
 	clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(render->deviceMaxAlloc), &(render->deviceMaxAlloc), NULL);
 	printf("---OpenCL: Selected device has CL_DEVICE_MAX_MEM_ALLOC_SIZE: %lfMB\n",
 	       render->deviceMaxAlloc/1024.0/1024.0);
+	// Also query the number of compute units, which determines the launch size of the persistent kernel
+	clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(render->deviceComputeUnits), &(render->deviceComputeUnits), NULL);
+	printf("---OpenCL: Selected device has CL_DEVICE_MAX_COMPUTE_UNITS: %u\n", render->deviceComputeUnits);
 
 	// create a command queue
 	render->queue = clCreateCommandQueue(render->contextCL, device, 0, &err);
@@ -979,7 +1334,14 @@ int InitialiseCLEnvironment(cl_platform_id **platform, cl_device_id ***device_id
 	}
 
 	//build program executable
-	err = clBuildProgram(*program, 0, NULL, "-I. -I src/", NULL, NULL);
+#ifdef OPENCLFORCEEMULATEDOUBLE
+	render->emulateDouble = 1;
+#endif
+	// The kernel includes config.h itself; pass on the formula, in case it was set on the command line
+	char buildOptions[256];
+	snprintf(buildOptions, sizeof(buildOptions), "-I. -I src/ -DFORMULA=%d -DMULTIBROTPOWER=%d -DJULIARE=%.17g -DJULIAIM=%.17g%s",
+	         FORMULA, MULTIBROTPOWER, JULIARE, JULIAIM, render->emulateDouble ? " -DEMULATEDOUBLE" : "");
+	err = clBuildProgram(*program, 0, NULL, buildOptions, NULL, NULL);
 	if (err != CL_SUCCESS) {
 		printf("Error in clBuildProgram: %d, line %d.\n", err, __LINE__);
 		char buffer[5000];
@@ -1,98 +1,377 @@
 #include "mandelbrot.h"
+#include "orbitdensity.h"
 
 
-void SetPixelColour(const int iter, const int maxIters, float mag, float *r, float *g, float *b, const double colourPeriod)
+// Fast approximate log2 of x > 0, accurate to about 2e-5. Split x into exponent and mantissa m in
+// [1,2), then log2(m) = 2/ln(2) * atanh(s) with s = (m-1)/(m+1), by the first terms of its series.
+static float FastLog2(const float x)
 {
-	// If pixel hit max iteration count, make it black
+	union { float f; uint32_t i; } bits = { x };
+	const float exponent = (float)((int)(bits.i >> 23) - 127);
+	bits.i = (bits.i & 0x007fffff) | 0x3f800000;
+	const float s = (bits.f - 1.0f)/(bits.f + 1.0f);
+	const float sSq = s*s;
+	return exponent + s*(2.8853901f + sSq*(0.96179669f + sSq*(0.57707801f + sSq*0.41219858f)));
+}
+
+
+
+float SmoothEscape(const int iter, const int maxIters, const float mag)
+{
+	// Pixels which hit max iteration count are marked with -1, and coloured black
 	if (iter == maxIters) {
-		*r = 0.0;
-		*g = 0.0;
-		*b = 0.0;
-		return;
+		return -1.0f;
 	}
-	// For non-black pixels, define a smoothed iteration count using the final
+	// For other pixels, define a smoothed iteration count using the final
 	// magnitude (passed in as argument).
 	// This is > 2, unless the pixel hit the max iteration count, handled above.
 	// We subtract a very slowely growing function of the magnitude, so very
 	// quickly diverging pixels look as if they diverged slightly (1, 2 iterations?)
-	// earlier than their iteration count suggests.
-	// Then compute its mod with a number of colour steps, so that it cycles
-	// through the gradient repeatedly, and scale it between 0 and 1.
-	float smooth = fmod((iter -log(log(mag)/log(2.0f))),colourPeriod)/colourPeriod;
-
-	if (smooth < 0.25) {
-		*r = 0.0;
-		*g = 0.5*smooth*4.0;
-		*b = 1.0*smooth*4.0;
-	}
-	else if (smooth < 0.5) {
-		*r = 1.0*(smooth-0.25)*4.0;
-		*g = 0.5 + 0.5*(smooth-0.25)*4.0;
-		*b = 1.0;
-	}
-	else if (smooth < 0.75) {
-		*r = 1.0;
-		*g = 1.0 - 0.5*(smooth-0.5)*4.0;
-		*b = 1.0 - (smooth-0.5)*4.0;
+	// earlier than their iteration count suggests. Clamp at zero, so that the
+	// sign is left to mark the pixels inside the set.
+	// ln(log2(mag)) = ln(2)*log2(log2(mag)), divided by log2 of the power of the formula
+	return fmaxf(0.0f, iter - 0.69314718f/log2f((float)FORMULA_POWER)*FastLog2(FastLog2(mag)));
+}
+
+
+
+float DistanceEscape(const int iter, const int maxIters, const double mag, const double dzMagSq,
+                     const double distanceScale)
+{
+	if (iter == maxIters) {
+		return -1.0f;
+	}
+	// |z| ln|z| / |dz/dc|
+	return (float)(0.5*sqrt(mag/dzMagSq)*log(mag)*distanceScale);
+}
+
+
+
+// Pixels per unit for distance estimates, or 0 if we are not using them
+static double DistanceScale(const imageStruct *image)
+{
+	return image->distanceEstimation ? 1.0/image->xStep : 0.0;
+}
+
+
+
+// hi+lo = a+b exactly, with hi the rounded sum
+static void TwoSum(const double a, const double b, double *hi, double *lo)
+{
+	*hi = a + b;
+	const double bVirtual = *hi - a;
+	*lo = (a - (*hi - bVirtual)) + (b - bVirtual);
+}
+
+
+
+void SetView(imageStruct *image, const double xCentre, const double yCentre, const double width)
+{
+	image->xCentre = xCentre;
+	image->xCentreLo = 0.0;
+	image->yCentre = yCentre;
+	image->yCentreLo = 0.0;
+	image->xStep = width/(double)image->xRes;
+	image->yStep = image->xStep;
+}
+
+
+
+void SetViewBounds(imageStruct *image, const double xMin, const double xMax, const double yMin, const double yMax)
+{
+	image->xStep = (xMax-xMin)/(double)image->xRes;
+	image->yStep = (yMax-yMin)/(double)image->yRes;
+	// The centre is xMin + xRes/2*xStep, to twice double precision
+	TwoSum(xMin, 0.5*(xMax-xMin), &(image->xCentre), &(image->xCentreLo));
+	TwoSum(yMin, 0.5*(yMax-yMin), &(image->yCentre), &(image->yCentreLo));
+}
+
+
+
+void MoveView(imageStruct *image, const double xShift, const double yShift)
+{
+	double hi, lo;
+	TwoSum(image->xCentre, xShift, &hi, &lo);
+	TwoSum(hi, lo + image->xCentreLo, &(image->xCentre), &(image->xCentreLo));
+	TwoSum(image->yCentre, yShift, &hi, &lo);
+	TwoSum(hi, lo + image->yCentreLo, &(image->yCentre), &(image->yCentreLo));
+}
+
+
+
+void CropRows(imageStruct *image, const unsigned rowStart, const unsigned rows)
+{
+	MoveView(image, 0.0, ((double)rowStart + 0.5*rows - 0.5*image->yRes)*image->yStep);
+	image->yRes = rows;
+}
+
+
+
+double ViewX(const imageStruct *image, const double x)
+{
+	return image->xCentre + ((x - 0.5*image->xRes)*image->xStep + image->xCentreLo);
+}
+
+
+
+double ViewY(const imageStruct *image, const double y)
+{
+	return image->yCentre + ((y - 0.5*image->yRes)*image->yStep + image->yCentreLo);
+}
+
+
+
+int ViewResolved(const imageStruct *image)
+{
+	return fabs(image->xStep) >= DBL_EPSILON*fabs(image->xCentre)
+	    && fabs(image->yStep) >= DBL_EPSILON*fabs(image->yCentre);
+}
+
+
+
+// The point of the plane at pixel x, y, which may be fractional. For exponential maps, the view's x is
+// the angle and y the log of the distance from the origin.
+static void PlanePoint(const imageStruct *image, const double x, const double y, double *Rec, double *Imc)
+{
+	if (image->expMap) {
+		const double r = exp(ViewY(image, y));
+		*Rec = image->xOrigin + r*cos(ViewX(image, x));
+		*Imc = image->yOrigin + r*sin(ViewX(image, x));
 	}
 	else {
-		*r = (1.0-(smooth-0.75)*4.0);
-		*g = 0.5*(1.0-(smooth-0.75)*4.0);
-		*b = 0.0;
+		*Rec = ViewX(image, x);
+		*Imc = ViewY(image, y);
 	}
+}
 
+
+
+// Compute the coordinates of image's columns and rows into coords, so that the renderers' inner loops
+// need only look them up (and, for exponential maps, multiply). Free coords->Re when done.
+static void FrameCoordinates(const imageStruct *image, coordinatesStruct *coords)
+{
+	coords->Re = malloc((2*(size_t)image->xRes + image->yRes) * sizeof *(coords->Re));
+	coords->sinAngle = coords->Re + image->xRes;
+	coords->Im = coords->sinAngle + image->xRes;
+
+	for (unsigned x = 0; x < image->xRes; x++) {
+		const double viewX = ViewX(image, (double)x);
+		coords->Re[x] = image->expMap ? cos(viewX) : viewX;
+		coords->sinAngle[x] = image->expMap ? sin(viewX) : 0.0;
+	}
+	for (unsigned y = 0; y < image->yRes; y++) {
+		const double viewY = ViewY(image, (double)y);
+		coords->Im[y] = image->expMap ? exp(viewY) : viewY;
+	}
 }
 
 
 
-void RenderMandelbrotCPU(renderStruct *render, imageStruct *image)
+// The point of the plane at pixel x, y, from the frame's coordinates
+static inline void PixelPoint(const imageStruct *image, const coordinatesStruct *coords,
+                              const unsigned x, const unsigned y, double *Rec, double *Imc)
 {
+	if (image->expMap) {
+		*Rec = image->xOrigin + coords->Im[y]*coords->Re[x];
+		*Imc = image->yOrigin + coords->Im[y]*coords->sinAngle[x];
+	}
+	else {
+		*Rec = coords->Re[x];
+		*Imc = coords->Im[y];
+	}
+}
+
 
-	if (image->xMin == ((1.0-(1.0/(double)image->xRes))*image->xMin + (1.0-(1.0/(double)image->xRes))*image->xMax)
-	 || image->yMin == ((1.0-(1.0/(double)image->yRes))*image->yMin + (1.0-(1.0/(double)image->xRes))*image->yMax)) {
-		printf("PRECISION WARNING!\n");
+
+void BuildPaletteLUT(float *paletteLUT)
+{
+	static const float palette[3*PALETTESTOPS] = PALETTE;
+
+	for (int i = 0; i <= PALETTELUTSIZE; i++) {
+		// The palette is cyclic, entry PALETTELUTSIZE is the same as entry 0
+		const float position = (float)PALETTESTOPS * (i % PALETTELUTSIZE) / PALETTELUTSIZE;
+		const int stop = (int)position;
+		const int next = (stop+1) % PALETTESTOPS;
+		const float frac = position - stop;
+		for (int c = 0; c < 3; c++) {
+			paletteLUT[3*i+c] = (1.0f-frac)*palette[3*stop+c] + frac*palette[3*next+c];
+		}
 	}
 
-	// For each pixel, iterate and store the iteration number when |z|>2 or maxIters
-	#pragma omp parallel for default(none) shared(image) schedule(dynamic)
-	for (unsigned y = 0; y < image->yRes; y++) {
-		for (unsigned x = 0; x < image->xRes; x++) {
+	// Black, for pixels inside the set
+	for (int c = 0; c < 3; c++) {
+		paletteLUT[3*(PALETTELUTSIZE+1)+c] = 0.0f;
+	}
+}
 
-			unsigned iter = 0;
-			double u = 0.0, v = 0.0, uNew, vNew;
-			double uSq = 0.0;
-			double vSq = 0.0;
-			const double xPix = ((double)x/(double)image->xRes);
-			const double yPix = ((double)y/(double)image->yRes);
-			const double Rec = (1.0-xPix)*image->xMin + xPix*image->xMax;
-			const double Imc = (1.0-yPix)*image->yMin + yPix*image->yMax;
 
 
-#ifdef EARLYBAIL
-	// early bail-out if point is inside cardioid or period 2 bulb
-	const double q = (Rec - 0.25)*(Rec - 0.25) + Imc*Imc;
-	if ((q*(q+(Rec-0.25)) < (Imc*Imc*0.25)) || ((Rec+1.0)*(Rec+1.0) + Imc*Imc < 1.0/16.0)) {
-		iter = image->maxIters;
+// Position of escape value in the histogram, in [0,HISTOGRAMBINS]
+static inline float HistogramBin(const imageStruct *image, const float escape)
+{
+	const float width = (image->escapeMax > image->escapeMin) ? (image->escapeMax-image->escapeMin) : 1.0f;
+	return fminf((float)HISTOGRAMBINS, fmaxf(0.0f, (escape-image->escapeMin)/width*HISTOGRAMBINS));
+}
+
+
+
+// Index into the palette LUT of a smoothed escape count. Either cycle through the gradient every
+// colourPeriod iterations or, if histogramColouring, HISTOGRAMCYCLES times over the cumulative
+// distribution of escape values. For distance estimates, go from the start of the palette at the
+// boundary to the middle of it DISTANCEWIDTH pixels away. This is written so that loops over it
+// vectorize.
+static inline int PaletteIndex(const imageStruct *image, const float escape)
+{
+	float position;
+	if (image->distanceEstimation) {
+		position = 0.5f*sqrtf(fminf(1.0f, fmaxf(0.0f, escape)/DISTANCEWIDTH));
 	}
-#endif
+	else if (image->histogramColouring) {
+		const float bin = HistogramBin(image, escape);
+		const int lower = (bin < HISTOGRAMBINS-1) ? (int)bin : HISTOGRAMBINS-1;
+		// interpolate within the bin
+		const float cdf = image->histogramCDF[lower] + (bin-lower)*(image->histogramCDF[lower+1]-image->histogramCDF[lower]);
+		position = cdf*HISTOGRAMCYCLES;
+		position -= floorf(position);
+	}
+	else {
+		// in double precision, as escape/colourPeriod can be large
+		const double turns = escape/image->colourPeriod;
+		position = (float)(turns - floor(turns));
+	}
+	return (escape < 0.0f) ? PALETTELUTSIZE+1 : (int)(position*PALETTELUTSIZE + 0.5f);
+}
 
 
-			// mandelbrot iterations
-			while ( (uSq+vSq) <= 4.0 && iter < image->maxIters) {
-				uNew = uSq-vSq + Rec;
-				uSq = uNew*uNew;
-				vNew = 2.0*u*v + Imc;
-				vSq = vNew*vNew;
-				u = uNew;
-				v = vNew;
-				iter++;
+
+// Set r,g,b from a smoothed escape count
+static void EscapeColour(const imageStruct *image, const float escape, float *r, float *g, float *b)
+{
+	const int index = PaletteIndex(image, escape);
+	*r = image->paletteLUT[3*index+0];
+	*g = image->paletteLUT[3*index+1];
+	*b = image->paletteLUT[3*index+2];
+}
+
+
+
+// Colour n pixels from their escape counts, in blocks: compute the palette indices in a loop which
+// vectorizes, then copy the colours from the LUT.
+#define COLOURBLOCK 256
+static void ColourPixels(const imageStruct *image, const float * restrict escape, float * restrict pixels,
+                         const size_t n)
+{
+	int index[COLOURBLOCK];
+	const float *paletteLUT = image->paletteLUT;
+
+	for (size_t start = 0; start < n; start += COLOURBLOCK) {
+		const int len = (n-start < COLOURBLOCK) ? (int)(n-start) : COLOURBLOCK;
+
+		#pragma omp simd
+		for (int i = 0; i < len; i++) {
+			index[i] = PaletteIndex(image, escape[start+i]);
+		}
+
+		for (int i = 0; i < len; i++) {
+			pixels[3*(start+i)+0] = paletteLUT[3*index[i]+0];
+			pixels[3*(start+i)+1] = paletteLUT[3*index[i]+1];
+			pixels[3*(start+i)+2] = paletteLUT[3*index[i]+2];
+		}
+	}
+}
+
+
+
+// Build the cumulative distribution of the escape values of the pixels outside the set, for histogram
+// colouring. Each thread bins its share of the pixels into its own histogram; these are merged and
+// summed at the end.
+static void BuildHistogram(imageStruct *image)
+{
+	const size_t nPixels = (size_t)image->xRes*image->yRes;
+	const float *escape = image->escape;
+
+	// Range of escape values, binned linearly
+	float escapeMin = FLT_MAX;
+	float escapeMax = 0.0f;
+	#pragma omp parallel for default(none) shared(escape) firstprivate(nPixels) reduction(min:escapeMin) reduction(max:escapeMax)
+	for (size_t i = 0; i < nPixels; i++) {
+		if (escape[i] >= 0.0f) {
+			escapeMin = fminf(escapeMin, escape[i]);
+			escapeMax = fmaxf(escapeMax, escape[i]);
+		}
+	}
+	image->escapeMin = escapeMin;
+	image->escapeMax = escapeMax;
+
+	const int nThreads = omp_get_max_threads();
+	unsigned *histograms = calloc((size_t)nThreads*HISTOGRAMBINS, sizeof *histograms);
+
+	#pragma omp parallel default(none) shared(image,escape,histograms) firstprivate(nPixels) num_threads(nThreads)
+	{
+		unsigned *histogram = &(histograms[omp_get_thread_num()*HISTOGRAMBINS]);
+		#pragma omp for schedule(static)
+		for (size_t i = 0; i < nPixels; i++) {
+			if (escape[i] >= 0.0f) {
+				const int bin = (int)HistogramBin(image, escape[i]);
+				histogram[(bin < HISTOGRAMBINS-1) ? bin : HISTOGRAMBINS-1]++;
 			}
+		}
+	}
+
+	// Merge and prefix sum
+	unsigned total = 0;
+	for (int bin = 0; bin < HISTOGRAMBINS; bin++) {
+		image->histogramCDF[bin] = total;
+		for (int t = 0; t < nThreads; t++) {
+			total += histograms[t*HISTOGRAMBINS + bin];
+		}
+	}
+	image->histogramCDF[HISTOGRAMBINS] = total;
+	for (int bin = 0; bin <= HISTOGRAMBINS; bin++) {
+		image->histogramCDF[bin] /= (total > 0) ? total : 1;
+	}
+
+	free(histograms);
+}
+
 
-			SetPixelColour(iter, image->maxIters, uSq+vSq, &(image->pixels[y*image->xRes*3+x*3+0]),
-			               &(image->pixels[y*image->xRes*3+x*3+1]),&(image->pixels[y*image->xRes*3+x*3+2]),
-			               image->colourPeriod);
 
+int RenderCancelled(const renderStruct *render)
+{
+	int cancel = 0;
+	if (render->cancel != NULL) {
+		#pragma omp atomic read
+		cancel = *(render->cancel);
+	}
+	return cancel;
+}
+
+
+
+void RecolourMandelbrotCPU(renderStruct *render, imageStruct *image)
+{
+	if (render->shaderColouring) {
+		// Build the histogram whether it's used or not, so that switching to it needs no recolour
+		if (!image->distanceEstimation) {
+			BuildHistogram(image);
 		}
+		return;
+	}
+
+	if (image->histogramColouring && !image->distanceEstimation) {
+		BuildHistogram(image);
+	}
+
+	// Colour a row at a time
+	#pragma omp parallel for default(none) shared(image) schedule(static)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		ColourPixels(image, &(image->escape[(size_t)y*image->xRes]), &(image->pixels[(size_t)y*image->xRes*3]), image->xRes);
+	}
+
+	// Supersampling is slow, and not worth starting for a frame which will be thrown away. Orbit
+	// densities can't be sampled at a point, so aren't supersampled.
+	if (image->supersample == 1 && !image->orbitDensity && !RenderCancelled(render)) {
+		AdaptiveSupersample(image);
 	}
 
 	if (image->gaussianBlur == 1) {
@@ -106,36 +385,444 @@ void RenderMandelbrotCPU(renderStruct *render, imageStruct *image)
 
 
 
+#ifdef EARLYBAIL
+int InteriorPoint(const double Rec, const double Imc)
+{
+	const double ImcSq = Imc*Imc;
+	const double q = (Rec - 0.25)*(Rec - 0.25) + ImcSq;
+	const double ImcAbs = fabs(Imc);
+	return (q*(q+(Rec-0.25)) < (ImcSq*0.25))
+	    || ((Rec+1.0)*(Rec+1.0) + ImcSq < 1.0/16.0)
+	    || ((Rec-BULB3X)*(Rec-BULB3X) + (ImcAbs-BULB3Y)*(ImcAbs-BULB3Y) < BULB3RSQ)
+	    || ((Rec-BULB4X)*(Rec-BULB4X) + (ImcAbs-BULB4Y)*(ImcAbs-BULB4Y) < BULB4RSQ)
+	    || ((Rec-BULB4BX)*(Rec-BULB4BX) + (ImcAbs-BULB4BY)*(ImcAbs-BULB4BY) < BULB4BRSQ);
+}
+#endif
+
+
+// Iterate point Rec + i*Imc on from iteration iter, with z = orbit[0] + i*orbit[1], to maxIters. Return
+// the final iteration count, leave the final z in orbit and set *mag to the final magnitude.
+static unsigned IteratePoint(const double Rec, const double Imc, unsigned iter, const unsigned maxIters,
+                             double *orbit, double *mag)
+{
+	double u = orbit[0], v = orbit[1];
+	double uSq = u*u;
+	double vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+
+#ifdef EARLYBAIL
+	// early bail-out if point is inside cardioid or one of the larger bulbs
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0;
+		return maxIters;
+	}
+#endif
+
+	// mandelbrot iterations
+	while ( (uSq+vSq) <= 4.0 && iter < maxIters) {
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+		iter++;
+	}
+
+	orbit[0] = u;
+	orbit[1] = v;
+	*mag = uSq+vSq;
+	return iter;
+}
+
+
+// As IteratePoint, also computing the derivative dz/dc = orbit[2] + i*orbit[3], for distance estimates.
+// Iterate until |z|^2 > DISTANCEBAILOUT and set *dzMagSq to the final |dz/dc|^2.
+static unsigned IteratePointDistance(const double Rec, const double Imc, unsigned iter, const unsigned maxIters,
+                                     double *orbit, double *mag, double *dzMagSq)
+{
+	double u = orbit[0], v = orbit[1];
+	double uSq = u*u;
+	double vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+	double du = orbit[2], dv = orbit[3];
+
+#ifdef EARLYBAIL
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0;
+		*dzMagSq = 1.0;
+		return maxIters;
+	}
+#endif
+
+	while ( (uSq+vSq) <= DISTANCEBAILOUT && iter < maxIters) {
+		// dz = f'(z)*dz + 1
+		FORMULA_DSTEP(double, u, v, du, dv);
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+		iter++;
+	}
+
+	orbit[0] = u;
+	orbit[1] = v;
+	orbit[2] = du;
+	orbit[3] = dv;
+	*mag = uSq+vSq;
+	*dzMagSq = du*du + dv*dv;
+	return iter;
+}
+
+
+// Iterate point Rec + i*Imc on from iteration iter and orbit, as IteratePoint, and return its escape
+// value: the smoothed escape count or, if distanceScale > 0, the distance estimate (see DistanceEscape).
+static float OrbitEscape(const double Rec, const double Imc, const unsigned iter, const unsigned maxIters,
+                         const double distanceScale, double *orbit)
+{
+	double mag;
+	if (distanceScale > 0.0) {
+		double dzMagSq;
+		const unsigned finalIter = IteratePointDistance(Rec, Imc, iter, maxIters, orbit, &mag, &dzMagSq);
+		return DistanceEscape(finalIter, maxIters, mag, dzMagSq, distanceScale);
+	}
+	const unsigned finalIter = IteratePoint(Rec, Imc, iter, maxIters, orbit, &mag);
+	return SmoothEscape(finalIter, maxIters, mag);
+}
+
+
+// Iterate point Rec + i*Imc from the start, and return its escape value
+static float PointEscape(const double Rec, const double Imc, const unsigned maxIters, const double distanceScale)
+{
+	double orbit[4] = {FORMULA_Z0(Rec, 0.0), FORMULA_Z0(Imc, 0.0), FORMULA_DZ0, 0.0};
+	return OrbitEscape(Rec, Imc, 0, maxIters, distanceScale, orbit);
+}
+
+
+
+// If image's escape counts and orbits are of a render of the same view with a lower maxIters, return its
+// maxIters, else 0. Clear orbitIters, as the orbits are changed by the render, and until it is complete.
+static unsigned ResumeIters(imageStruct *image)
+{
+	const unsigned orbitIters = (image->orbits != NULL && image->orbitIters < image->maxIters) ? image->orbitIters : 0;
+	image->orbitIters = 0;
+	return orbitIters;
+}
+
+
+
+void RenderMandelbrotCPU(renderStruct *render, imageStruct *image)
+{
+	if (image->orbitDensity) {
+		RenderOrbitDensityCPU(render, image);
+		return;
+	}
+
+	if (!ViewResolved(image)) {
+		fprintf(stderr, "PRECISION WARNING!\n");
+	}
+
+	const double distanceScale = DistanceScale(image);
+	coordinatesStruct coords;
+	FrameCoordinates(image, &coords);
+	// If the last render was of this view, only pixels which reached its maxIters need iterating further
+	const unsigned resumeIters = ResumeIters(image);
+
+	// For each pixel, iterate and store the smoothed escape count, or distance estimate
+	#pragma omp parallel for default(none) shared(image,render,coords) firstprivate(distanceScale, resumeIters) schedule(dynamic)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		// If cancelled, skip the remaining rows
+		if (RenderCancelled(render)) {
+			continue;
+		}
+		for (unsigned x = 0; x < image->xRes; x++) {
+			const size_t pixel = (size_t)y*image->xRes+x;
+			if (resumeIters > 0 && image->escape[pixel] >= 0.0f) {
+				continue;
+			}
+
+			double Rec, Imc;
+			PixelPoint(image, &coords, x, y, &Rec, &Imc);
+
+			double pixelOrbit[4];
+			double *orbit = (image->orbits != NULL) ? &(image->orbits[ORBITVALUES*pixel]) : pixelOrbit;
+			if (resumeIters == 0) {
+				orbit[0] = FORMULA_Z0(Rec, 0.0);
+				orbit[1] = FORMULA_Z0(Imc, 0.0);
+				orbit[2] = FORMULA_DZ0;
+				orbit[3] = 0.0;
+			}
+			image->escape[pixel] = OrbitEscape(Rec, Imc, resumeIters, image->maxIters, distanceScale, orbit);
+
+		}
+	}
+	free(coords.Re);
+
+	if (RenderCancelled(render)) {
+		return;
+	}
+	image->orbitIters = image->maxIters;
+	RecolourMandelbrotCPU(render, image);
+}
+
+
+
+float Jitter(const unsigned x, const unsigned y, const unsigned s)
+{
+	uint32_t h = (x * 0x8da6b343u) ^ (y * 0xd8163841u) ^ (s * 0xcb1ab31fu);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (float)(h >> 8) / 16777216.0f;
+}
+
+
+
+void AdaptiveSupersample(imageStruct *image)
+{
+	// Subsamples are computed in double precision. Don't bother if it can't resolve them (GMP zooms).
+	if (fabs(image->xStep)/SUPERSAMPLEN < 16.0*DBL_EPSILON*fabs(image->xCentre)) {
+		return;
+	}
+
+	const double distanceScale = DistanceScale(image);
+
+	// Find edge pixels first, since we overwrite the colours as we go.
+	unsigned char *edge = malloc(image->xRes * image->yRes * sizeof *edge);
+
+	#pragma omp parallel for default(none) shared(image,edge) schedule(static)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		const unsigned yu = (y == image->yRes-1) ? y : y+1;
+		const unsigned yd = (y == 0) ? y : y-1;
+		for (unsigned x = 0; x < image->xRes; x++) {
+			const unsigned xl = (x == 0) ? x : x-1;
+			const unsigned xr = (x == image->xRes-1) ? x : x+1;
+			const unsigned neighbours[4] = {y*image->xRes+xl, y*image->xRes+xr, yd*image->xRes+x, yu*image->xRes+x};
+			const float *pixel = &(image->pixels[(y*image->xRes+x)*3]);
+			const int inside = (image->escape[y*image->xRes+x] < 0.0f);
+
+			// Edge if colours differ, or one pixel is inside the set and the other isn't, or if the
+			// boundary is within a pixel by the distance estimate
+			edge[y*image->xRes+x] = (image->distanceEstimation && !inside && image->escape[y*image->xRes+x] < 1.0f);
+			for (int n = 0; n < 4 && !edge[y*image->xRes+x]; n++) {
+				const float *neighbour = &(image->pixels[neighbours[n]*3]);
+				const float diff = fabsf(pixel[0]-neighbour[0]) + fabsf(pixel[1]-neighbour[1]) + fabsf(pixel[2]-neighbour[2]);
+				if (diff > SUPERSAMPLETHRESHOLD || inside != (image->escape[neighbours[n]] < 0.0f)) {
+					edge[y*image->xRes+x] = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	// Replace edge pixels with the average colour of SUPERSAMPLEN*SUPERSAMPLEN jittered samples.
+	// This is where nearly all of the time is spent, and it is concentrated along the boundary.
+	#pragma omp parallel for default(none) shared(image,edge) firstprivate(distanceScale) schedule(dynamic)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		for (unsigned x = 0; x < image->xRes; x++) {
+			if (!edge[y*image->xRes+x]) {
+				continue;
+			}
+
+			float rSum = 0.0f, gSum = 0.0f, bSum = 0.0f;
+			for (unsigned s = 0; s < SUPERSAMPLEN*SUPERSAMPLEN; s++) {
+				const float dx = ((s%SUPERSAMPLEN) + Jitter(x, y, 2*s)) / SUPERSAMPLEN - 0.5f;
+				const float dy = ((s/SUPERSAMPLEN) + Jitter(x, y, 2*s+1)) / SUPERSAMPLEN - 0.5f;
+				double Rec, Imc;
+				PlanePoint(image, (double)x+dx, (double)y+dy, &Rec, &Imc);
+
+				float r, g, b;
+				EscapeColour(image, PointEscape(Rec, Imc, image->maxIters, distanceScale), &r, &g, &b);
+				rSum += r;
+				gSum += g;
+				bSum += b;
+			}
+
+			image->pixels[(y*image->xRes+x)*3+0] = rSum / (SUPERSAMPLEN*SUPERSAMPLEN);
+			image->pixels[(y*image->xRes+x)*3+1] = gSum / (SUPERSAMPLEN*SUPERSAMPLEN);
+			image->pixels[(y*image->xRes+x)*3+2] = bSum / (SUPERSAMPLEN*SUPERSAMPLEN);
+		}
+	}
+
+	free(edge);
+}
+
+
+
+unsigned AutoMaxIters(const renderStruct *render, const imageStruct *image)
+{
+	// Sample grid, with the aspect ratio of the image
+	const unsigned xSamples = AUTOITERSSAMPLES;
+	const unsigned ySamples = (unsigned)fmax(1.0, AUTOITERSSAMPLES*(double)image->yRes/(double)image->xRes);
+	const unsigned nSamples = xSamples*ySamples;
+
+	// Per-sample iteration state, so that each round continues where the last one stopped. active
+	// lists the samples which have not yet escaped.
+	double *Rec = malloc(nSamples * sizeof *Rec);
+	double *Imc = malloc(nSamples * sizeof *Imc);
+	double *u = malloc(nSamples * sizeof *u);
+	double *v = malloc(nSamples * sizeof *v);
+	unsigned *iter = malloc(nSamples * sizeof *iter);
+	unsigned *active = malloc(nSamples * sizeof *active);
+
+	// Histogram of escape counts, AUTOITERSBINSPEROCTAVE log-spaced bins per factor of two
+	unsigned histogram[AUTOITERSBINS] = {0};
+
+	unsigned nActive = 0;
+	for (unsigned y = 0; y < ySamples; y++) {
+		for (unsigned x = 0; x < xSamples; x++) {
+			const unsigned i = y*xSamples+x;
+			Rec[i] = ViewX(image, ((double)x+0.5)/(double)xSamples*(double)image->xRes);
+			Imc[i] = ViewY(image, ((double)y+0.5)/(double)ySamples*(double)image->yRes);
+			u[i] = FORMULA_Z0(Rec[i], 0.0);
+			v[i] = FORMULA_Z0(Imc[i], 0.0);
+			iter[i] = 0;
+
+#ifdef EARLYBAIL
+			// points inside the cardioid or one of the larger bulbs never escape, don't iterate them
+			if (InteriorPoint(Rec[i], Imc[i])) {
+				continue;
+			}
+#endif
+			active[nActive++] = i;
+		}
+	}
+
+	// Iterate the remaining samples in rounds, doubling the iteration cap each time, until samples have
+	// started escaping and then two rounds pass in which (almost) none do. The rest are taken to be
+	// inside the set. In deep zooms no sample may escape for the first few rounds.
+	unsigned cap = AUTOITERSPROBE;
+	unsigned prevCap = 0;
+	unsigned totalEscaped = 0;
+	int quietRounds = 0;
+	double work = 0.0;
+	while (nActive > 0) {
+		work += (double)nActive*(cap-prevCap);
+		#pragma omp parallel for default(none) shared(render,Rec,Imc,u,v,iter,active) firstprivate(nActive,cap) schedule(dynamic,16)
+		for (unsigned a = 0; a < nActive; a++) {
+			if (RenderCancelled(render)) {
+				continue;
+			}
+			const unsigned i = active[a];
+			double uLocal = u[i], vLocal = v[i];
+			double uSq = uLocal*uLocal;
+			double vSq = vLocal*vLocal;
+			const double cRe = FORMULA_C(Rec[i], JULIARE), cIm = FORMULA_C(Imc[i], JULIAIM);
+			unsigned iterLocal = iter[i];
+			while ( (uSq+vSq) <= 4.0 && iterLocal < cap) {
+				FORMULA_STEP(uLocal, vLocal, uSq, vSq, cRe, cIm);
+				iterLocal++;
+			}
+			u[i] = uLocal;
+			v[i] = vLocal;
+			iter[i] = iterLocal;
+		}
+
+		// Bin the samples which escaped, and remove them from the active list
+		unsigned escaped = 0;
+		unsigned stillActive = 0;
+		for (unsigned a = 0; a < nActive; a++) {
+			const unsigned i = active[a];
+			if (u[i]*u[i]+v[i]*v[i] > 4.0) {
+				// (Julia set samples may start outside, with no iterations)
+				int bin = (iter[i] > 0) ? (int)(AUTOITERSBINSPEROCTAVE*log2((double)iter[i])) : 0;
+				bin = (bin > AUTOITERSBINS-1) ? AUTOITERSBINS-1 : bin;
+				histogram[bin]++;
+				escaped++;
+			}
+			else {
+				active[stillActive++] = i;
+			}
+		}
+		nActive = stillActive;
+		totalEscaped += escaped;
+
+		if (totalEscaped > AUTOITERSTAIL*nSamples && escaped <= AUTOITERSTAIL*nSamples) {
+			quietRounds++;
+		}
+		else {
+			quietRounds = 0;
+		}
+		if (quietRounds == 2 || cap >= AUTOITERSMAX/2 || work + (double)nActive*cap > AUTOITERSWORK
+		 || RenderCancelled(render)) {
+			break;
+		}
+		prevCap = cap;
+		cap *= 2;
+	}
+
+	// Choose the smallest maxIters for which at most AUTOITERSTAIL of the samples escape later,
+	// rounding up to the upper edge of the bin.
+	unsigned tail = 0;
+	int bin = AUTOITERSBINS-1;
+	while (bin > 0 && tail + histogram[bin] <= AUTOITERSTAIL*nSamples) {
+		tail += histogram[bin];
+		bin--;
+	}
+	const double maxIters = ceil(pow(2.0, (double)(bin+1)/AUTOITERSBINSPEROCTAVE));
+
+	free(Rec);
+	free(Imc);
+	free(u);
+	free(v);
+	free(iter);
+	free(active);
+
+	// If (almost) nothing escaped, we know nothing about the view: leave maxIters alone. Likewise if
+	// cancelled, as the rounds are incomplete.
+	if (totalEscaped <= AUTOITERSTAIL*nSamples || RenderCancelled(render)) {
+		return image->maxIters;
+	}
+	return (unsigned)fmin(AUTOITERSMAX, fmax(MINITERS, maxIters));
+}
+
+
+
 #ifdef WITHGMP
 // Routine using GMP library for high precision. High precision variables have prefix "m".
 void RenderMandelbrotGMPCPU(renderStruct *render, imageStruct *image)
 {
+	// Orbits which reach a deep view are too rare to sample, so this needs no high precision version
+	if (image->orbitDensity) {
+		RenderOrbitDensityCPU(render, image);
+		return;
+	}
 
 	// 256 bit floats
 	mpf_set_default_prec(GMPPRECISION);
 
 	// x,y loop invariant:
-	mpf_t mtwo, mfour;
-	mpf_init_set_ui(mtwo, (unsigned long)2);
-	mpf_init_set_ui(mfour, (unsigned long)4);
-	mpf_t mxMin, mxMax, myMin, myMax;
-	mpf_init_set_d(mxMin, image->xMin);
-	mpf_init_set_d(mxMax, image->xMax);
-	mpf_init_set_d(myMin, image->yMin);
-	mpf_init_set_d(myMax, image->yMax);
-	mpf_t mxRes, myRes;
-	mpf_init_set_si(mxRes, image->xRes);
-	mpf_init_set_si(myRes, image->yRes);
+	mpf_t mzero, mbailout;
+	mpf_init(mzero);
+	// fixed parameter c of Julia sets
+	mpf_t mjuliaRe, mjuliaIm;
+	mpf_init_set_d(mjuliaRe, JULIARE);
+	mpf_init_set_d(mjuliaIm, JULIAIM);
+	// escape radius squared: 4, or larger for distance estimates
+	const double distanceScale = DistanceScale(image);
+	mpf_init_set_d(mbailout, (distanceScale > 0.0) ? DISTANCEBAILOUT : 4.0);
+	// centre of the view, to the precision it is held, and the pixel spacing
+	mpf_t mxCentre, myCentre, mxStep, myStep, mcentreLo;
+	mpf_init_set_d(mxCentre, image->xCentre);
+	mpf_init_set_d(myCentre, image->yCentre);
+	mpf_init_set_d(mcentreLo, image->xCentreLo);
+	mpf_add(mxCentre, mxCentre, mcentreLo);
+	mpf_set_d(mcentreLo, image->yCentreLo);
+	mpf_add(myCentre, myCentre, mcentreLo);
+	mpf_clear(mcentreLo);
+	mpf_init_set_d(mxStep, image->xStep);
+	mpf_init_set_d(myStep, image->yStep);
+	mpf_t mxOrigin, myOrigin;
+	mpf_init_set_d(mxOrigin, image->xOrigin);
+	mpf_init_set_d(myOrigin, image->yOrigin);
 
 
 	// For each pixel, iterate and store the iteration number when |z|>2 or maxIters
-	#pragma omp parallel for default(none) shared(image,mtwo,mfour,mxMin,mxMax,myMin,myMax,mxRes,myRes) schedule(dynamic)
+	#pragma omp parallel for default(none) shared(image,render,mzero,mjuliaRe,mjuliaIm,mbailout,mxCentre,myCentre,mxStep,myStep,mxOrigin,myOrigin) firstprivate(distanceScale) schedule(dynamic)
 	for (unsigned y = 0; y < image->yRes; y++) {
+		if (RenderCancelled(render)) {
+			continue;
+		}
 
-		// x loop invariant
-		mpf_t myPix;
-		mpf_init(myPix);
-		mpf_ui_div(myPix, (unsigned long)y, myRes);
+		// x loop invariant: the row's imaginary part. The offset in pixels is exact in double precision.
+		mpf_t myRow;
+		mpf_init_set_d(myRow, (double)y - 0.5*image->yRes);
+		mpf_mul(myRow, myRow, myStep);
+		mpf_add(myRow, myRow, myCentre);
 
 		// init x-dependent mpf_t here, set inside loop
 		mpf_t mu, mv, muNew, muSq, mvSq, mmag;
@@ -145,14 +832,12 @@ void RenderMandelbrotGMPCPU(renderStruct *render, imageStruct *image)
 		mpf_init(muSq);
 		mpf_init(mvSq);
 		mpf_init(mmag);
-		mpf_t mxPix, mRec, mImc;
-		mpf_init(mxPix);
+		mpf_t mRec, mImc;
 		mpf_init(mRec);
 		mpf_init(mImc);
-		mpf_t mxtmp1,mxtmp2;
+		mpf_t mxtmp1;
 		mpf_t mytmp1,mytmp2;
 		mpf_init(mxtmp1);
-		mpf_init(mxtmp2);
 		mpf_init(mytmp1);
 		mpf_init(mytmp2);
 
@@ -160,60 +845,62 @@ void RenderMandelbrotGMPCPU(renderStruct *render, imageStruct *image)
 		for (unsigned x = 0; x < image->xRes; x++) {
 
 			unsigned iter = 0;
+			// derivative dz/dc for distance estimates, which doesn't need multiple precision
+			double du = FORMULA_DZ0, dv = 0.0;
+
+			mpf_set_d(mRec, (double)x - 0.5*image->xRes);
+			mpf_mul(mRec, mRec, mxStep);
+			mpf_add(mRec, mRec, mxCentre);
+			mpf_set(mImc, myRow);
+
+			if (image->expMap) {
+				// The view is of the angle and log distance from the origin, which, as the offset
+				// from the origin, only need double precision.
+				const double r = exp(ViewY(image, (double)y));
+				const double theta = ViewX(image, (double)x);
+				mpf_set_d(mxtmp1, r*cos(theta));
+				mpf_set_d(mytmp1, r*sin(theta));
+				mpf_add(mRec, mxOrigin, mxtmp1);
+				mpf_add(mImc, myOrigin, mytmp1);
+			}
 
-			// set mu and mv to zero initially
-			unsigned long zero = 0;
-			mpf_set_ui(mu, zero);
-			mpf_set_ui(mv, zero);
-			mpf_set_ui(muSq, zero);
-			mpf_set_ui(mvSq, zero);
-			mpf_set_ui(mmag, zero);
-
-			mpf_ui_div(mxPix, (unsigned long)x, mxRes);
-
-			mpf_ui_sub(mxtmp1, 1, mxPix); // xtmp1 = 1-xPix
-			mpf_ui_sub(mytmp1, 1, myPix); // ytmp1 = 1-yPix
-
-			mpf_mul(mxtmp2, mxtmp1, mxMin); // xtmp2 = (1-xPix)*xMin
-			mpf_mul(mytmp2, mytmp1, myMin); // ytmp2 = (1-yPix)*yMin
-
-			mpf_mul(mxtmp1, mxPix, mxMax); // xtmp1 = xPix*xMax
-			mpf_mul(mytmp1, myPix, myMax); // ytmp1 = yPix*yMax
-
-			mpf_add(mRec, mxtmp1, mxtmp2);
-			mpf_add(mImc, mytmp1, mytmp2); // all tmp vars available
-
-
-			while ( mpf_cmp(mmag, mfour) <= 0 && iter < image->maxIters) {
-				mpf_sub(mxtmp1, muSq, mvSq);
-				mpf_add(muNew, mxtmp1, mRec); // uNew = uSq - vSq + Rec
-
-				mpf_mul(mytmp1, mtwo, mu);
-				mpf_mul(mytmp2, mytmp1, mv);
-				mpf_add(mv, mytmp2, mImc); // v = 2*u*v + Imc
-
-				mpf_set(mu, muNew);
+			// initial z: zero, or the point itself for Julia sets
+			mpf_set(mu, FORMULA_Z0(mRec, mzero));
+			mpf_set(mv, FORMULA_Z0(mImc, mzero));
+			mpf_mul(muSq, mu, mu);
+			mpf_mul(mvSq, mv, mv);
+			mpf_add(mmag, muSq, mvSq);
+
+			while ( mpf_cmp(mmag, mbailout) <= 0 && iter < image->maxIters) {
+				if (distanceScale > 0.0) {
+					// dz = f'(z)*dz + 1
+					const double u = mpf_get_d(mu);
+					const double v = mpf_get_d(mv);
+					FORMULA_DSTEP(double, u, v, du, dv);
+				}
 
-				// update squares and magnitude
-				mpf_mul(muSq, mu, mu);
-				mpf_mul(mvSq, mv, mv);
+				// z = f(z) + c, updating the squares, then the magnitude
+				FORMULA_STEP_GMP(mu, mv, muSq, mvSq, FORMULA_C(mRec, mjuliaRe), FORMULA_C(mImc, mjuliaIm),
+				                 muNew, mxtmp1, mytmp1, mytmp2);
 				mpf_add(mmag, muSq, mvSq);
 
 				iter++;
 			}
 
-			SetPixelColour(iter, image->maxIters, (float)mpf_get_d(mmag),
-			               &(image->pixels[y*image->xRes*3+x*3+0]),
-			               &(image->pixels[y*image->xRes*3+x*3+1]),
-			               &(image->pixels[y*image->xRes*3+x*3+2]),
-			               image->colourPeriod);
+			if (distanceScale > 0.0) {
+				image->escape[y*image->xRes+x] = DistanceEscape(iter, image->maxIters, mpf_get_d(mmag), du*du + dv*dv,
+				                                                distanceScale);
+			}
+			else {
+				image->escape[y*image->xRes+x] = SmoothEscape(iter, image->maxIters, (float)mpf_get_d(mmag));
+			}
 
 
 		}
 
 		// Clear mpf variables to free memory
 		// x loop invariant
-		mpf_clear(myPix);
+		mpf_clear(myRow);
 
 		// x-dependent, init, clear outside loop
 		mpf_clear(mu);
@@ -222,177 +909,922 @@ void RenderMandelbrotGMPCPU(renderStruct *render, imageStruct *image)
 		mpf_clear(muSq);
 		mpf_clear(mvSq);
 		mpf_clear(mmag);
-		mpf_clear(mxPix);
 		mpf_clear(mRec);
 		mpf_clear(mImc);
 		mpf_clear(mxtmp1);
-		mpf_clear(mxtmp2);
 		mpf_clear(mytmp1);
 		mpf_clear(mytmp2);
 
 	}
 
 	// x,y loop invariant
-	mpf_clear(mtwo);
-	mpf_clear(mfour);
-	mpf_clear(mxMin);
-	mpf_clear(mxMax);
-	mpf_clear(myMin);
-	mpf_clear(myMax);
-	mpf_clear(mxRes);
-	mpf_clear(myRes);
+	mpf_clear(mzero);
+	mpf_clear(mjuliaRe);
+	mpf_clear(mjuliaIm);
+	mpf_clear(mbailout);
+	mpf_clear(mxCentre);
+	mpf_clear(myCentre);
+	mpf_clear(mxStep);
+	mpf_clear(myStep);
+	mpf_clear(mxOrigin);
+	mpf_clear(myOrigin);
+
+
+	if (RenderCancelled(render)) {
+		return;
+	}
+	RecolourMandelbrotCPU(render, image);
+}
+#endif
 
 
-	if (image->gaussianBlur == 1) {
-		GaussianBlur(image->pixels, image->xRes, image->yRes);
+
+#ifdef WITHFIXED
+// Signed 128 bit fixed point numbers, with FORMULA_FIXEDBITS fractional bits: 4.124 for z^2 + c. Products
+// take four 64x64 bit multiplies, rather than GMP's calls through limb arrays, and the arithmetic is exact
+// until truncation to the last bit, 2^-124. The view's centre is only held to double-double precision,
+// though, about 1e-32 near the origin, so views go from where double precision runs out (pixels of
+// about 1e-13) to pixels of about 1e-31.
+__extension__ typedef __int128 fixedPoint;
+__extension__ typedef unsigned __int128 fixedPointU;
+
+// The z of an orbit in image->orbits which can't be resumed: no iteration gives the most negative number
+#define FIXEDNOORBIT (-(fixedPoint)(((fixedPointU)1 << 127) - 1) - 1)
+
+static inline fixedPoint FixedFromDouble(const double x)
+{
+	// Scaling by a power of two is exact, and so is the conversion of the integer part
+	return (fixedPoint)ldexp(x, FORMULA_FIXEDBITS);
+}
+
+static inline double FixedToDouble(const fixedPoint x)
+{
+	return ldexp((double)x, -FORMULA_FIXEDBITS);
+}
+
+static inline fixedPointU FixedAbs(const fixedPoint x)
+{
+	return (x < 0) ? -(fixedPointU)x : (fixedPointU)x;
+}
+
+// The product of magnitudes a and b, of 256 bits, shifted right by FORMULA_FIXEDBITS. The high 128 bits
+// are the high half by high half product, plus the carries of the cross products and the low product.
+static inline fixedPointU FixedMulU(const fixedPointU a, const fixedPointU b)
+{
+	const fixedPointU aLo = (uint64_t)a, aHi = a >> 64;
+	const fixedPointU bLo = (uint64_t)b, bHi = b >> 64;
+	const fixedPointU lo = aLo*bLo;
+	const fixedPointU crossA = aLo*bHi;
+	const fixedPointU crossB = aHi*bLo;
+	const fixedPointU middle = (lo >> 64) + (uint64_t)crossA + (uint64_t)crossB;
+	const fixedPointU low = (middle << 64) | (uint64_t)lo;
+	const fixedPointU high = aHi*bHi + (crossA >> 64) + (crossB >> 64) + (middle >> 64);
+	return (high << (128-FORMULA_FIXEDBITS)) | (low >> FORMULA_FIXEDBITS);
+}
+
+// Signed product, truncated towards zero. The caller keeps it in range.
+static inline fixedPoint FixedMul(const fixedPoint a, const fixedPoint b)
+{
+	const fixedPoint product = (fixedPoint)FixedMulU(FixedAbs(a), FixedAbs(b));
+	return ((a < 0) != (b < 0)) ? -product : product;
+}
+
+// As ViewResolved, for the fixed point numbers and the double-double centre of the view
+static int FixedViewResolved(const imageStruct *image)
+{
+	const double ulp = ldexp(1.0, 4-FORMULA_FIXEDBITS);
+	return fabs(image->xStep) >= fmax(ulp, DBL_EPSILON*DBL_EPSILON*fabs(image->xCentre))
+	    && fabs(image->yStep) >= fmax(ulp, DBL_EPSILON*DBL_EPSILON*fabs(image->yCentre));
+}
+
+// Routine using 128 bit fixed point. Each point is iterated in fixed point until |z| > 2, and then, for
+// distance estimates, on to DISTANCEBAILOUT in double precision, which is enough for the escaping orbit.
+// The derivative is in double precision throughout, as for GMP. Pixels which reach maxIters in fixed
+// point are resumed from their orbits, as for the double precision routines. The few which reach it on
+// the way to DISTANCEBAILOUT are started again.
+void RenderMandelbrotFixedCPU(renderStruct *render, imageStruct *image)
+{
+	if (image->orbitDensity) {
+		RenderOrbitDensityCPU(render, image);
+		return;
 	}
 
-	if (render->updateTex) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->xRes, image->yRes, 0, GL_RGB, GL_FLOAT, image->pixels);
+	if (!FixedViewResolved(image)) {
+		fprintf(stderr, "PRECISION WARNING!\n");
 	}
+
+	const double distanceScale = DistanceScale(image);
+	const double bailout = (distanceScale > 0.0) ? DISTANCEBAILOUT : 4.0;
+	const fixedPointU two = (fixedPointU)FixedFromDouble(2.0);
+	const fixedPoint four = FixedFromDouble(4.0);
+	// centre of the view, to the precision it is held
+	const fixedPoint xCentre = FixedFromDouble(image->xCentre) + FixedFromDouble(image->xCentreLo);
+	const fixedPoint yCentre = FixedFromDouble(image->yCentre) + FixedFromDouble(image->yCentreLo);
+	const fixedPoint xOrigin = FixedFromDouble(image->xOrigin), yOrigin = FixedFromDouble(image->yOrigin);
+	// If the last render was of this view, only pixels which reached its maxIters need iterating further
+	const unsigned resumeIters = ResumeIters(image);
+
+	#pragma omp parallel for default(none) shared(image,render) firstprivate(distanceScale, bailout, two, four, xCentre, yCentre, xOrigin, yOrigin, resumeIters) schedule(dynamic)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		if (RenderCancelled(render)) {
+			continue;
+		}
+
+		for (unsigned x = 0; x < image->xRes; x++) {
+			const size_t pixel = (size_t)y*image->xRes+x;
+			if (resumeIters > 0 && image->escape[pixel] >= 0.0f) {
+				continue;
+			}
+			double *orbit = (image->orbits != NULL) ? &(image->orbits[ORBITVALUES*pixel]) : NULL;
+			int orbitKept = 0;
+
+			// The point, as for GMP: the offsets from the centre, or from the origin of an exponential
+			// map, only need double precision. Rec, Imc are its double precision approximation.
+			fixedPoint fRec, fImc;
+			double Rec, Imc;
+			if (image->expMap) {
+				const double r = exp(ViewY(image, (double)y));
+				const double theta = ViewX(image, (double)x);
+				fRec = xOrigin + FixedFromDouble(r*cos(theta));
+				fImc = yOrigin + FixedFromDouble(r*sin(theta));
+				Rec = image->xOrigin + r*cos(theta);
+				Imc = image->yOrigin + r*sin(theta);
+			}
+			else {
+				fRec = xCentre + FixedFromDouble(((double)x - 0.5*image->xRes)*image->xStep);
+				fImc = yCentre + FixedFromDouble(((double)y - 0.5*image->yRes)*image->yStep);
+				Rec = ViewX(image, (double)x);
+				Imc = ViewY(image, (double)y);
+			}
+
+			unsigned iter = 0;
+			double du = FORMULA_DZ0, dv = 0.0;
+			double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+
+			// Points beyond |Re|,|Im| < 4 would overflow, and escape at once in double precision anyway
+			if (fabs(Rec) < 4.0 && fabs(Imc) < 4.0) {
+				fixedPoint fu = FORMULA_Z0(fRec, 0), fv = FORMULA_Z0(fImc, 0);
+				if (resumeIters > 0) {
+					fixedPoint orbitU, orbitV;
+					memcpy(&orbitU, &(orbit[0]), sizeof orbitU);
+					memcpy(&orbitV, &(orbit[2]), sizeof orbitV);
+					if (orbitU != FIXEDNOORBIT) {
+						fu = orbitU;
+						fv = orbitV;
+						du = orbit[4];
+						dv = orbit[5];
+						iter = resumeIters;
+					}
+				}
+				const fixedPoint cRe = FORMULA_C(fRec, FixedFromDouble(JULIARE));
+				const fixedPoint cIm = FORMULA_C(fImc, FixedFromDouble(JULIAIM));
+
+				while (iter < image->maxIters) {
+					// |z|^2 > 4, without squaring parts which could overflow
+					if (FixedAbs(fu) > two || FixedAbs(fv) > two) {
+						break;
+					}
+					const fixedPoint uSq = FixedMul(fu, fu);
+					const fixedPoint vSq = FixedMul(fv, fv);
+					if (uSq > four - vSq) {
+						break;
+					}
+
+					if (distanceScale > 0.0) {
+						// dz = f'(z)*dz + 1
+						const double uD = FixedToDouble(fu);
+						const double vD = FixedToDouble(fv);
+						FORMULA_DSTEP(double, uD, vD, du, dv);
+					}
+
+					FORMULA_STEP_FIXED(fu, fv, uSq, vSq, cRe, cIm);
+					iter++;
+				}
+
+				if (orbit != NULL && iter == image->maxIters) {
+					memcpy(&(orbit[0]), &fu, sizeof fu);
+					memcpy(&(orbit[2]), &fv, sizeof fv);
+					orbit[4] = du;
+					orbit[5] = dv;
+					orbitKept = 1;
+				}
+				u = FixedToDouble(fu);
+				v = FixedToDouble(fv);
+			}
+
+			// The rest of the orbit, to bailout
+			double uSq = u*u;
+			double vSq = v*v;
+			const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+			while ( (uSq+vSq) <= bailout && iter < image->maxIters) {
+				if (distanceScale > 0.0) {
+					FORMULA_DSTEP(double, u, v, du, dv);
+				}
+				FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+				iter++;
+			}
+			if (orbit != NULL && iter == image->maxIters && !orbitKept) {
+				const fixedPoint noOrbit = FIXEDNOORBIT;
+				memcpy(&(orbit[0]), &noOrbit, sizeof noOrbit);
+			}
+
+			if (distanceScale > 0.0) {
+				image->escape[pixel] = DistanceEscape(iter, image->maxIters, uSq+vSq, du*du + dv*dv, distanceScale);
+			}
+			else {
+				image->escape[pixel] = SmoothEscape(iter, image->maxIters, (float)(uSq+vSq));
+			}
+		}
+	}
+
+	if (RenderCancelled(render)) {
+		return;
+	}
+	image->orbitIters = image->maxIters;
+	RecolourMandelbrotCPU(render, image);
 }
 #endif
 
 
 
 #ifdef WITHAVX
-// Vectorized routine using AVX intrinsics. Vector variables have a "v" prefix.
-void RenderMandelbrotAVXCPU(renderStruct *render, imageStruct *image)
+#ifdef EARLYBAIL
+// As the disc tests of InteriorPoint, for 4 points. vImcAbs is |Imc|.
+static inline __m256d InteriorDiscAVX(const __m256d vRec, const __m256d vImcAbs,
+                                      const double x, const double y, const double rSq)
 {
+	const __m256d vdx = _mm256_sub_pd(vRec, _mm256_set1_pd(x));
+	const __m256d vdy = _mm256_sub_pd(vImcAbs, _mm256_set1_pd(y));
+	const __m256d vdistSq = _mm256_add_pd(_mm256_mul_pd(vdx, vdx), _mm256_mul_pd(vdy, vdy));
+	return _mm256_cmp_pd(vdistSq, _mm256_set1_pd(rSq), _CMP_LT_OQ);
+}
 
-	if (image->xMin == ((1.0-(1.0/(double)image->xRes))*image->xMin + (1.0-(1.0/(double)image->xRes))*image->xMax)
-	 || image->yMin == ((1.0-(1.0/(double)image->yRes))*image->yMin + (1.0-(1.0/(double)image->yRes))*image->yMax)) {
-		printf("PRECISION WARNING!\n");
+
+// As InteriorPoint, for 4 points. Returns a mask, set for lanes which are inside.
+static __m256d InteriorPointAVX(const __m256d vRec, const __m256d vImc)
+{
+	const __m256d vImcSq = _mm256_mul_pd(vImc, vImc);
+	const __m256d vRecShift = _mm256_sub_pd(vRec, _mm256_set1_pd(0.25));
+	const __m256d vq = _mm256_add_pd(_mm256_mul_pd(vRecShift, vRecShift), vImcSq);
+	const __m256d vRecPlusOne = _mm256_add_pd(vRec, _mm256_set1_pd(1.0));
+	const __m256d vImcAbs = _mm256_andnot_pd(_mm256_set1_pd(-0.0), vImc);
+
+	// cardioid
+	__m256d vinside = _mm256_cmp_pd(_mm256_mul_pd(vq, _mm256_add_pd(vq, vRecShift)),
+	                                _mm256_mul_pd(vImcSq, _mm256_set1_pd(0.25)), _CMP_LT_OQ);
+	// period-2 bulb
+	vinside = _mm256_or_pd(vinside, _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(vRecPlusOne, vRecPlusOne), vImcSq),
+	                                              _mm256_set1_pd(1.0/16.0), _CMP_LT_OQ));
+	// period-3 and period-4 bulbs
+	vinside = _mm256_or_pd(vinside, InteriorDiscAVX(vRec, vImcAbs, BULB3X, BULB3Y, BULB3RSQ));
+	vinside = _mm256_or_pd(vinside, InteriorDiscAVX(vRec, vImcAbs, BULB4X, BULB4Y, BULB4RSQ));
+	vinside = _mm256_or_pd(vinside, InteriorDiscAVX(vRec, vImcAbs, BULB4BX, BULB4BY, BULB4BRSQ));
+	return vinside;
+}
+#endif
+
+
+// As FastLog2, for 4 values
+static inline __m128 FastLog2AVX(const __m128 vx)
+{
+	const __m128i vbits = _mm_castps_si128(vx);
+	const __m128 vexponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(vbits, 23), _mm_set1_epi32(127)));
+	const __m128 vm = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(vbits, _mm_set1_epi32(0x007fffff)),
+	                                                 _mm_set1_epi32(0x3f800000)));
+	const __m128 vs = _mm_div_ps(_mm_sub_ps(vm, _mm_set1_ps(1.0f)), _mm_add_ps(vm, _mm_set1_ps(1.0f)));
+	const __m128 vsSq = _mm_mul_ps(vs, vs);
+	__m128 vpoly = _mm_add_ps(_mm_set1_ps(0.57707801f), _mm_mul_ps(vsSq, _mm_set1_ps(0.41219858f)));
+	vpoly = _mm_add_ps(_mm_set1_ps(0.96179669f), _mm_mul_ps(vsSq, vpoly));
+	vpoly = _mm_add_ps(_mm_set1_ps(2.8853901f), _mm_mul_ps(vsSq, vpoly));
+	return _mm_add_ps(vexponent, _mm_mul_ps(vs, vpoly));
+}
+
+
+// As SmoothEscape, for 4 pixels. Lanes which haven't escaped give meaningless values.
+static inline __m128 SmoothEscapeAVX(const __m256d viter, const __m256d vmag, const __m256d vmaxIters)
+{
+	const __m128 vsmooth = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm256_cvtpd_ps(viter),
+	                                  _mm_mul_ps(_mm_set1_ps(0.69314718f/log2f((float)FORMULA_POWER)),
+	                                             FastLog2AVX(FastLog2AVX(_mm256_cvtpd_ps(vmag))))));
+	// -1 for pixels which hit max iteration count. The sign bits of the mask survive the conversion.
+	const __m128 vinside = _mm256_cvtpd_ps(_mm256_cmp_pd(viter, vmaxIters, _CMP_GE_OQ));
+	return _mm_blendv_ps(vsmooth, _mm_set1_ps(-1.0f), vinside);
+}
+
+
+// Number of pixels the AVX kernel iterates at once. Each has a bit of an unsigned mask.
+#define AVXLANES (4*AVXINTERLEAVE)
+#if AVXLANES > 32
+	#error "AVXINTERLEAVE is at most 8"
+#endif
+
+
+// A row's queue of pixels for the AVX lanes, and the state each one's lane starts from: z = u + i*v and
+// dz = du + i*dv after iter iterations
+typedef struct {
+	unsigned *pixel;
+	double *u;
+	double *v;
+	double *du;
+	double *dv;
+	double *iter;
+	unsigned len;
+} avxQueueStruct;
+
+
+static inline void QueuePixelAVX(avxQueueStruct *queue, const unsigned x, const double u, const double v,
+                                 const double du, const double dv, const double iter)
+{
+	const unsigned i = queue->len++;
+	queue->pixel[i] = x;
+	queue->u[i] = u;
+	queue->v[i] = v;
+	queue->du[i] = du;
+	queue->dv[i] = dv;
+	queue->iter[i] = iter;
+}
+
+
+// Store a finished pixel: its smoothed escape count (from SmoothEscapeAVX) or its distance estimate, and
+// its orbit if the image keeps them
+static inline void StorePixelAVX(imageStruct *image, const size_t pixel, const float smoothEscape,
+                                 const double iter, const double mag, const double u, const double v,
+                                 const double du, const double dv, const double distanceScale)
+{
+	image->escape[pixel] = (distanceScale > 0.0)
+	        ? DistanceEscape((int)iter, image->maxIters, mag, du*du + dv*dv, distanceScale)
+	        : smoothEscape;
+	if (image->orbits != NULL) {
+		double *orbit = &(image->orbits[ORBITVALUES*pixel]);
+		orbit[0] = u;
+		orbit[1] = v;
+		orbit[2] = du;
+		orbit[3] = dv;
 	}
+}
 
-	const __m256d vxMin = _mm256_set1_pd(image->xMin);
-	const __m256d vxMax = _mm256_set1_pd(image->xMax);
-	const __m256d vyMin = _mm256_set1_pd(image->yMin);
-	const __m256d vyMax = _mm256_set1_pd(image->yMax);
-	const __m256d vxRes = _mm256_set1_pd((double)image->xRes);
-	const __m256d vyRes = _mm256_set1_pd((double)image->yRes);
 
-	// For each pixel, iterate and store the iteration number when |z|>2 or maxIters
-	#pragma omp parallel for default(none) shared(image) firstprivate(vxMin,vxMax,vyMin,vyMax,vxRes,vyRes) schedule(dynamic)
-	for (unsigned y = 0; y < image->yRes; y++) {
-		for (unsigned x = 0; x < image->xRes; x+=4) {
+// Lanes whose bit is set in bits (the low 4 bits), as a mask
+static inline __m256d LaneMaskAVX(const unsigned bits)
+{
+	return _mm256_castsi256_pd(_mm256_set_epi64x(-(long long)((bits>>3)&1), -(long long)((bits>>2)&1),
+	                                             -(long long)((bits>>1)&1), -(long long)(bits&1)));
+}
 
-			const __m256d vxPix = _mm256_div_pd(_mm256_set_pd(x+3,x+2,x+1,x+0), vxRes);
-			const __m256d vyPix = _mm256_div_pd(_mm256_set1_pd(y), vyRes);
 
-			const __m256d vRec = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), vxPix),vxMin),
-			                                   _mm256_mul_pd(vxPix, vxMax));
-			const __m256d vImc = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), vyPix),vyMin),
-			                                   _mm256_mul_pd(vyPix, vyMax));
+// Iterate the pixels x.. of row y whose bits are set in pending, with points vRec, vImc, together for up to
+// AVXSHORTITERS iterations. Pixels which finish are stored, and the rest queued for the lanes. Most pixels
+// of a shallow view escape in a few iterations, and are spared the bookkeeping of a lane refill each.
+// Finished lanes are iterated on with the rest, so the state they finished with is kept aside.
+static void ShortPassAVX(imageStruct *image, const unsigned x, const unsigned y, const unsigned pending,
+                         const __m256d *vRec, const __m256d *vImc, const double bailout,
+                         const double distanceScale, avxQueueStruct *queue)
+{
+	const __m256d vmaxIters = _mm256_set1_pd((double)image->maxIters);
+	const __m256d vbailout = _mm256_set1_pd(bailout);
+
+	__m256d vu[AVXINTERLEAVE], vv[AVXINTERLEAVE], vuSq[AVXINTERLEAVE], vvSq[AVXINTERLEAVE], vuv[AVXINTERLEAVE];
+	__m256d vdu[AVXINTERLEAVE], vdv[AVXINTERLEAVE], viter[AVXINTERLEAVE], vmagnitude[AVXINTERLEAVE];
+	// The state of each lane as it finished, and which have. Lanes without a pixel count as finished.
+	__m256d vfu[AVXINTERLEAVE], vfv[AVXINTERLEAVE], vfdu[AVXINTERLEAVE], vfdv[AVXINTERLEAVE];
+	__m256d vfiter[AVXINTERLEAVE], vfmagnitude[AVXINTERLEAVE], vfinished[AVXINTERLEAVE];
+	unsigned finished = ~pending;
+	for (int j = 0; j < AVXINTERLEAVE; j++) {
+		vu[j] = FORMULA_Z0(vRec[j], _mm256_setzero_pd());
+		vv[j] = FORMULA_Z0(vImc[j], _mm256_setzero_pd());
+		vuSq[j] = _mm256_mul_pd(vu[j], vu[j]);
+		vvSq[j] = _mm256_mul_pd(vv[j], vv[j]);
+		vuv[j] = _mm256_mul_pd(vu[j], vv[j]);
+		vdu[j] = _mm256_set1_pd(FORMULA_DZ0);
+		vdv[j] = _mm256_setzero_pd();
+		viter[j] = _mm256_setzero_pd();
+		vmagnitude[j] = _mm256_setzero_pd();
+		vfu[j] = vfv[j] = vfdu[j] = vfdv[j] = vfiter[j] = vfmagnitude[j] = _mm256_setzero_pd();
+		vfinished[j] = LaneMaskAVX(~pending >> (4*j));
+	}
 
+	for (int i = 0; i < AVXSHORTITERS && ~finished & pending; i++) {
+		for (int j = 0; j < AVXINTERLEAVE; j++) {
+			if (distanceScale > 0.0) {
+				FORMULA_DSTEP_AVX(vu[j], vv[j], vdu[j], vdv[j]);
+			}
+			FORMULA_STEP_AVX(vu[j], vv[j], vuSq[j], vvSq[j], vuv[j],
+			                 FORMULA_C(vRec[j], _mm256_set1_pd(JULIARE)),
+			                 FORMULA_C(vImc[j], _mm256_set1_pd(JULIAIM)));
+			viter[j] = _mm256_add_pd(viter[j], _mm256_set1_pd(1.0));
+			vmagnitude[j] = _mm256_add_pd(vuSq[j], vvSq[j]);
+
+			const __m256d vnew = _mm256_andnot_pd(vfinished[j],
+			                                      _mm256_or_pd(_mm256_cmp_pd(vmagnitude[j], vbailout, _CMP_GT_OQ),
+			                                                   _mm256_cmp_pd(viter[j], vmaxIters, _CMP_GE_OQ)));
+			const unsigned newBits = (unsigned)_mm256_movemask_pd(vnew);
+			if (newBits) {
+				vfu[j] = _mm256_blendv_pd(vfu[j], vu[j], vnew);
+				vfv[j] = _mm256_blendv_pd(vfv[j], vv[j], vnew);
+				vfdu[j] = _mm256_blendv_pd(vfdu[j], vdu[j], vnew);
+				vfdv[j] = _mm256_blendv_pd(vfdv[j], vdv[j], vnew);
+				vfiter[j] = _mm256_blendv_pd(vfiter[j], viter[j], vnew);
+				vfmagnitude[j] = _mm256_blendv_pd(vfmagnitude[j], vmagnitude[j], vnew);
+				vfinished[j] = _mm256_or_pd(vfinished[j], vnew);
+				finished |= newBits << (4*j);
+			}
+		}
+	}
 
-/*			// early stop if ALL FOUR points are inside cardioid ??????????? implement this.
-			const double q = (Rec - 0.25)*(Rec - 0.25) + Imc*Imc;
-			if (q*(q+(Rec-0.25)) < (Imc*Imc*0.25)) {
-				iter = maxIters;
-			}*/
+	// Store the finished pixels, smoothed 4 at a time, and queue the rest from where they are
+	for (int j = 0; j < AVXINTERLEAVE; j++) {
+		if (!((pending >> (4*j)) & 0xf)) {
+			continue;
+		}
+		double u[4], v[4], du[4], dv[4], iter[4], mag[4];
+		float escape[4];
+		_mm256_storeu_pd(u, _mm256_blendv_pd(vu[j], vfu[j], vfinished[j]));
+		_mm256_storeu_pd(v, _mm256_blendv_pd(vv[j], vfv[j], vfinished[j]));
+		_mm256_storeu_pd(du, _mm256_blendv_pd(vdu[j], vfdu[j], vfinished[j]));
+		_mm256_storeu_pd(dv, _mm256_blendv_pd(vdv[j], vfdv[j], vfinished[j]));
+		_mm256_storeu_pd(iter, _mm256_blendv_pd(viter[j], vfiter[j], vfinished[j]));
+		_mm256_storeu_pd(mag, vfmagnitude[j]);
+		_mm_storeu_ps(escape, SmoothEscapeAVX(vfiter[j], vfmagnitude[j], vmaxIters));
+		for (int k = 0; k < 4; k++) {
+			const unsigned bit = 1u << (4*j+k);
+			if (!(pending & bit)) {
+				continue;
+			}
+			if (finished & bit) {
+				StorePixelAVX(image, (size_t)y*image->xRes+x+4*j+k, escape[k], iter[k], mag[k],
+				              u[k], v[k], du[k], dv[k], distanceScale);
+			}
+			else {
+				QueuePixelAVX(queue, x+4*j+k, u[k], v[k], du[k], dv[k], iter[k]);
+			}
+		}
+	}
+}
 
 
-			unsigned iter = 0;
-			__m256d viter = _mm256_set1_pd(0.0);
-			__m256d vu = _mm256_set1_pd(0.0);
-			__m256d vv = _mm256_set1_pd(0.0);
-			__m256d vuFinal = _mm256_set1_pd(0.0);
-			__m256d vvFinal = _mm256_set1_pd(0.0);
-
-			// Update mask. Update viter depending on this, and also update vuFinal and vvFinal.
-			// Initial value is -1.0 since we update based on the *sign bit* of this vector.
-			__m256d vincrMask = _mm256_set1_pd(-1.0);
-
-			// initial squares and u*v are zero.
-			__m256d vuSq = _mm256_set1_pd(0.0);
-			__m256d vvSq = _mm256_set1_pd(0.0);
-			__m256d vvuvv = _mm256_set1_pd(0.0);
-
-			// Loop on non-vector iteration count. If this hits maxIters, all four entries have diverged.
-			while (iter++ < image->maxIters) {
-
-				vu = _mm256_add_pd(_mm256_sub_pd(vuSq, vvSq), vRec);
-				vv = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(2.0),vvuvv), vImc);
-
-				// compute new squares and product of u and v
-				vuSq = _mm256_mul_pd(vu,vu);
-				vvSq = _mm256_mul_pd(vv,vv);
-				vvuvv = _mm256_mul_pd(vu, vv);
-
-				// compute magnitude, for divergence check
-				__m256d vmagnitude = _mm256_add_pd(vuSq, vvSq);
-
-				// If pixel has not *already* diverged, update v{u,v}Final values for smooth colouring -- this was
-				// very easy in the scalar code as we just left the loop upon divergence with u,v retaining their
-				// values. Now we continue until all 4 values have diverged, so only store un-diverged pixels,
-				// or pixels which diverged *this* iteration.
-				// _mm256_maskstore_pd stores if the *sign bit* in the __m256i is 1, (which it is, for (-nan))
-				// so all we have to do is bit-wise cast vincrMask to __m256i.
-				_mm256_maskstore_pd( (double*)&vuFinal, _mm256_castpd_si256(vincrMask), vu);
-				_mm256_maskstore_pd( (double*)&vvFinal, _mm256_castpd_si256(vincrMask), vv);
-
-				// Now we need to increment iteration count for vector entries which have magnitude <= 4.0, ie,
-				// the didn't diverge this iteration.
-				vincrMask = _mm256_cmp_pd(vmagnitude, _mm256_set1_pd(4.0), _CMP_LE_OS);
-
-				// vincr now contains 0xFFFFFFFFFFFFFFFF (-nan) where vmagnitude entry <= 4.0, and 0x0 otherwise.
-				// By computing a bitwise AND with 1.0, we get 1.0 where we want to increment the iteration count.
-				viter = _mm256_add_pd(viter, _mm256_and_pd(vincrMask, _mm256_set1_pd(1.0)));
-
-				// Want to leave loop if all 4 pixels have diverged, ie, test if all entries of incr are 0x0.
-				// _mm256_testz_pd does this by computing bitwise AND of the operands, and returning 1 if all
-				// resulting *sign bits* are zero.
-				// (-nan) has a sign bit 1, so by using testz against a negative number, (-1.0, for eg) we get
-				// a sign bit of 1, and don't break out of the loop.
-				if ( _mm256_testz_pd(vincrMask, _mm256_set1_pd(-1.0))) {
-					break;
+// Vectorized routine using AVX intrinsics. Vector variables have a "v" prefix.
+void RenderMandelbrotAVXCPU(renderStruct *render, imageStruct *image)
+{
+	if (image->orbitDensity) {
+		RenderOrbitDensityCPU(render, image);
+		return;
+	}
+
+	if (!ViewResolved(image)) {
+		fprintf(stderr, "PRECISION WARNING!\n");
+	}
+
+	coordinatesStruct coords;
+	FrameCoordinates(image, &coords);
+	const __m256d vmaxIters = _mm256_set1_pd((double)image->maxIters);
+	// For distance estimates, we also track the derivative dz/dc and iterate to a larger radius
+	const double distanceScale = DistanceScale(image);
+	const double bailout = (distanceScale > 0.0) ? DISTANCEBAILOUT : 4.0;
+	const __m256d vbailout = _mm256_set1_pd(bailout);
+	// If the last render was of this view, only pixels which reached its maxIters go in the queues, and
+	// their lanes start from their orbits
+	const unsigned resumeIters = ResumeIters(image);
+
+	// Each thread takes a row at a time. The row's pixels are first iterated AVXLANES at a time for a few
+	// iterations (see ShortPassAVX), and those still going form a queue: each of the AVXLANES lanes iterates
+	// its own pixel, and as soon as any lane's pixel escapes (or reaches maxIters), the vector loop stops,
+	// the pixel is stored and the lane is refilled with the next pixel of the queue. So lanes don't sit
+	// idle waiting for their slowest neighbour, except while the row's last few pixels finish.
+	#pragma omp parallel default(none) shared(image,render,coords) firstprivate(vmaxIters, vbailout, bailout, distanceScale, resumeIters)
+	{
+	avxQueueStruct queue;
+	queue.pixel = malloc(image->xRes * sizeof *(queue.pixel));
+	queue.u = malloc(5*(size_t)image->xRes * sizeof *(queue.u));
+	queue.v = queue.u + image->xRes;
+	queue.du = queue.v + image->xRes;
+	queue.dv = queue.du + image->xRes;
+	queue.iter = queue.dv + image->xRes;
+
+	#pragma omp for schedule(dynamic)
+	for (unsigned y = 0; y < image->yRes; y++) {
+		if (RenderCancelled(render)) {
+			continue;
+		}
+
+		// Fill the queue, AVXLANES pixels at a time, repeating the row's last point to fill the vectors
+		queue.len = 0;
+		for (unsigned x = 0; x < image->xRes; x += AVXLANES) {
+			__m256d vRec[AVXINTERLEAVE], vImc[AVXINTERLEAVE];
+			unsigned pending = 0;
+			for (int j = 0; j < AVXINTERLEAVE; j++) {
+				double Rec[4], Imc[4];
+				for (unsigned k = 0; k < 4; k++) {
+					PixelPoint(image, &coords, (x+4*j+k < image->xRes) ? x+4*j+k : image->xRes-1, y, &Rec[k], &Imc[k]);
 				}
+				vRec[j] = _mm256_loadu_pd(Rec);
+				vImc[j] = _mm256_loadu_pd(Imc);
+				// Points inside the cardioid or one of the larger bulbs never escape: they are stored
+				// directly, and never take up a lane
+#ifdef EARLYBAIL
+				const unsigned inside = (unsigned)_mm256_movemask_pd(InteriorPointAVX(vRec[j], vImc[j]));
+#else
+				const unsigned inside = 0;
+#endif
+				for (unsigned k = 0; k < 4 && x+4*j+k < image->xRes; k++) {
+					if (inside & (1u<<k)) {
+						image->escape[(size_t)y*image->xRes+x+4*j+k] = -1.0f;
+					}
+					else {
+						pending |= 1u << (4*j+k);
+					}
+				}
+			}
 
+			if (resumeIters == 0) {
+				if (pending) {
+					ShortPassAVX(image, x, y, pending, vRec, vImc, bailout, distanceScale, &queue);
+				}
+				continue;
 			}
-			// Compute final magnitude for smooth colouring function
-			__m256d vmagnitudeFinal = _mm256_add_pd(_mm256_mul_pd(vuFinal,vuFinal), _mm256_mul_pd(vvFinal,vvFinal));
+			for (unsigned k = 0; k < AVXLANES; k++) {
+				const size_t pixel = (size_t)y*image->xRes+x+k;
+				if (!(pending & (1u<<k)) || image->escape[pixel] >= 0.0f) {
+					continue;
+				}
+				// The lanes step before they test, so pixels which escaped in the last iteration of the
+				// last render are stored here
+				const double *orbit = &(image->orbits[ORBITVALUES*pixel]);
+				const double mag = orbit[0]*orbit[0] + orbit[1]*orbit[1];
+				if (mag <= bailout) {
+					QueuePixelAVX(&queue, x+k, orbit[0], orbit[1], orbit[2], orbit[3], (double)resumeIters);
+				}
+				else {
+					image->escape[pixel] = (distanceScale > 0.0)
+					        ? DistanceEscape((int)resumeIters, image->maxIters, mag,
+					                         orbit[2]*orbit[2] + orbit[3]*orbit[3], distanceScale)
+					        : SmoothEscape((int)resumeIters, image->maxIters, (float)mag);
+				}
+			}
+		}
+		if (queue.len == 0) {
+			continue;
+		}
+
+		// Lane state, held in these arrays while lanes are refilled
+		double laneRec[AVXLANES], laneImc[AVXLANES], laneU[AVXLANES], laneV[AVXLANES], laneIter[AVXLANES], laneMag[AVXLANES];
+		double laneDu[AVXLANES], laneDv[AVXLANES];
+		float laneEscape[AVXLANES];
+		unsigned lanePixel[AVXLANES] = {0};
+		// bit k is set if lane k holds a pixel, or if it has finished
+		unsigned active = 0;
+		unsigned finished = ~0u >> (32-AVXLANES);
+		// next entry of the queue
+		unsigned next = 0;
+
+		// The lanes, as AVXINTERLEAVE independent vectors which are iterated together
+		__m256d vRec[AVXINTERLEAVE], vImc[AVXINTERLEAVE], vu[AVXINTERLEAVE], vv[AVXINTERLEAVE];
+		__m256d viter[AVXINTERLEAVE], vmagnitude[AVXINTERLEAVE];
+		__m256d vuSq[AVXINTERLEAVE], vvSq[AVXINTERLEAVE], vuv[AVXINTERLEAVE];
+		__m256d vdu[AVXINTERLEAVE], vdv[AVXINTERLEAVE];
+		for (int j = 0; j < AVXINTERLEAVE; j++) {
+			vRec[j] = _mm256_setzero_pd();
+			vImc[j] = _mm256_setzero_pd();
+			vu[j] = _mm256_setzero_pd();
+			vv[j] = _mm256_setzero_pd();
+			vdu[j] = _mm256_setzero_pd();
+			vdv[j] = _mm256_setzero_pd();
+			viter[j] = _mm256_setzero_pd();
+			vmagnitude[j] = _mm256_setzero_pd();
+		}
+
+		while (1) {
+
+			// Store finished pixels, and refill their lanes. Only the vectors with a finished lane are
+			// unpacked, smoothed together and reloaded.
+			for (int j = 0; j < AVXINTERLEAVE; j++) {
+				const unsigned vectorFinished = (finished >> (4*j)) & 0xf;
+				if (!vectorFinished) {
+					continue;
+				}
+				_mm256_storeu_pd(&laneRec[4*j], vRec[j]);
+				_mm256_storeu_pd(&laneImc[4*j], vImc[j]);
+				_mm256_storeu_pd(&laneU[4*j], vu[j]);
+				_mm256_storeu_pd(&laneV[4*j], vv[j]);
+				_mm256_storeu_pd(&laneIter[4*j], viter[j]);
+				_mm256_storeu_pd(&laneMag[4*j], vmagnitude[j]);
+				_mm256_storeu_pd(&laneDu[4*j], vdu[j]);
+				_mm256_storeu_pd(&laneDv[4*j], vdv[j]);
+				_mm_storeu_ps(&laneEscape[4*j], SmoothEscapeAVX(viter[j], vmagnitude[j], vmaxIters));
+
+				for (int k = 4*j; k < 4*j+4; k++) {
+					if (!(finished & (1u<<k))) {
+						continue;
+					}
+					if (active & (1u<<k)) {
+						StorePixelAVX(image, (size_t)y*image->xRes+lanePixel[k], laneEscape[k], laneIter[k],
+						              laneMag[k], laneU[k], laneV[k], laneDu[k], laneDv[k], distanceScale);
+					}
+					if (next < queue.len) {
+						lanePixel[k] = queue.pixel[next];
+						PixelPoint(image, &coords, lanePixel[k], y, &laneRec[k], &laneImc[k]);
+						laneU[k] = queue.u[next];
+						laneV[k] = queue.v[next];
+						laneDu[k] = queue.du[next];
+						laneDv[k] = queue.dv[next];
+						laneIter[k] = queue.iter[next];
+						next++;
+						active |= (1u<<k);
+					}
+					else {
+						// An empty lane iterates from z = 0 (with c = 0, except for Julia sets), and is ignored
+						laneRec[k] = 0.0;
+						laneImc[k] = 0.0;
+						laneU[k] = 0.0;
+						laneV[k] = 0.0;
+						laneIter[k] = 0.0;
+						laneDu[k] = 0.0;
+						laneDv[k] = 0.0;
+						active &= ~(1u<<k);
+					}
+				}
 
-			for (int k = 0; k < 4; k++) {
-				SetPixelColour((int)(((double*)&viter)[k]), image->maxIters, ((double*)&vmagnitudeFinal)[k],
-							&(image->pixels[y*image->xRes*3+(x+k)*3+0]),
-							&(image->pixels[y*image->xRes*3+(x+k)*3+1]),
-							&(image->pixels[y*image->xRes*3+(x+k)*3+2]),
-							image->colourPeriod);
+				vRec[j] = _mm256_loadu_pd(&laneRec[4*j]);
+				vImc[j] = _mm256_loadu_pd(&laneImc[4*j]);
+				vu[j] = _mm256_loadu_pd(&laneU[4*j]);
+				vv[j] = _mm256_loadu_pd(&laneV[4*j]);
+				viter[j] = _mm256_loadu_pd(&laneIter[4*j]);
+				vdu[j] = _mm256_loadu_pd(&laneDu[4*j]);
+				vdv[j] = _mm256_loadu_pd(&laneDv[4*j]);
+				vuSq[j] = _mm256_mul_pd(vu[j], vu[j]);
+				vvSq[j] = _mm256_mul_pd(vv[j], vv[j]);
+				vuv[j] = _mm256_mul_pd(vu[j], vv[j]);
+			}
+			if (!active) {
+				break;
 			}
 
+			// Iterate until any lane finishes. As for the scalar code, the iteration count includes the
+			// iteration in which the pixel escaped. Each iteration is a chain of dependent mul/adds, so we
+			// step the independent vectors together to keep the FP units busy.
+			if (distanceScale > 0.0) {
+				do {
+					finished = 0;
+					for (int j = 0; j < AVXINTERLEAVE; j++) {
+						// dz = f'(z)*dz + 1
+						FORMULA_DSTEP_AVX(vu[j], vv[j], vdu[j], vdv[j]);
+						FORMULA_STEP_AVX(vu[j], vv[j], vuSq[j], vvSq[j], vuv[j],
+						                 FORMULA_C(vRec[j], _mm256_set1_pd(JULIARE)),
+						                 FORMULA_C(vImc[j], _mm256_set1_pd(JULIAIM)));
+						viter[j] = _mm256_add_pd(viter[j], _mm256_set1_pd(1.0));
+
+						vmagnitude[j] = _mm256_add_pd(vuSq[j], vvSq[j]);
+						const __m256d vfinished = _mm256_or_pd(_mm256_cmp_pd(vmagnitude[j], vbailout, _CMP_GT_OQ),
+						                                       _mm256_cmp_pd(viter[j], vmaxIters, _CMP_GE_OQ));
+						finished |= (unsigned)_mm256_movemask_pd(vfinished) << (4*j);
+					}
+					finished &= active;
+				} while (!finished);
+			}
+			else {
+				do {
+					finished = 0;
+					for (int j = 0; j < AVXINTERLEAVE; j++) {
+						FORMULA_STEP_AVX(vu[j], vv[j], vuSq[j], vvSq[j], vuv[j],
+						                 FORMULA_C(vRec[j], _mm256_set1_pd(JULIARE)),
+						                 FORMULA_C(vImc[j], _mm256_set1_pd(JULIAIM)));
+						viter[j] = _mm256_add_pd(viter[j], _mm256_set1_pd(1.0));
+
+						vmagnitude[j] = _mm256_add_pd(vuSq[j], vvSq[j]);
+						const __m256d vfinished = _mm256_or_pd(_mm256_cmp_pd(vmagnitude[j], vbailout, _CMP_GT_OQ),
+						                                       _mm256_cmp_pd(viter[j], vmaxIters, _CMP_GE_OQ));
+						finished |= (unsigned)_mm256_movemask_pd(vfinished) << (4*j);
+					}
+					finished &= active;
+				} while (!finished);
+			}
 		}
 	}
 
-	if (image->gaussianBlur == 1) {
-		GaussianBlur(image->pixels, image->xRes, image->yRes);
+	free(queue.pixel);
+	free(queue.u);
 	}
+	free(coords.Re);
 
-	if (render->updateTex) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->xRes, image->yRes, 0, GL_RGB, GL_FLOAT, image->pixels);
+	if (RenderCancelled(render)) {
+		return;
 	}
+	image->orbitIters = image->maxIters;
+	RecolourMandelbrotCPU(render, image);
 }
 #endif
 
 
 
 #ifdef WITHOPENCL
-void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image)
+static int GreatestCommonDivisor(int a, int b)
+{
+	while (b != 0) {
+		const int t = b;
+		b = a % b;
+		a = t;
+	}
+	return a;
+}
+
+
+// Split a double into a float-float pair, hi+lo, for the emulated double precision kernel
+static cl_float2 SplitDouble(const double d)
+{
+	cl_float2 f;
+	f.s[0] = (float)d;
+	f.s[1] = (float)(d - (double)f.s[0]);
+	return f;
+}
+
+
+// Set the four kernel arguments describing the view, starting at argument firstArg: the point of pixel
+// 0,0 and the pixel spacing. For the float-float kernels, each is split into two floats.
+static cl_int SetViewKernelArgs(cl_kernel kernel, const cl_uint firstArg, renderStruct *render, imageStruct *image)
+{
+	cl_int err;
+	const double xMin = ViewX(image, 0.0);
+	const double yMin = ViewY(image, 0.0);
+	if (render->emulateDouble) {
+		cl_float2 xMinSplit = SplitDouble(xMin);
+		cl_float2 xStep = SplitDouble(image->xStep);
+		cl_float2 yMinSplit = SplitDouble(yMin);
+		cl_float2 yStep = SplitDouble(image->yStep);
+		err  = clSetKernelArg(kernel, firstArg+0, sizeof(cl_float2), &xMinSplit);
+		err |= clSetKernelArg(kernel, firstArg+1, sizeof(cl_float2), &xStep);
+		err |= clSetKernelArg(kernel, firstArg+2, sizeof(cl_float2), &yMinSplit);
+		err |= clSetKernelArg(kernel, firstArg+3, sizeof(cl_float2), &yStep);
+	}
+	else {
+		err  = clSetKernelArg(kernel, firstArg+0, sizeof(double), &xMin);
+		err |= clSetKernelArg(kernel, firstArg+1, sizeof(double), &(image->xStep));
+		err |= clSetKernelArg(kernel, firstArg+2, sizeof(double), &yMin);
+		err |= clSetKernelArg(kernel, firstArg+3, sizeof(double), &(image->yStep));
+	}
+	return err;
+}
+
+
+// Set the six kernel arguments describing the colouring, starting at argument firstArg
+static cl_int SetColourKernelArgs(cl_kernel kernel, const cl_uint firstArg, renderStruct *render, imageStruct *image)
+{
+	cl_int err;
+	float colourPeriod = image->colourPeriod;
+	err  = clSetKernelArg(kernel, firstArg+0, sizeof(int), &(image->distanceEstimation));
+	err |= clSetKernelArg(kernel, firstArg+1, sizeof(int), &(image->histogramColouring));
+	err |= clSetKernelArg(kernel, firstArg+2, sizeof(float), &colourPeriod);
+	err |= clSetKernelArg(kernel, firstArg+3, sizeof(cl_mem), &(render->histogramCDF));
+	err |= clSetKernelArg(kernel, firstArg+4, sizeof(cl_mem), &(render->escapeRange));
+	err |= clSetKernelArg(kernel, firstArg+5, sizeof(cl_mem), &(render->paletteLUT));
+	return err;
+}
+
+
+// Set arguments of the gaussianBlurKernels, which blur and supersample pixelsDevice, writing to output
+static void SetOutputKernelArgs(cl_kernel kernel, cl_mem *output, renderStruct *render, imageStruct *image)
+{
+	cl_int err;
+	err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), output);
+	err |= clSetKernelArg(kernel, 1, sizeof(int), &(image->xRes));
+	err |= clSetKernelArg(kernel, 2, sizeof(int), &(image->yRes));
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &(render->pixelsDevice));
+	err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &(render->escapeDevice));
+	err |= clSetKernelArg(kernel, 5, sizeof(int), &(image->gaussianBlur));
+	const int supersample = image->supersample && !image->orbitDensity;
+	err |= clSetKernelArg(kernel, 6, sizeof(int), &supersample);
+	err |= SetViewKernelArgs(kernel, 7, render, image);
+	const float distanceScale = (float)DistanceScale(image);
+	err |= clSetKernelArg(kernel, 11, sizeof(int), &(image->maxIters));
+	err |= clSetKernelArg(kernel, 12, sizeof(float), &distanceScale);
+	err |= SetColourKernelArgs(kernel, 13, render, image);
+	CheckOpenCLError(err, __LINE__);
+}
+
+
+// Build the cumulative distribution of escape counts in render->histogramCDF, for histogram colouring.
+// Find their range, bin them into a histogram per work-group, then merge and prefix sum.
+static void BuildHistogramOpenCL(renderStruct *render, imageStruct *image)
 {
 	int err;
-	// Set kernel args
-	err  = clSetKernelArg(render->renderMandelbrotKernel, 0, sizeof(cl_mem), &(render->pixelsDevice));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 1, sizeof(int), &(image->xRes));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 2, sizeof(int), &(image->yRes));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 3, sizeof(double), &(image->xMin));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 4, sizeof(double), &(image->xMax));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 5, sizeof(double), &(image->yMin));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 6, sizeof(double), &(image->yMax));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 7, sizeof(int), &(image->maxIters));
-	err |= clSetKernelArg(render->renderMandelbrotKernel, 8, sizeof(double), &(image->colourPeriod));
+	const int nPixels = image->xRes * image->yRes;
+	const int nHistograms = OPENCLHISTOGRAMGROUPS;
+
+	// Reset the range. The kernel reads these as ints.
+	static const cl_float initialRange[2] = {FLT_MAX, 0.0f};
+	err = clEnqueueWriteBuffer(render->queue, render->escapeRange, CL_FALSE, 0, sizeof(initialRange), initialRange,
+	                           0, NULL, NULL);
 	CheckOpenCLError(err, __LINE__);
 
-	err = clEnqueueNDRangeKernel(render->queue, render->renderMandelbrotKernel, 1, NULL,
+	err  = clSetKernelArg(render->escapeRangeKernel, 0, sizeof(cl_mem), &(render->escapeDevice));
+	err |= clSetKernelArg(render->escapeRangeKernel, 1, sizeof(cl_mem), &(render->escapeRange));
+	CheckOpenCLError(err, __LINE__);
+	err = clEnqueueNDRangeKernel(render->queue, render->escapeRangeKernel, 1, NULL,
+	                             &(render->globalSize), &(render->localSize), 0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+
+	err  = clSetKernelArg(render->histogramKernel, 0, sizeof(cl_mem), &(render->escapeDevice));
+	err |= clSetKernelArg(render->histogramKernel, 1, sizeof(int), &nPixels);
+	err |= clSetKernelArg(render->histogramKernel, 2, sizeof(cl_mem), &(render->escapeRange));
+	err |= clSetKernelArg(render->histogramKernel, 3, sizeof(cl_mem), &(render->histograms));
+	CheckOpenCLError(err, __LINE__);
+	size_t histogramSize = nHistograms * render->localSize;
+	err = clEnqueueNDRangeKernel(render->queue, render->histogramKernel, 1, NULL,
+	                             &histogramSize, &(render->localSize), 0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+
+	// A single work-group merges the histograms
+	err  = clSetKernelArg(render->histogramCDFKernel, 0, sizeof(cl_mem), &(render->histograms));
+	err |= clSetKernelArg(render->histogramCDFKernel, 1, sizeof(int), &nHistograms);
+	err |= clSetKernelArg(render->histogramCDFKernel, 2, sizeof(cl_mem), &(render->histogramCDF));
+	CheckOpenCLError(err, __LINE__);
+	err = clEnqueueNDRangeKernel(render->queue, render->histogramCDFKernel, 1, NULL,
+	                             &(render->localSize), &(render->localSize), 0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+}
+
+
+void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image)
+{
+	if (image->orbitDensity) {
+		RenderOrbitDensityOpenCL(render, image);
+		return;
+	}
+
+	int err;
+	// The persistent kernel is only available in double precision
+	int persistent = 0;
+#ifdef OPENCLPERSISTENT
+	persistent = !(render->emulateDouble);
+#endif
+	// 0 unless we are computing distance estimates
+	const float distanceScale = (float)DistanceScale(image);
+
+	if (persistent) {
+		// The persistent kernel visits pixels in the order (i*permStride)%nPixels. Choose a stride close to
+		// nPixels/(golden ratio), so that consecutive work is spread over the image, which is coprime to
+		// nPixels so that every pixel is visited exactly once.
+		const int nPixels = image->xRes * image->yRes;
+		int permStride = (int)(nPixels * 0.6180339887);
+		while (GreatestCommonDivisor(permStride, nPixels) != 1) {
+			permStride++;
+		}
+
+		// Reset the work queue
+		static const cl_int zero = 0;
+		err = clEnqueueWriteBuffer(render->queue, render->workCounter, CL_FALSE, 0, sizeof(cl_int), &zero, 0, NULL, NULL);
+		CheckOpenCLError(err, __LINE__);
+
+		// Set kernel args
+		err  = clSetKernelArg(render->renderMandelbrotPersistentKernel, 0, sizeof(cl_mem), &(render->escapeDevice));
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 1, sizeof(int), &(image->xRes));
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 2, sizeof(int), &(image->yRes));
+		err |= SetViewKernelArgs(render->renderMandelbrotPersistentKernel, 3, render, image);
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 7, sizeof(int), &(image->maxIters));
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 8, sizeof(float), &distanceScale);
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 9, sizeof(cl_mem), &(render->workCounter));
+		err |= clSetKernelArg(render->renderMandelbrotPersistentKernel, 10, sizeof(int), &permStride);
+		CheckOpenCLError(err, __LINE__);
+
+		// Launch only enough work-groups to fill the device
+		size_t persistentSize = render->deviceComputeUnits * OPENCLPERSISTENTGROUPS * render->localSize;
+		err = clEnqueueNDRangeKernel(render->queue, render->renderMandelbrotPersistentKernel, 1, NULL,
+		                             &persistentSize, &(render->localSize), 0, NULL, NULL);
+		CheckOpenCLError(err, __LINE__);
+	}
+
+	else {
+		// Set kernel args
+		err  = clSetKernelArg(render->renderMandelbrotKernel, 0, sizeof(cl_mem), &(render->escapeDevice));
+		err |= clSetKernelArg(render->renderMandelbrotKernel, 1, sizeof(int), &(image->xRes));
+		err |= clSetKernelArg(render->renderMandelbrotKernel, 2, sizeof(int), &(image->yRes));
+		err |= SetViewKernelArgs(render->renderMandelbrotKernel, 3, render, image);
+		err |= clSetKernelArg(render->renderMandelbrotKernel, 7, sizeof(int), &(image->maxIters));
+		err |= clSetKernelArg(render->renderMandelbrotKernel, 8, sizeof(float), &distanceScale);
+		CheckOpenCLError(err, __LINE__);
+
+		err = clEnqueueNDRangeKernel(render->queue, render->renderMandelbrotKernel, 1, NULL,
+		                             &(render->globalSize), &(render->localSize), 0, NULL, NULL);
+		CheckOpenCLError(err, __LINE__);
+	}
+
+	RecolourMandelbrotOpenCL(render, image);
+}
+
+
+void RecolourMandelbrotOpenCL(renderStruct *render, imageStruct *image)
+{
+	int err;
+
+	// High resolution tiles reuse the histogram of the frame on screen, so that they are coloured alike
+	if (image->histogramColouring && !image->distanceEstimation && render->updateTex) {
+		BuildHistogramOpenCL(render, image);
+	}
+
+	// Colour pixels from the escape counts
+	err  = clSetKernelArg(render->colourKernel, 0, sizeof(cl_mem), &(render->pixelsDevice));
+	err |= clSetKernelArg(render->colourKernel, 1, sizeof(cl_mem), &(render->escapeDevice));
+	err |= SetColourKernelArgs(render->colourKernel, 2, render, image);
+	CheckOpenCLError(err, __LINE__);
+	err = clEnqueueNDRangeKernel(render->queue, render->colourKernel, 1, NULL,
 	                             &(render->globalSize), &(render->localSize), 0, NULL, NULL);
 	CheckOpenCLError(err, __LINE__);
 
@@ -403,19 +1835,14 @@ void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image)
 		// If we are using OpenGL OpenCL interop:
 		if (render->glclInterop) {
 			// set kernel args
-			err  = clSetKernelArg(render->gaussianBlurKernel, 0, sizeof(cl_mem), &(render->pixelsTex));
-			err |= clSetKernelArg(render->gaussianBlurKernel, 1, sizeof(int), &(image->xRes));
-			err |= clSetKernelArg(render->gaussianBlurKernel, 2, sizeof(int), &(image->yRes));
-			err |= clSetKernelArg(render->gaussianBlurKernel, 3, sizeof(cl_mem), &(render->pixelsDevice));
-			err |= clSetKernelArg(render->gaussianBlurKernel, 4, sizeof(int), &(image->gaussianBlur));
-			CheckOpenCLError(err, __LINE__);
+			SetOutputKernelArgs(render->gaussianBlurKernel, &(render->pixelsTex), render, image);
 
 			// Take ownership of OpenGL texture
 			glFinish();
 			err = clEnqueueAcquireGLObjects(render->queue, 1, &(render->pixelsTex), 0, 0, NULL);
 			CheckOpenCLError(err, __LINE__);
 
-			// Run blur kernel, which blurs (if GAUSSIANBLUR) and writes to texture
+			// Run blur kernel, which blurs (if gaussianBlur), supersamples edges (if supersample) and writes to texture
 			err = clEnqueueNDRangeKernel(render->queue, render->gaussianBlurKernel, 1, NULL,
 												  &(render->globalSize), &(render->localSize), 0, NULL, NULL);
 			CheckOpenCLError(err, __LINE__);
@@ -426,28 +1853,27 @@ void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image)
 		}
 
 
-		// otherwise, we have to blur using gaussianBlurKernel2, and transfer the
-		// data to the host array for rendering
+		// otherwise, we have to blur using gaussianBlurKernel2, and map the output
+		// buffer to the host for rendering
 		else {
 			// set kernel args
-			err  = clSetKernelArg(render->gaussianBlurKernel2, 0, sizeof(cl_mem), &(render->pixelsTex));
-			err |= clSetKernelArg(render->gaussianBlurKernel2, 1, sizeof(int), &(image->xRes));
-			err |= clSetKernelArg(render->gaussianBlurKernel2, 2, sizeof(int), &(image->yRes));
-			err |= clSetKernelArg(render->gaussianBlurKernel2, 3, sizeof(cl_mem), &(render->pixelsDevice));
-			err |= clSetKernelArg(render->gaussianBlurKernel2, 4, sizeof(int), &(image->gaussianBlur));
-			CheckOpenCLError(err, __LINE__);
+			SetOutputKernelArgs(render->gaussianBlurKernel2, &(render->pixelsTex), render, image);
 			// Run blur kernel 2, which blurs (if GAUSSIANBLUR) and writes to global array instead of texture
 			err = clEnqueueNDRangeKernel(render->queue, render->gaussianBlurKernel2, 1, NULL,
 												  &(render->globalSize), &(render->localSize), 0, NULL, NULL);
 			CheckOpenCLError(err, __LINE__);
 
-			// Transfer data back to host
+			// Map the output buffer, which was allocated with CL_MEM_ALLOC_HOST_PTR, and upload directly
+			// from the mapped pointer. If the device shares memory with the host, there is no copy at all.
 			size_t readSize = image->xRes * image->yRes * sizeof *(image->pixels) * 3;
-			clEnqueueReadBuffer(render->queue, render->pixelsTex, CL_TRUE, 0, readSize, image->pixels, 0, NULL, NULL);
+			float *mappedPixels = clEnqueueMapBuffer(render->queue, render->pixelsTex, CL_TRUE, CL_MAP_READ, 0, readSize,
+			                                         0, NULL, NULL, &err);
+			CheckOpenCLError(err, __LINE__);
 
-			if (render->updateTex) {
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->xRes, image->yRes, 0, GL_RGB, GL_FLOAT, image->pixels);
-			}
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->xRes, image->yRes, 0, GL_RGB, GL_FLOAT, mappedPixels);
+
+			err = clEnqueueUnmapMemObject(render->queue, render->pixelsTex, mappedPixels, 0, NULL, NULL);
+			CheckOpenCLError(err, __LINE__);
 		}
 
 
@@ -457,12 +1883,7 @@ void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image)
 	// texture, so need to call an alternative gaussian blur kernel that stores in device
 	// global memory. Copy back to host memory in HighResolutionRender().
 	else {
-		err  = clSetKernelArg(render->gaussianBlurKernel2, 0, sizeof(cl_mem), &(render->pixelsTex));
-		err |= clSetKernelArg(render->gaussianBlurKernel2, 1, sizeof(int), &(image->xRes));
-		err |= clSetKernelArg(render->gaussianBlurKernel2, 2, sizeof(int), &(image->yRes));
-		err |= clSetKernelArg(render->gaussianBlurKernel2, 3, sizeof(cl_mem), &(render->pixelsDevice));
-		err |= clSetKernelArg(render->gaussianBlurKernel2, 4, sizeof(int), &(image->gaussianBlur));
-		CheckOpenCLError(err, __LINE__);
+		SetOutputKernelArgs(render->gaussianBlurKernel2, &(render->pixelsTex), render, image);
 
 		// Run blur kernel 2, which blurs (if GAUSSIANBLUR) and writes to global array instead of texture
 		err = clEnqueueNDRangeKernel(render->queue, render->gaussianBlurKernel2, 1, NULL,
@@ -4,10 +4,17 @@
 // Compute mandelbrot set inside supplied coordinates, returned in *image. Resolution variables used to
 // determine mandelbrot coordinates of each pixel.
 
+#ifndef MANDELBROT_H
+#define MANDELBROT_H
 
 // Includes
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #ifdef WITHGMP
 	#include <gmp.h>
@@ -30,11 +37,91 @@
 #include "structs.h"
 #include "GaussianBlur.h"
 #include "config.h"
+#include "formula.h"
 #include "GetWallTime.h"
 
 
-// Set pixels in r,g,b pointers based on final iteration value
-void SetPixelColour(const int iter, const int maxIters, float mag, float *r, float *g, float *b, const double colourPeriod);
+// Doubles per pixel of image->orbits: z and dz/dc, or for the fixed point routine, the bits of z's two
+// 128 bit parts, then dz/dc
+#ifdef WITHFIXED
+#define ORBITVALUES 6
+#else
+#define ORBITVALUES 4
+#endif
+
+
+// Smoothed escape count, from the final iteration count and magnitude. Negative (-1) for pixels which
+// reached maxIters, which are considered inside the set.
+float SmoothEscape(const int iter, const int maxIters, const float mag);
+
+// Estimated distance to the set in pixels, from the final iteration count, magnitude, and squared
+// magnitude of the derivative dz/dc. distanceScale is the number of pixels per unit. Negative (-1) for
+// pixels which reached maxIters.
+float DistanceEscape(const int iter, const int maxIters, const double mag, const double dzMagSq,
+                     const double distanceScale);
+
+
+// Set image's view to be centred on xCentre, yCentre, width wide, with square pixels. Set image->xRes
+// and yRes first.
+void SetView(imageStruct *image, const double xCentre, const double yCentre, const double width);
+
+// Set image's view to span xMin..xMax, yMin..yMax. Set image->xRes and yRes first.
+void SetViewBounds(imageStruct *image, const double xMin, const double xMax, const double yMin, const double yMax);
+
+// Move the centre of image's view by xShift, yShift, keeping the rounding error in xCentreLo, yCentreLo,
+// so that a long drag in a deep zoom doesn't drift.
+void MoveView(imageStruct *image, const double xShift, const double yShift);
+
+// Narrow image's view to its rows rowStart to rowStart+rows-1, for rendering in tiles, and set yRes.
+void CropRows(imageStruct *image, const unsigned rowStart, const unsigned rows);
+
+// The x and y view coordinates of column x and row y of image, which may be fractional. The offset from
+// the centre is added to the centre's low part first, so that each is rounded once.
+double ViewX(const imageStruct *image, const double x);
+double ViewY(const imageStruct *image, const double y);
+
+// 0 if image's pixels are too closely spaced for double precision to tell neighbours apart
+int ViewResolved(const imageStruct *image);
+
+
+// Fill paletteLUT, of 3*(PALETTELUTSIZE+2) floats, with r,g,b values interpolated from PALETTE. Entry
+// PALETTELUTSIZE+1 is black, for pixels inside the set. Shared by the CPU routines and OpenCL kernels.
+void BuildPaletteLUT(float *paletteLUT);
+
+
+// Colour image->pixels from the escape counts in image->escape, which the rendering routines compute,
+// then supersample and blur (if enabled) and update the texture. Called at the end of the CPU rendering
+// routines, and on its own if only the colouring has changed. With render->shaderColouring, only the
+// histogram is built, and the escape counts left for the fragment shader.
+void RecolourMandelbrotCPU(renderStruct *render, imageStruct *image);
+
+
+// Pseudo-random number in [0,1) from x, y and s: pixel x,y and sample number s, to jitter supersamples, or
+// a sample number and coordinate, to place orbit density samples. Must match the OpenCL version in
+// mandelbrotKernel.cl.
+float Jitter(const unsigned x, const unsigned y, const unsigned s);
+
+
+// Replace pixels which differ strongly in colour from their neighbours with the average colour of
+// SUPERSAMPLEN*SUPERSAMPLEN jittered samples. Double precision, used by the CPU and AVX routines.
+void AdaptiveSupersample(imageStruct *image);
+
+
+// Choose maxIters for image's view: iterate a coarse grid of points, with increasing iteration limits,
+// and take the escape count beyond which only a fraction AUTOITERSTAIL of points escape. Returns
+// image->maxIters if cancelled through render.
+unsigned AutoMaxIters(const renderStruct *render, const imageStruct *image);
+
+
+#ifdef EARLYBAIL
+// Returns 1 if c = Rec + i*Imc is inside the cardioid, the period-2 bulb, or one of the discs inside
+// the larger period-3 and period-4 bulbs. Such points never escape.
+int InteriorPoint(const double Rec, const double Imc);
+#endif
+
+
+// 1 if the render should stop early, as render->cancel has been set.
+int RenderCancelled(const renderStruct *render);
 
 
 // Basic routine, using CPU.
@@ -45,6 +132,12 @@ void RenderMandelbrotCPU(renderStruct *render, imageStruct *image);
 void RenderMandelbrotGMPCPU(renderStruct *render, imageStruct *image);
 #endif
 
+#ifdef WITHFIXED
+// 128 bit fixed point routine, for views too deep for double precision. The view's centre is held in
+// double-double, so pixels can be no smaller than about 1e-31 (see FixedViewResolved).
+void RenderMandelbrotFixedCPU(renderStruct *render, imageStruct *image);
+#endif
+
 #ifdef WITHAVX
 // AVX Vectorized
 void RenderMandelbrotAVXCPU(renderStruct *render, imageStruct *image);
@@ -55,4 +148,9 @@ void RenderMandelbrotAVXCPU(renderStruct *render, imageStruct *image);
 // This function blocks until OpenCL has finished with the texture, and OpenGL is free to
 // use it.
 void RenderMandelbrotOpenCL(renderStruct *render, imageStruct *image);
+
+// Colour (and blur, supersample) the escape counts of the last render, as above.
+void RecolourMandelbrotOpenCL(renderStruct *render, imageStruct *image);
+#endif
+
 #endif
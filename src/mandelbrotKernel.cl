@@ -1,161 +1,883 @@
 // OpenCL Kernel to render the mandelbrot set
 
 #include "config.h"
+#include "formula.h"
 
 
-__kernel void renderMandelbrotKernel(__global float * restrict pixels, const int xRes, const int yRes,
-                                     const double xMin, const double xMax, const double yMin, const double yMax,
-                                     const int maxIters, const double colourPeriod)
+// Smoothed escape count, from the final iteration count and magnitude, or -1 if the point reached
+// maxIters. As SmoothEscape in mandelbrot.c; ln(log2(mag)) = ln(2)*log2(log2(mag)).
+float SmoothEscape(const int iter, const int maxIters, const float mag)
 {
-	const int x = get_global_id(0)%xRes;
-	const int y = get_global_id(0)/xRes;
+	if (iter == maxIters) {
+		return -1.0f;
+	}
+	return fmax(0.0f, iter - M_LN2_F/log2((float)FORMULA_POWER)*native_log2(native_log2(mag)));
+}
+
+
+// Estimated distance to the set in pixels, from the final iteration count, magnitude and |dz/dc|, or -1
+// if the point reached maxIters. As DistanceEscape in mandelbrot.c.
+float DistanceEscape(const int iter, const int maxIters, const float mag, const float dzMag, const float distanceScale)
+{
+	if (iter == maxIters) {
+		return -1.0f;
+	}
+	return 0.5f*sqrt(mag)*log(mag)/dzMag*distanceScale;
+}
+
+
+// Colouring parameters, as passed to the kernels. If distanceEstimation, escape values are distance
+// estimates rather than escape counts. escapeRange holds the min and max escape values of
+// the frame (as ints, see escapeRangeKernel) and histogramCDF the cumulative distribution of escape
+// values over HISTOGRAMBINS bins between them; these are only used if histogramColouring. paletteLUT
+// holds the colours, built on the host by BuildPaletteLUT.
+#define COLOURPARAMS const int distanceEstimation, const int histogramColouring, const float colourPeriod, \
+                     __global const float * restrict histogramCDF, __global const int * restrict escapeRange, \
+                     __global const float * restrict paletteLUT
+#define COLOURARGS distanceEstimation, histogramColouring, colourPeriod, histogramCDF, escapeRange, paletteLUT
+
+
+// Position of escape value in the histogram, in [0,HISTOGRAMBINS]
+float HistogramBin(const float escape, const float escapeMin, const float escapeMax)
+{
+	const float width = (escapeMax > escapeMin) ? (escapeMax-escapeMin) : 1.0f;
+	return clamp((escape-escapeMin)/width*HISTOGRAMBINS, 0.0f, (float)HISTOGRAMBINS);
+}
+
+
+// Set r,g,b values from a smoothed escape count. Either cycle through the gradient every colourPeriod
+// iterations or, if histogramColouring, HISTOGRAMCYCLES times over the cumulative distribution of
+// escape values, so that colours are spread evenly over the pixels at any depth. Distance estimates go
+// from the start of the palette at the boundary to the middle of it DISTANCEWIDTH pixels away.
+void EscapeColour(const float escape, COLOURPARAMS, float *r, float *g, float *b)
+{
+	float position;
+	if (distanceEstimation) {
+		position = 0.5f*sqrt(fmin(1.0f, fmax(0.0f, escape)/DISTANCEWIDTH));
+	}
+	else if (histogramColouring) {
+		const float bin = HistogramBin(escape, as_float(escapeRange[0]), as_float(escapeRange[1]));
+		const int lower = min((int)bin, HISTOGRAMBINS-1);
+		// interpolate within the bin
+		const float cdf = histogramCDF[lower] + (bin-lower)*(histogramCDF[lower+1]-histogramCDF[lower]);
+		position = cdf*HISTOGRAMCYCLES;
+		position -= floor(position);
+	}
+	else {
+		position = fmod(escape, colourPeriod)/colourPeriod;
+	}
+
+	// The last entry of the LUT is black, for pixels inside the set
+	const int index = (escape < 0.0f) ? PALETTELUTSIZE+1 : (int)(position*PALETTELUTSIZE + 0.5f);
+	*r = paletteLUT[3*index + 0];
+	*g = paletteLUT[3*index + 1];
+	*b = paletteLUT[3*index + 2];
+}
+
+
+
+// Colour each pixel from its escape value
+__kernel void colourKernel(__global float * restrict pixels, __global const float * restrict escape,
+                           COLOURPARAMS)
+{
+	const int index = get_global_id(0);
+	float r,g,b;
+	EscapeColour(escape[index], COLOURARGS, &r, &g, &b);
+
+	pixels[index*3 + 0] = r;
+	pixels[index*3 + 1] = g;
+	pixels[index*3 + 2] = b;
+}
+
+
+
+// Histogram colouring, step 1: find the range of escape values of pixels outside the set, by a
+// reduction within each work-group (of power of two size) and then atomics. For non-negative floats the
+// bit patterns are ordered as the values, so escapeRange holds them as ints; the host sets it to
+// {FLT_MAX, 0} before launch.
+__kernel void escapeRangeKernel(__global const float * restrict escape, volatile __global int * restrict escapeRange)
+{
+	__local float localMin[OPENCLLOCALSIZE];
+	__local float localMax[OPENCLLOCALSIZE];
+	const int lid = get_local_id(0);
+
+	const float e = escape[get_global_id(0)];
+	localMin[lid] = (e < 0.0f) ? FLT_MAX : e;
+	localMax[lid] = (e < 0.0f) ? 0.0f : e;
+
+	for (int stride = get_local_size(0)/2; stride > 0; stride /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < stride) {
+			localMin[lid] = fmin(localMin[lid], localMin[lid+stride]);
+			localMax[lid] = fmax(localMax[lid], localMax[lid+stride]);
+		}
+	}
+
+	if (lid == 0) {
+		atomic_min(&escapeRange[0], as_int(localMin[0]));
+		atomic_max(&escapeRange[1], as_int(localMax[0]));
+	}
+}
+
+
+
+// Step 2: each work-group bins the escape values of a strided share of the pixels into a histogram in
+// local memory, and writes it out to its own slot of histograms.
+__kernel void histogramKernel(__global const float * restrict escape, const int nPixels,
+                              __global const int * restrict escapeRange, __global uint * restrict histograms)
+{
+	__local uint localHistogram[HISTOGRAMBINS];
+	const int lid = get_local_id(0);
+	const int localSize = get_local_size(0);
+
+	for (int bin = lid; bin < HISTOGRAMBINS; bin += localSize) {
+		localHistogram[bin] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const float escapeMin = as_float(escapeRange[0]);
+	const float escapeMax = as_float(escapeRange[1]);
+	for (int i = get_global_id(0); i < nPixels; i += get_global_size(0)) {
+		const float e = escape[i];
+		if (e >= 0.0f) {
+			atomic_inc(&localHistogram[min((int)HistogramBin(e, escapeMin, escapeMax), HISTOGRAMBINS-1)]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = lid; bin < HISTOGRAMBINS; bin += localSize) {
+		histograms[get_group_id(0)*HISTOGRAMBINS + bin] = localHistogram[bin];
+	}
+}
+
+
+
+// Step 3: merge the nHistograms histograms and compute their normalised cumulative distribution
+// (HISTOGRAMBINS+1 values) by a prefix sum. Run as a single work-group: each work-item merges a
+// contiguous block of bins, work-item 0 scans the block totals, then each work-item writes its block.
+__kernel void histogramCDFKernel(__global const uint * restrict histograms, const int nHistograms,
+                                 __global float * restrict histogramCDF)
+{
+	__local uint counts[HISTOGRAMBINS];
+	__local uint blockOffset[OPENCLLOCALSIZE+1];
+	const int lid = get_local_id(0);
+	const int localSize = get_local_size(0);
+	const int blockSize = (HISTOGRAMBINS + localSize-1)/localSize;
+	const int first = min(lid*blockSize, HISTOGRAMBINS);
+	const int last = min(first+blockSize, HISTOGRAMBINS);
+
+	uint blockTotal = 0;
+	for (int bin = first; bin < last; bin++) {
+		uint count = 0;
+		for (int h = 0; h < nHistograms; h++) {
+			count += histograms[h*HISTOGRAMBINS + bin];
+		}
+		counts[bin] = count;
+		blockTotal += count;
+	}
+	blockOffset[lid+1] = blockTotal;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) {
+		blockOffset[0] = 0;
+		for (int i = 1; i <= localSize; i++) {
+			blockOffset[i] += blockOffset[i-1];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const float total = (float)max(blockOffset[localSize], 1u);
+	uint sum = blockOffset[lid];
+	for (int bin = first; bin < last; bin++) {
+		histogramCDF[bin] = sum/total;
+		sum += counts[bin];
+	}
+	if (lid == 0) {
+		histogramCDF[HISTOGRAMBINS] = blockOffset[localSize]/total;
+	}
+}
+
+
+
+// Pseudo-random number in [0,1) from pixel x,y and sample number s, used to jitter supersamples, or from
+// a sample number and coordinate, to place orbit density samples. Must match the CPU version in mandelbrot.c.
+float Jitter(const uint x, const uint y, const uint s)
+{
+	uint h = (x * 0x8da6b343u) ^ (y * 0xd8163841u) ^ (s * 0xcb1ab31fu);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (float)(h >> 8) / 16777216.0f;
+}
+
+
+// Returns 1 if the colour of pixel x,y differs from any of its neighbours by more than
+// SUPERSAMPLETHRESHOLD (sum of absolute differences of r,g,b), or one of them is inside the set and the
+// other is not, or (if distanceEstimation) the boundary is within a pixel, and pixel x,y should be
+// supersampled.
+int IsEdge(__global const float * restrict pixels, __global const float * restrict escape,
+           const int x, const int y, const int xRes, const int yRes, const int distanceEstimation)
+{
+	const int index = y*xRes + x;
+	if (distanceEstimation && escape[index] >= 0.0f && escape[index] < 1.0f) {
+		return 1;
+	}
+	const int neighbours[4] = {y*xRes + max(x-1, 0), y*xRes + min(x+1, xRes-1),
+	                           max(y-1, 0)*xRes + x, min(y+1, yRes-1)*xRes + x};
+
+	for (int n = 0; n < 4; n++) {
+		const float diff = fabs(pixels[index*3 + 0] - pixels[neighbours[n]*3 + 0])
+		                 + fabs(pixels[index*3 + 1] - pixels[neighbours[n]*3 + 1])
+		                 + fabs(pixels[index*3 + 2] - pixels[neighbours[n]*3 + 2]);
+		if (diff > SUPERSAMPLETHRESHOLD || (escape[index] < 0.0f) != (escape[neighbours[n]] < 0.0f)) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	int iter = 0;
 
-	double u = 0.0, v = 0.0, uNew, vNew;
-	double uSq = 0.0, vSq = 0.0;
-	const double xPix = ( (double)x / (double)xRes );
-	const double yPix = ( (double)y / (double)yRes );
-	const double Rec = (1.0-xPix)*xMin + xPix*xMax;
-	const double Imc = (1.0-yPix)*yMin + yPix*yMax;
 
 #ifdef EARLYBAIL
-	// early bail-out if point is inside cardioid or period 2 bulb
+// Returns 1 if c = Rec + i*Imc is inside one of the discs inside the larger period-3 and period-4 bulbs.
+// The discs keep well clear of the bulbs' boundaries, so single precision is enough.
+int InteriorDisc(const float Rec, const float Imc)
+{
+	const float ImcAbs = fabs(Imc);
+	return ((Rec-(float)BULB3X)*(Rec-(float)BULB3X) + (ImcAbs-(float)BULB3Y)*(ImcAbs-(float)BULB3Y) < (float)BULB3RSQ)
+	    || ((Rec-(float)BULB4X)*(Rec-(float)BULB4X) + (ImcAbs-(float)BULB4Y)*(ImcAbs-(float)BULB4Y) < (float)BULB4RSQ)
+	    || ((Rec-(float)BULB4BX)*(Rec-(float)BULB4BX) + (ImcAbs-(float)BULB4BY)*(ImcAbs-(float)BULB4BY) < (float)BULB4BRSQ);
+}
+#endif
+
+
+
+#ifndef EMULATEDOUBLE
+// The view, as passed to the kernels: the point of pixel 0,0, and the pixel spacing
+#define VIEWPARAMS const double xMin, const double xStep, const double yMin, const double yStep
+#define VIEWARGS xMin, xStep, yMin, yStep
+
+
+#ifdef EARLYBAIL
+// Returns 1 if c = Rec + i*Imc is inside the cardioid or one of the larger bulbs
+int InteriorPoint(const double Rec, const double Imc)
+{
 	const double RecSq = Rec*Rec;
 	const double ImcSq = Imc*Imc;
 	const double q = (RecSq - 0.5*Rec + 0.125) + ImcSq;
-	if ((q*(q+(Rec-0.25)) < (ImcSq*0.25)) || ((RecSq + 2.0*Rec + 1.0) + ImcSq < 1.0/16.0)) {
-		iter = maxIters;
+	return (q*(q+(Rec-0.25)) < (ImcSq*0.25)) || ((RecSq + 2.0*Rec + 1.0) + ImcSq < 1.0/16.0)
+	       || InteriorDisc((float)Rec, (float)Imc);
+}
+#endif
+
+
+// Iterate point Rec + i*Imc, return the final iteration count and set *mag to the final magnitude
+int IteratePoint(const double Rec, const double Imc, const int maxIters, float *mag)
+{
+	int iter = 0;
+
+	double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+	double uSq = u*u, vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+
+#ifdef EARLYBAIL
+	// early bail-out if point is inside cardioid or one of the larger bulbs
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0f;
+		return maxIters;
 	}
 #endif
 
 	while ( (uSq+vSq) <= 4.0 && iter < maxIters) {
-		uNew = uSq-vSq + Rec;
-		uSq = uNew*uNew;
-		vNew = 2.0*u*v + Imc;
-		vSq = vNew*vNew;
-		u = uNew;
-		v = vNew;
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
 		iter++;
 	}
 
-	float r,g,b;
+	*mag = uSq+vSq;
+	return iter;
+}
 
-	if (iter == maxIters) {
-		r = 0.0;
-		g = 0.0;
-		b = 0.0;
+
+// As IteratePoint, also computing the derivative dz/dc, for distance estimates. Iterate until
+// |z|^2 > DISTANCEBAILOUT and set *dzMag to the final |dz/dc|.
+int IteratePointDistance(const double Rec, const double Imc, const int maxIters, float *mag, float *dzMag)
+{
+	int iter = 0;
+
+	double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+	double uSq = u*u, vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+	double du = FORMULA_DZ0, dv = 0.0;
+
+#ifdef EARLYBAIL
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0f;
+		*dzMag = 1.0f;
+		return maxIters;
+	}
+#endif
+
+	while ( (uSq+vSq) <= DISTANCEBAILOUT && iter < maxIters) {
+		// dz = f'(z)*dz + 1
+		FORMULA_DSTEP(double, u, v, du, dv);
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+		iter++;
 	}
 
-	else {
-		float smooth = fmod((iter -log(log(uSq+vSq)/log(2.0f))),colourPeriod)/colourPeriod;
+	*mag = uSq+vSq;
+	*dzMag = sqrt(du*du + dv*dv);
+	return iter;
+}
 
-		if (smooth < 0.25) {
-			r = 0.0;
-			g = 0.5*smooth*4.0;
-			b = 1.0*smooth*4.0;
+
+// Iterate point Rec + i*Imc and return its escape value: the smoothed escape count or, if
+// distanceScale > 0, the distance estimate in pixels (distanceScale is pixels per unit).
+float PointEscape(const double Rec, const double Imc, const int maxIters, const float distanceScale)
+{
+	float mag;
+	if (distanceScale > 0.0f) {
+		float dzMag;
+		const int iter = IteratePointDistance(Rec, Imc, maxIters, &mag, &dzMag);
+		return DistanceEscape(iter, maxIters, mag, dzMag, distanceScale);
+	}
+	const int iter = IteratePoint(Rec, Imc, maxIters, &mag);
+	return SmoothEscape(iter, maxIters, mag);
+}
+
+
+// Colour of pixel x,y averaged over SUPERSAMPLEN*SUPERSAMPLEN jittered samples
+void SupersamplePixel(const int x, const int y, const int xRes, const int yRes, VIEWPARAMS,
+                      const int maxIters, const float distanceScale, COLOURPARAMS, float *r, float *g, float *b)
+{
+	*r = 0.0f;
+	*g = 0.0f;
+	*b = 0.0f;
+
+	for (int s = 0; s < SUPERSAMPLEN*SUPERSAMPLEN; s++) {
+		const float dx = ((s%SUPERSAMPLEN) + Jitter(x, y, 2*s)) / SUPERSAMPLEN - 0.5f;
+		const float dy = ((s/SUPERSAMPLEN) + Jitter(x, y, 2*s+1)) / SUPERSAMPLEN - 0.5f;
+		const double Rec = xMin + ((double)x + dx)*xStep;
+		const double Imc = yMin + ((double)y + dy)*yStep;
+
+		float rs, gs, bs;
+		EscapeColour(PointEscape(Rec, Imc, maxIters, distanceScale), COLOURARGS, &rs, &gs, &bs);
+		*r += rs;
+		*g += gs;
+		*b += bs;
+	}
+
+	*r /= SUPERSAMPLEN*SUPERSAMPLEN;
+	*g /= SUPERSAMPLEN*SUPERSAMPLEN;
+	*b /= SUPERSAMPLEN*SUPERSAMPLEN;
+}
+
+
+
+__kernel void renderMandelbrotKernel(__global float * restrict escape, const int xRes, const int yRes,
+                                     VIEWPARAMS, const int maxIters, const float distanceScale)
+{
+	const int x = get_global_id(0)%xRes;
+	const int y = get_global_id(0)/xRes;
+
+	const double Rec = xMin + (double)x*xStep;
+	const double Imc = yMin + (double)y*yStep;
+
+	escape[y*xRes + x] = PointEscape(Rec, Imc, maxIters, distanceScale);
+}
+
+
+
+// Persistent-threads version of the above. Only enough work-groups to fill the device are launched,
+// and each work-item pulls batches of pixels from the global counter *workCounter (zeroed by the host
+// before launch). Iterations run in blocks of OPENCLPERSISTENTSTEPS, after which any work-item whose
+// pixel has finished stores it and fetches the next one, so lanes of a wavefront don't sit idle waiting
+// for their slowest neighbour. Work index i maps to pixel (i*permStride)%(xRes*yRes); permStride is
+// coprime to the pixel count, so this is a permutation which spreads expensive regions over the device.
+__kernel void renderMandelbrotPersistentKernel(__global float * restrict escape, const int xRes, const int yRes,
+                                               VIEWPARAMS, const int maxIters, const float distanceScale,
+                                               volatile __global int * restrict workCounter, const int permStride)
+{
+	const int nPixels = xRes*yRes;
+	// For distance estimates, we also track dz/dc and iterate to a larger radius
+	const double bailout = (distanceScale > 0.0f) ? DISTANCEBAILOUT : 4.0;
+
+	// next work index to take from this work-item's batch, and the end of the batch
+	int next = 0;
+	int batchEnd = 0;
+
+	// current pixel, and its iteration state. pixel == -1 means we have no pixel yet.
+	int pixel = -1;
+	int iter = maxIters;
+	double u = 0.0, v = 0.0;
+	double uSq = 0.0, vSq = 0.0;
+	double du = 0.0, dv = 0.0;
+	double Rec = 0.0, Imc = 0.0;
+
+	while (1) {
+
+		// If the current pixel has finished (or we don't have one yet), store it and fetch the next
+		if ((uSq+vSq) > bailout || iter >= maxIters) {
+			if (pixel >= 0) {
+				escape[pixel] = (distanceScale > 0.0f)
+				              ? DistanceEscape(iter, maxIters, uSq+vSq, sqrt(du*du + dv*dv), distanceScale)
+				              : SmoothEscape(iter, maxIters, uSq+vSq);
+			}
+
+			if (next == batchEnd) {
+				next = atomic_add(workCounter, OPENCLPERSISTENTBATCH);
+				batchEnd = min(next + OPENCLPERSISTENTBATCH, nPixels);
+			}
+			if (next >= nPixels) {
+				break;
+			}
+
+			pixel = (int)(((long)next * (long)permStride) % (long)nPixels);
+			next++;
+
+			const int x = pixel%xRes;
+			const int y = pixel/xRes;
+			Rec = xMin + (double)x*xStep;
+			Imc = yMin + (double)y*yStep;
+
+			iter = 0;
+			u = FORMULA_Z0(Rec, 0.0);
+			v = FORMULA_Z0(Imc, 0.0);
+			uSq = u*u;
+			vSq = v*v;
+			du = FORMULA_DZ0;
+			dv = 0.0;
+
+#ifdef EARLYBAIL
+			// early bail-out if point is inside cardioid or one of the larger bulbs
+			if (InteriorPoint(Rec, Imc)) {
+				iter = maxIters;
+				continue;
+			}
+#endif
 		}
-		else if (smooth < 0.5) {
-			r = 1.0*(smooth-0.25)*4.0;
-			g = 0.5 + 0.5*(smooth-0.25)*4.0;
-			b = 1.0;
+
+		// mandelbrot iterations, for at most OPENCLPERSISTENTSTEPS before checking for a new pixel
+		for (int i = 0; i < OPENCLPERSISTENTSTEPS && (uSq+vSq) <= bailout && iter < maxIters; i++) {
+			if (distanceScale > 0.0f) {
+				// dz = f'(z)*dz + 1
+				FORMULA_DSTEP(double, u, v, du, dv);
+			}
+			FORMULA_STEP(u, v, uSq, vSq, FORMULA_C(Rec, JULIARE), FORMULA_C(Imc, JULIAIM));
+			iter++;
 		}
-		else if (smooth < 0.75) {
-			r = 1.0;
-			g = 1.0 - 0.5*(smooth-0.5)*4.0;
-			b = 1.0 - (smooth-0.5)*4.0;
+	}
+}
+
+
+
+// Add x to *p. OpenCL 1.2 has no float atomics, so retry with atomic_cmpxchg until no other work-item
+// has changed *p in between.
+void AtomicAddFloat(volatile __global float *p, const float x)
+{
+	uint old = as_uint(*p);
+	uint prev;
+	while ((prev = atomic_cmpxchg((volatile __global uint *)p, old, as_uint(as_float(old) + x))) != old) {
+		old = prev;
+	}
+}
+
+
+// Orbit density (see orbitdensity.c): each work-item takes every global size'th of samples, chooses its
+// point as SamplePoint does from the grid's cells (the cumulative probabilities of the gridSize*gridSize
+// cells, then their weights), and if it escapes within maxIters, adds its weight to the density of each
+// pixel its orbit lands in. Each work-group adds to densities buffer group_id%nDensities, of xRes*yRes.
+__kernel void orbitDensityKernel(volatile __global float * restrict densities, const int nDensities,
+                                 const int xRes, const int yRes,
+                                 const double xLeft, const double xScale, const double yBottom, const double yScale,
+                                 const int maxIters, __global const float * restrict cells, const int gridSize,
+                                 const uint samples)
+{
+	const int nCells = gridSize*gridSize;
+	__global const float *weights = &cells[nCells+1];
+	volatile __global float *density = &densities[(size_t)(get_group_id(0)%nDensities)*xRes*yRes];
+	const double cellSize = 2.0*ORBITDENSITYRADIUS/gridSize;
+
+	for (uint s = get_global_id(0); s < samples; s += get_global_size(0)) {
+		// The cell i with cells[i] <= r < cells[i+1]
+		const float r = Jitter(s, 0, 0);
+		int lower = 0;
+		int upper = nCells;
+		while (upper - lower > 1) {
+			const int middle = lower + (upper-lower)/2;
+			if (cells[middle] <= r) {
+				lower = middle;
+			}
+			else {
+				upper = middle;
+			}
+		}
+		const double Rec = -ORBITDENSITYRADIUS + (lower%gridSize + Jitter(s, 1, 0))*cellSize;
+		const double Imc = -ORBITDENSITYRADIUS + (lower/gridSize + Jitter(s, 2, 0))*cellSize;
+
+		float mag;
+		const int iters = IteratePoint(Rec, Imc, maxIters, &mag);
+		if (iters == maxIters) {
+			continue;
 		}
-		else {
-			r = (1.0-(smooth-0.75)*4.0);
-			g = 0.5*(1.0-(smooth-0.75)*4.0);
-			b = 0.0;
+
+		// Iterate again, splatting the orbit
+		const float weight = weights[lower];
+		double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+		double uSq = u*u, vSq = v*v;
+		const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+		for (int iter = 0; iter < iters; iter++) {
+			FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+			const double x = (u - xLeft)*xScale;
+			const double y = (v - yBottom)*yScale;
+			if (x >= 0.0 && x < xRes && y >= 0.0 && y < yRes) {
+				AtomicAddFloat(&density[(int)y*xRes + (int)x], weight);
+			}
 		}
 	}
+}
+
+
+// Sum the nDensities densities of each pixel, scaled, into escape, and zero them for the next render
+__kernel void orbitDensityMergeKernel(__global float * restrict escape, __global float * restrict densities,
+                                      const int nDensities, const int nPixels, const float scale)
+{
+	const int index = get_global_id(0);
+	float sum = 0.0f;
+	for (int i = 0; i < nDensities; i++) {
+		sum += densities[(size_t)i*nPixels + index];
+		densities[(size_t)i*nPixels + index] = 0.0f;
+	}
+	escape[index] = sum*scale;
+}
+
+#else
+// The device does not support cl_khr_fp64. Emulate double precision with float-float arithmetic: each
+// value is stored as an unevaluated sum hi+lo of two floats (in a float2, .x = hi, .y = lo), giving
+// around 48 bits of mantissa. These routines rely on IEEE single precision rounding, so the program
+// must not be built with -cl-fast-relaxed-math or similar.
+
+// Sum of two floats, with the rounding error stored in lo
+float2 TwoSum(const float a, const float b)
+{
+	const float s = a + b;
+	const float bb = s - a;
+	return (float2)(s, (a - (s - bb)) + (b - bb));
+}
+
+// As above, requires |a| >= |b|
+float2 QuickTwoSum(const float a, const float b)
+{
+	const float s = a + b;
+	return (float2)(s, b - (s - a));
+}
 
-	pixels[y*xRes*3 + x*3 + 0] = r;
-	pixels[y*xRes*3 + x*3 + 1] = g;
-	pixels[y*xRes*3 + x*3 + 2] = b;
+// Product of two floats, with the rounding error stored in lo
+float2 TwoProd(const float a, const float b)
+{
+	const float p = a * b;
+#ifdef FP_FAST_FMAF
+	return (float2)(p, fma(a, b, -p));
+#else
+	// Dekker's splitting, if we don't have a fast fma
+	const float aBig = a * 4097.0f;
+	const float aHi = aBig - (aBig - a);
+	const float aLo = a - aHi;
+	const float bBig = b * 4097.0f;
+	const float bHi = bBig - (bBig - b);
+	const float bLo = b - bHi;
+	return (float2)(p, ((aHi*bHi - p) + aHi*bLo + aLo*bHi) + aLo*bLo);
+#endif
 }
 
+float2 FFAdd(const float2 a, const float2 b)
+{
+	float2 s = TwoSum(a.x, b.x);
+	const float2 t = TwoSum(a.y, b.y);
+	s.y += t.x;
+	s = QuickTwoSum(s.x, s.y);
+	s.y += t.y;
+	return QuickTwoSum(s.x, s.y);
+}
 
+float2 FFSub(const float2 a, const float2 b)
+{
+	return FFAdd(a, -b);
+}
 
-__kernel void gaussianBlurKernel(__write_only image2d_t image, const int xRes, const int yRes,
-                                 __global const float * restrict pixels, const int gaussianBlur)
+float2 FFMul(const float2 a, const float2 b)
+{
+	float2 p = TwoProd(a.x, b.x);
+	p.y += a.x*b.y + a.y*b.x;
+	return QuickTwoSum(p.x, p.y);
+}
+
+// Product with a float
+float2 FFMulF(const float2 a, const float b)
+{
+	float2 p = TwoProd(a.x, b);
+	p.y += a.y*b;
+	return QuickTwoSum(p.x, p.y);
+}
+
+float2 FFSqr(const float2 a)
+{
+	float2 p = TwoProd(a.x, a.x);
+	p.y += 2.0f*a.x*a.y;
+	return QuickTwoSum(p.x, p.y);
+}
+
+
+
+// Boundaries of the view, as passed to the kernels: the lower boundaries and the pixel spacing, split
+// into float-float on the host.
+#define VIEWPARAMS const float2 xMin, const float2 xStep, const float2 yMin, const float2 yStep
+#define VIEWARGS xMin, xStep, yMin, yStep
+
+
+#ifdef EARLYBAIL
+// Float-float version of InteriorPoint. The cardioid and period-2 tests need to be done at full
+// precision, or we misclassify points close to the boundary.
+int InteriorPoint(const float2 Rec, const float2 Imc)
+{
+	const float2 ImcSq = FFSqr(Imc);
+	const float2 RecShift = FFAdd(Rec, (float2)(-0.25f, 0.0f));
+	const float2 q = FFAdd(FFSqr(RecShift), ImcSq);
+	const float2 RecPlusOne = FFAdd(Rec, (float2)(1.0f, 0.0f));
+	return FFSub(FFMul(q, FFAdd(q, RecShift)), FFMulF(ImcSq, 0.25f)).x < 0.0f
+	       || FFAdd(FFSqr(RecPlusOne), ImcSq).x < 1.0f/16.0f
+	       || InteriorDisc(Rec.x, Imc.x);
+}
+#endif
+
+
+// Float-float version of IteratePoint
+int IteratePoint(const float2 Rec, const float2 Imc, const int maxIters, float *mag)
+{
+	int iter = 0;
+
+	float2 u = FORMULA_Z0(Rec, (float2)(0.0f, 0.0f));
+	float2 v = FORMULA_Z0(Imc, (float2)(0.0f, 0.0f));
+	float2 uSq = FFSqr(u);
+	float2 vSq = FFSqr(v);
+	const float2 cRe = FORMULA_C(Rec, (float2)((float)JULIARE, 0.0f));
+	const float2 cIm = FORMULA_C(Imc, (float2)((float)JULIAIM, 0.0f));
+
+#ifdef EARLYBAIL
+	// early bail-out if point is inside cardioid or one of the larger bulbs
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0f;
+		return maxIters;
+	}
+#endif
+
+	while ( (uSq.x+vSq.x) <= 4.0f && iter < maxIters) {
+		FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm);
+		iter++;
+	}
+
+	*mag = uSq.x+vSq.x;
+	return iter;
+}
+
+
+// Float-float version of IteratePointDistance. The derivative doesn't need the extra precision.
+int IteratePointDistance(const float2 Rec, const float2 Imc, const int maxIters, float *mag, float *dzMag)
+{
+	int iter = 0;
+
+	float2 u = FORMULA_Z0(Rec, (float2)(0.0f, 0.0f));
+	float2 v = FORMULA_Z0(Imc, (float2)(0.0f, 0.0f));
+	float2 uSq = FFSqr(u);
+	float2 vSq = FFSqr(v);
+	const float2 cRe = FORMULA_C(Rec, (float2)((float)JULIARE, 0.0f));
+	const float2 cIm = FORMULA_C(Imc, (float2)((float)JULIAIM, 0.0f));
+	float du = FORMULA_DZ0, dv = 0.0f;
+
+#ifdef EARLYBAIL
+	if (InteriorPoint(Rec, Imc)) {
+		*mag = 0.0f;
+		*dzMag = 1.0f;
+		return maxIters;
+	}
+#endif
+
+	while ( (uSq.x+vSq.x) <= DISTANCEBAILOUT && iter < maxIters) {
+		// dz = f'(z)*dz + 1
+		FORMULA_DSTEP(float, u.x, v.x, du, dv);
+		FORMULA_STEP_FF(u, v, uSq, vSq, cRe, cIm);
+		iter++;
+	}
+
+	*mag = uSq.x+vSq.x;
+	*dzMag = hypot(du, dv);
+	return iter;
+}
+
+
+// Float-float version of PointEscape
+float PointEscape(const float2 Rec, const float2 Imc, const int maxIters, const float distanceScale)
+{
+	float mag;
+	if (distanceScale > 0.0f) {
+		float dzMag;
+		const int iter = IteratePointDistance(Rec, Imc, maxIters, &mag, &dzMag);
+		return DistanceEscape(iter, maxIters, mag, dzMag, distanceScale);
+	}
+	const int iter = IteratePoint(Rec, Imc, maxIters, &mag);
+	return SmoothEscape(iter, maxIters, mag);
+}
+
+
+// Float-float version of SupersamplePixel
+void SupersamplePixel(const int x, const int y, const int xRes, const int yRes, VIEWPARAMS,
+                      const int maxIters, const float distanceScale, COLOURPARAMS, float *r, float *g, float *b)
+{
+	*r = 0.0f;
+	*g = 0.0f;
+	*b = 0.0f;
+
+	const float2 RecPixel = FFAdd(xMin, FFMulF(xStep, (float)x));
+	const float2 ImcPixel = FFAdd(yMin, FFMulF(yStep, (float)y));
+
+	for (int s = 0; s < SUPERSAMPLEN*SUPERSAMPLEN; s++) {
+		const float dx = ((s%SUPERSAMPLEN) + Jitter(x, y, 2*s)) / SUPERSAMPLEN - 0.5f;
+		const float dy = ((s/SUPERSAMPLEN) + Jitter(x, y, 2*s+1)) / SUPERSAMPLEN - 0.5f;
+		const float2 Rec = FFAdd(RecPixel, FFMulF(xStep, dx));
+		const float2 Imc = FFAdd(ImcPixel, FFMulF(yStep, dy));
+
+		float rs, gs, bs;
+		EscapeColour(PointEscape(Rec, Imc, maxIters, distanceScale), COLOURARGS, &rs, &gs, &bs);
+		*r += rs;
+		*g += gs;
+		*b += bs;
+	}
+
+	*r /= SUPERSAMPLEN*SUPERSAMPLEN;
+	*g /= SUPERSAMPLEN*SUPERSAMPLEN;
+	*b /= SUPERSAMPLEN*SUPERSAMPLEN;
+}
+
+
+
+// Float-float version of renderMandelbrotKernel.
+__kernel void renderMandelbrotKernel(__global float * restrict escape, const int xRes, const int yRes,
+                                     VIEWPARAMS, const int maxIters, const float distanceScale)
 {
 	const int x = get_global_id(0)%xRes;
 	const int y = get_global_id(0)/xRes;
-	float r,g,b;
 
+	// x and y are exact in single precision
+	const float2 Rec = FFAdd(xMin, FFMulF(xStep, (float)x));
+	const float2 Imc = FFAdd(yMin, FFMulF(yStep, (float)y));
+
+	escape[y*xRes + x] = PointEscape(Rec, Imc, maxIters, distanceScale);
+}
+#endif
+
+
+// Blurred (if gaussianBlur) colour of pixel x,y. The stencil is chosen by GAUSSIANBLURSIZE, as for the
+// CPU routine.
+void BlurPixel(__global const float * restrict pixels, const int x, const int y, const int xRes, const int yRes,
+               const int gaussianBlur, float *r, float *g, float *b)
+{
 	if (gaussianBlur == 0) {
-		r = pixels[y*xRes*3 + x*3 + 0];
-		g = pixels[y*xRes*3 + x*3 + 1];
-		b = pixels[y*xRes*3 + x*3 + 2];
+		*r = pixels[y*xRes*3 + x*3 + 0];
+		*g = pixels[y*xRes*3 + x*3 + 1];
+		*b = pixels[y*xRes*3 + x*3 + 2];
+		return;
+	}
+
+#if GAUSSIANBLURSIZE == 3 || GAUSSIANBLURSIZE == 5
+	// separable gaussian, weights are the binomial coefficients
+	#if GAUSSIANBLURSIZE == 5
+		const int radius = 2;
+		const float weights[5] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+	#else
+		const int radius = 1;
+		const float weights[3] = {1.0f/4.0f, 2.0f/4.0f, 1.0f/4.0f};
+	#endif
+	*r = 0.0f;
+	*g = 0.0f;
+	*b = 0.0f;
+	for (int j = -radius; j <= radius; j++) {
+		const int yn = clamp(y+j, 0, yRes-1);
+		for (int i = -radius; i <= radius; i++) {
+			const int xn = clamp(x+i, 0, xRes-1);
+			const float weight = weights[j+radius]*weights[i+radius];
+			*r += weight*pixels[yn*xRes*3 + xn*3 + 0];
+			*g += weight*pixels[yn*xRes*3 + xn*3 + 1];
+			*b += weight*pixels[yn*xRes*3 + xn*3 + 2];
+		}
 	}
 
+#else
+	const int yu = (y == yRes-1) ? y : y+1;
+	const int yd = (y == 0) ? y : y-1;
+	const int xl = (x == 0) ? x : x-1;
+	const int xr = (x == xRes-1) ? x : x+1;
+
+	*r = (+1.0f*pixels[yu*xRes*3 + x *3 + 0]
+		  +1.0f*pixels[y *xRes*3 + xr*3 + 0]
+		  +4.0f*pixels[y *xRes*3 + x *3 + 0]
+		  +1.0f*pixels[y *xRes*3 + xl*3 + 0]
+		  +1.0f*pixels[yd*xRes*3 + x *3 + 0])/8.0f;
+	*g = (+1.0f*pixels[yu*xRes*3 + x *3 + 1]
+		  +1.0f*pixels[y *xRes*3 + xr*3 + 1]
+		  +4.0f*pixels[y *xRes*3 + x *3 + 1]
+		  +1.0f*pixels[y *xRes*3 + xl*3 + 1]
+		  +1.0f*pixels[yd*xRes*3 + x *3 + 1])/8.0f;
+	*b = (+1.0f*pixels[yu*xRes*3 + x *3 + 2]
+		  +1.0f*pixels[y *xRes*3 + xr*3 + 2]
+		  +4.0f*pixels[y *xRes*3 + x *3 + 2]
+		  +1.0f*pixels[y *xRes*3 + xl*3 + 2]
+		  +1.0f*pixels[yd*xRes*3 + x *3 + 2])/8.0f;
+#endif
+}
+
+
+
+// Write the final image to the OpenGL texture. Blurs (if gaussianBlur) and, if supersample, replaces
+// pixels which differ strongly from their neighbours with an average over jittered subsamples.
+__kernel void gaussianBlurKernel(__write_only image2d_t image, const int xRes, const int yRes,
+                                 __global const float * restrict pixels, __global const float * restrict escape,
+                                 const int gaussianBlur, const int supersample, VIEWPARAMS, const int maxIters,
+                                 const float distanceScale, COLOURPARAMS)
+{
+	const int x = get_global_id(0)%xRes;
+	const int y = get_global_id(0)/xRes;
+	float r,g,b;
+
+	if (supersample && IsEdge(pixels, escape, x, y, xRes, yRes, distanceEstimation)) {
+		SupersamplePixel(x, y, xRes, yRes, VIEWARGS, maxIters, distanceScale, COLOURARGS, &r, &g, &b);
+	}
 	else {
-		const int yu = (y == yRes-1) ? y : y+1;
-		const int yd = (y == 0) ? y : y-1;
-		const int xl = (x == 0) ? x : x-1;
-		const int xr = (x == xRes-1) ? x : x+1;
-
-		r = (+1.0*pixels[yu*xRes*3 + x *3 + 0]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 0]
-			  +4.0*pixels[y *xRes*3 + x *3 + 0]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 0]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 0])/8.0;
-		g = (+1.0*pixels[yu*xRes*3 + x *3 + 1]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 1]
-			  +4.0*pixels[y *xRes*3 + x *3 + 1]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 1]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 1])/8.0;
-		b = (+1.0*pixels[yu*xRes*3 + x *3 + 2]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 2]
-			  +4.0*pixels[y *xRes*3 + x *3 + 2]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 2]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 2])/8.0;
+		BlurPixel(pixels, x, y, xRes, yRes, gaussianBlur, &r, &g, &b);
 	}
 
 	int2 coord = {x,y};
-	float4 colour = {r,g,b,1.0};
+	float4 colour = {r,g,b,1.0f};
 	write_imagef(image, coord, colour);
 }
 
 
 
+// As above, but writes to a global array instead of the texture
 __kernel void gaussianBlurKernel2(__global float * restrict output, const int xRes, const int yRes,
-                                  __global const float * restrict pixels, const int gaussianBlur)
+                                  __global const float * restrict pixels, __global const float * restrict escape,
+                                  const int gaussianBlur, const int supersample, VIEWPARAMS, const int maxIters,
+                                  const float distanceScale, COLOURPARAMS)
 {
 	const int x = get_global_id(0)%xRes;
 	const int y = get_global_id(0)/xRes;
 	float r,g,b;
 
-	if (gaussianBlur == 0) {
-		r = pixels[y*xRes*3 + x*3 + 0];
-		g = pixels[y*xRes*3 + x*3 + 1];
-		b = pixels[y*xRes*3 + x*3 + 2];
+	if (supersample && IsEdge(pixels, escape, x, y, xRes, yRes, distanceEstimation)) {
+		SupersamplePixel(x, y, xRes, yRes, VIEWARGS, maxIters, distanceScale, COLOURARGS, &r, &g, &b);
 	}
-
 	else {
-		const int yu = (y == yRes-1) ? y : y+1;
-		const int yd = (y == 0) ? y : y-1;
-		const int xl = (x == 0) ? x : x-1;
-		const int xr = (x == xRes-1) ? x : x+1;
-
-		r = (+1.0*pixels[yu*xRes*3 + x *3 + 0]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 0]
-			  +4.0*pixels[y *xRes*3 + x *3 + 0]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 0]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 0])/8.0;
-		g = (+1.0*pixels[yu*xRes*3 + x *3 + 1]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 1]
-			  +4.0*pixels[y *xRes*3 + x *3 + 1]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 1]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 1])/8.0;
-		b = (+1.0*pixels[yu*xRes*3 + x *3 + 2]
-			  +1.0*pixels[y *xRes*3 + xr*3 + 2]
-			  +4.0*pixels[y *xRes*3 + x *3 + 2]
-			  +1.0*pixels[y *xRes*3 + xl*3 + 2]
-			  +1.0*pixels[yd*xRes*3 + x *3 + 2])/8.0;
+		BlurPixel(pixels, x, y, xRes, yRes, gaussianBlur, &r, &g, &b);
 	}
 
 	output[y*xRes*3 + x*3 + 0] = r;
@@ -0,0 +1,360 @@
+#include "orbitdensity.h"
+
+// Each sample is a point p of the square |Re|,|Im| < ORBITDENSITYRADIUS, iterated from z = FORMULA_Z0(p)
+// with c = FORMULA_C(p), as for the escape counts. If it escapes within maxIters, its orbit is iterated
+// again, and each point of it which lands in the view adds the sample's weight to the density of that
+// pixel. Points which don't escape add nothing.
+//
+// Most orbits never come near a zoomed view, so samples are chosen by importance. The square is divided
+// into a grid of cells, each probed with a few points, counting the points of their orbits which land in
+// the view. Sample s chooses a cell in proportion to its count (plus a floor, so that every cell can be
+// chosen), and a point in the cell, from Jitter(s, k, 0). Its weight is the probability of the cell under
+// uniform sampling over the probability it was chosen with, so the density is an unbiased estimate of
+// the one uniform sampling would give, with far fewer samples wasted.
+//
+// Each thread adds to a density array of its own, of the image's size, and these are summed once the
+// samples are done, so the splats need no atomics and threads never contend for a cache line. On the
+// device, each work-group adds to one of a few density buffers, and a second kernel sums them.
+//
+// The density is scaled to the number of orbit points per pixel, if one orbit were started in each
+// pixel-sized square of the sampled square. This depends on neither the resolution nor the number of
+// samples, so that high resolution tiles, which are sampled separately, are coloured alike.
+
+
+// The grid of cells samples are chosen from: gridSize*gridSize cells, the cumulative probability of
+// choosing cells 0..i-1 in cdf[i], and the weight of a sample from cell i in weight[i]
+typedef struct {
+	unsigned gridSize;
+	double *cdf;
+	double *weight;
+} orbitGridStruct;
+
+// Where the points of an orbit land: column (u - xLeft)*xScale, row (v - yBottom)*yScale of the image
+typedef struct {
+	double xLeft;
+	double xScale;
+	double yBottom;
+	double yScale;
+	unsigned xRes;
+	unsigned yRes;
+} orbitViewStruct;
+
+
+
+static void OrbitView(const imageStruct *image, orbitViewStruct *view)
+{
+	// The edges of the first column and row
+	view->xLeft = ViewX(image, -0.5);
+	view->xScale = 1.0/image->xStep;
+	view->yBottom = ViewY(image, -0.5);
+	view->yScale = 1.0/image->yStep;
+	view->xRes = image->xRes;
+	view->yRes = image->yRes;
+}
+
+
+
+// Iterate point Rec + i*Imc, as IteratePoint in mandelbrot.c. Returns the number of iterations it takes
+// to escape, or 0 if it doesn't within maxIters.
+static unsigned EscapeIterations(const double Rec, const double Imc, const unsigned maxIters)
+{
+#ifdef EARLYBAIL
+	if (InteriorPoint(Rec, Imc)) {
+		return 0;
+	}
+#endif
+	unsigned iter = 0;
+	double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+	double uSq = u*u;
+	double vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+
+	while ( (uSq+vSq) <= 4.0 && iter < maxIters) {
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+		iter++;
+	}
+	return (iter < maxIters) ? iter : 0;
+}
+
+
+
+// Iterate point Rec + i*Imc for iters iterations again, and add weight to density at each point of the
+// orbit which lands in the view, unless density is NULL. Returns the number of points which did.
+static unsigned SplatOrbit(const double Rec, const double Imc, const unsigned iters,
+                           const orbitViewStruct *view, float *density, const float weight)
+{
+	double u = FORMULA_Z0(Rec, 0.0), v = FORMULA_Z0(Imc, 0.0);
+	double uSq = u*u;
+	double vSq = v*v;
+	const double cRe = FORMULA_C(Rec, JULIARE), cIm = FORMULA_C(Imc, JULIAIM);
+
+	unsigned hits = 0;
+	for (unsigned iter = 0; iter < iters; iter++) {
+		FORMULA_STEP(u, v, uSq, vSq, cRe, cIm);
+		const double x = (u - view->xLeft)*view->xScale;
+		const double y = (v - view->yBottom)*view->yScale;
+		if (x >= 0.0 && x < view->xRes && y >= 0.0 && y < view->yRes) {
+			hits++;
+			if (density != NULL) {
+				density[(size_t)(unsigned)y*view->xRes + (unsigned)x] += weight;
+			}
+		}
+	}
+	return hits;
+}
+
+
+
+// Probe each cell of the grid, as fine as ORBITDENSITYGRID if that takes no more than
+// ORBITDENSITYPROBEFRACTION of samples, and set the cells' probabilities and weights. Allocates
+// grid->cdf and grid->weight.
+static void BuildOrbitGrid(renderStruct *render, const imageStruct *image, const orbitViewStruct *view,
+                           const unsigned samples, orbitGridStruct *grid)
+{
+	grid->gridSize = (unsigned)fmax(1.0, fmin(ORBITDENSITYGRID,
+	                                          floor(sqrt(samples*ORBITDENSITYPROBEFRACTION/ORBITDENSITYPROBES))));
+	const unsigned gridSize = grid->gridSize;
+	const unsigned cells = gridSize*gridSize;
+	const double cellSize = 2.0*ORBITDENSITYRADIUS/gridSize;
+	grid->cdf = malloc((cells+1) * sizeof *(grid->cdf));
+	grid->weight = malloc(cells * sizeof *(grid->weight));
+	double *hits = grid->weight;
+
+	#pragma omp parallel for default(none) shared(render,image,view,hits) firstprivate(gridSize, cells, cellSize) schedule(dynamic)
+	for (unsigned cell = 0; cell < cells; cell++) {
+		hits[cell] = 0.0;
+		if (RenderCancelled(render)) {
+			continue;
+		}
+		for (unsigned k = 0; k < ORBITDENSITYPROBES; k++) {
+			const double Rec = -ORBITDENSITYRADIUS + (cell%gridSize + Jitter(cell, 2*k, 1))*cellSize;
+			const double Imc = -ORBITDENSITYRADIUS + (cell/gridSize + Jitter(cell, 2*k+1, 1))*cellSize;
+			const unsigned iters = EscapeIterations(Rec, Imc, image->maxIters);
+			if (iters > 0) {
+				hits[cell] += SplatOrbit(Rec, Imc, iters, view, NULL, 0.0f);
+			}
+		}
+	}
+
+	double total = 0.0;
+	for (unsigned cell = 0; cell < cells; cell++) {
+		total += hits[cell];
+	}
+	// With no hits at all, sample uniformly
+	const double floorHits = (total > 0.0) ? ORBITDENSITYFLOOR*total/cells : 1.0;
+	grid->cdf[0] = 0.0;
+	for (unsigned cell = 0; cell < cells; cell++) {
+		grid->cdf[cell+1] = grid->cdf[cell] + hits[cell] + floorHits;
+	}
+	const double sum = grid->cdf[cells];
+	for (unsigned cell = 0; cell < cells; cell++) {
+		// The uniform probability 1/cells, over the cell's probability (hits + floor)/sum
+		grid->weight[cell] = sum/cells/(hits[cell] + floorHits);
+		grid->cdf[cell] /= sum;
+	}
+	grid->cdf[cells] = 1.0;
+}
+
+
+
+// Sample s: choose a cell from the grid's distribution, and a point in it, and set its weight
+static void SamplePoint(const orbitGridStruct *grid, const unsigned s, double *Rec, double *Imc, float *weight)
+{
+	// The cell i with cdf[i] <= r < cdf[i+1]
+	const double r = Jitter(s, 0, 0);
+	unsigned lower = 0;
+	unsigned upper = grid->gridSize*grid->gridSize;
+	while (upper - lower > 1) {
+		const unsigned middle = lower + (upper-lower)/2;
+		if (grid->cdf[middle] <= r) {
+			lower = middle;
+		}
+		else {
+			upper = middle;
+		}
+	}
+	const double cellSize = 2.0*ORBITDENSITYRADIUS/grid->gridSize;
+	*Rec = -ORBITDENSITYRADIUS + (lower%grid->gridSize + Jitter(s, 1, 0))*cellSize;
+	*Imc = -ORBITDENSITYRADIUS + (lower/grid->gridSize + Jitter(s, 2, 0))*cellSize;
+	*weight = (float)grid->weight[lower];
+}
+
+
+
+// Number of samples for image: ORBITDENSITYSAMPLES per pixel
+static unsigned OrbitSamples(const imageStruct *image)
+{
+	return (unsigned)fmin(ORBITDENSITYSAMPLES*image->xRes*image->yRes, 4294967295.0);
+}
+
+
+
+// Scale from the sum of sample weights to the density, see above
+static double OrbitDensityScale(const imageStruct *image, const unsigned samples)
+{
+	return 4.0*ORBITDENSITYRADIUS*ORBITDENSITYRADIUS/((double)samples*fabs(image->xStep*image->yStep));
+}
+
+
+
+// Sample the orbit density of image's view into escape, on the host
+static void SampleOrbitDensity(renderStruct *render, const imageStruct *image, float *escape)
+{
+	const size_t nPixels = (size_t)image->xRes*image->yRes;
+	orbitViewStruct view;
+	OrbitView(image, &view);
+	const unsigned samples = OrbitSamples(image);
+	orbitGridStruct grid;
+	BuildOrbitGrid(render, image, &view, samples, &grid);
+
+	const int nThreads = omp_get_max_threads();
+	float *densities = calloc((size_t)nThreads*nPixels, sizeof *densities);
+	const unsigned batches = (samples + ORBITDENSITYBATCH-1)/ORBITDENSITYBATCH;
+
+	#pragma omp parallel default(none) shared(render,image,view,grid,densities) firstprivate(nPixels, samples, batches) num_threads(nThreads)
+	{
+		float *density = &(densities[omp_get_thread_num()*nPixels]);
+		#pragma omp for schedule(dynamic)
+		for (unsigned batch = 0; batch < batches; batch++) {
+			if (RenderCancelled(render)) {
+				continue;
+			}
+			const unsigned last = (batch+1 < batches) ? (batch+1)*ORBITDENSITYBATCH : samples;
+			for (unsigned s = batch*ORBITDENSITYBATCH; s < last; s++) {
+				double Rec, Imc;
+				float weight;
+				SamplePoint(&grid, s, &Rec, &Imc, &weight);
+				const unsigned iters = EscapeIterations(Rec, Imc, image->maxIters);
+				if (iters > 0) {
+					SplatOrbit(Rec, Imc, iters, &view, density, weight);
+				}
+			}
+		}
+	}
+
+	// Merge the threads' densities
+	const double scale = OrbitDensityScale(image, samples);
+	#pragma omp parallel for default(none) shared(escape,densities) firstprivate(nPixels, nThreads, scale) schedule(static)
+	for (size_t i = 0; i < nPixels; i++) {
+		double sum = 0.0;
+		for (int t = 0; t < nThreads; t++) {
+			sum += densities[t*nPixels + i];
+		}
+		escape[i] = (float)(sum*scale);
+	}
+
+	free(densities);
+	free(grid.cdf);
+	free(grid.weight);
+}
+
+
+
+void RenderOrbitDensityCPU(renderStruct *render, imageStruct *image)
+{
+	// There are no orbits to resume from
+	image->orbitIters = 0;
+
+	SampleOrbitDensity(render, image, image->escape);
+
+	if (RenderCancelled(render)) {
+		return;
+	}
+	RecolourMandelbrotCPU(render, image);
+}
+
+
+
+#ifdef WITHOPENCL
+void RenderOrbitDensityOpenCL(renderStruct *render, imageStruct *image)
+{
+	cl_int err;
+	const size_t nPixels = (size_t)image->xRes*image->yRes;
+
+	// The kernel is only built with double precision
+	if (render->emulateDouble) {
+		float *escape = malloc(nPixels * sizeof *escape);
+		SampleOrbitDensity(render, image, escape);
+		err = clEnqueueWriteBuffer(render->queue, render->escapeDevice, CL_TRUE, 0, nPixels * sizeof *escape, escape,
+		                           0, NULL, NULL);
+		CheckOpenCLError(err, __LINE__);
+		free(escape);
+		RecolourMandelbrotOpenCL(render, image);
+		return;
+	}
+
+	// The grid is built on the host, and copied to the device: the cdf, then the weights, as floats
+	orbitViewStruct view;
+	OrbitView(image, &view);
+	const unsigned samples = OrbitSamples(image);
+	orbitGridStruct grid;
+	BuildOrbitGrid(render, image, &view, samples, &grid);
+	const int gridSize = grid.gridSize;
+	const unsigned cells = grid.gridSize*grid.gridSize;
+	cl_float *gridCells = malloc((2*cells+1) * sizeof *gridCells);
+	for (unsigned cell = 0; cell <= cells; cell++) {
+		gridCells[cell] = (cl_float)grid.cdf[cell];
+	}
+	for (unsigned cell = 0; cell < cells; cell++) {
+		gridCells[cells+1+cell] = (cl_float)grid.weight[cell];
+	}
+	err = clEnqueueWriteBuffer(render->queue, render->orbitCells, CL_TRUE, 0, (2*cells+1) * sizeof *gridCells, gridCells,
+	                           0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+	free(gridCells);
+	free(grid.cdf);
+	free(grid.weight);
+
+	// As many density buffers as fit in one allocation. They are zeroed when allocated, and by the
+	// kernel which merges them, so are ready for the next render.
+	const int nDensities = (int)fmax(1.0, fmin(OPENCLORBITDENSITYBUFFERS,
+	                                           floor((double)render->deviceMaxAlloc/(nPixels*sizeof(cl_float)))));
+	const size_t densitiesSize = nDensities*nPixels*sizeof(cl_float);
+	if (densitiesSize > render->orbitDensitiesSize) {
+		if (render->orbitDensities != NULL) {
+			clReleaseMemObject(render->orbitDensities);
+		}
+		printf("   --- allocating orbit density buffers on device: %.2lfMB\n", densitiesSize/1024.0/1024.0);
+		render->orbitDensities = clCreateBuffer(render->contextCL, CL_MEM_READ_WRITE, densitiesSize, NULL, &err);
+		CheckOpenCLError(err, __LINE__);
+		static const cl_float zero = 0.0f;
+		err = clEnqueueFillBuffer(render->queue, render->orbitDensities, &zero, sizeof zero, 0, densitiesSize, 0, NULL, NULL);
+		CheckOpenCLError(err, __LINE__);
+		render->orbitDensitiesSize = densitiesSize;
+	}
+
+	// Launch only enough work-groups to fill the device; each work-item takes every globalSize'th sample
+	err  = clSetKernelArg(render->orbitDensityKernel, 0, sizeof(cl_mem), &(render->orbitDensities));
+	err |= clSetKernelArg(render->orbitDensityKernel, 1, sizeof(int), &nDensities);
+	err |= clSetKernelArg(render->orbitDensityKernel, 2, sizeof(int), &(image->xRes));
+	err |= clSetKernelArg(render->orbitDensityKernel, 3, sizeof(int), &(image->yRes));
+	err |= clSetKernelArg(render->orbitDensityKernel, 4, sizeof(double), &(view.xLeft));
+	err |= clSetKernelArg(render->orbitDensityKernel, 5, sizeof(double), &(view.xScale));
+	err |= clSetKernelArg(render->orbitDensityKernel, 6, sizeof(double), &(view.yBottom));
+	err |= clSetKernelArg(render->orbitDensityKernel, 7, sizeof(double), &(view.yScale));
+	err |= clSetKernelArg(render->orbitDensityKernel, 8, sizeof(int), &(image->maxIters));
+	err |= clSetKernelArg(render->orbitDensityKernel, 9, sizeof(cl_mem), &(render->orbitCells));
+	err |= clSetKernelArg(render->orbitDensityKernel, 10, sizeof(int), &gridSize);
+	err |= clSetKernelArg(render->orbitDensityKernel, 11, sizeof(cl_uint), &samples);
+	CheckOpenCLError(err, __LINE__);
+	size_t densitySize = render->deviceComputeUnits * OPENCLPERSISTENTGROUPS * render->localSize;
+	err = clEnqueueNDRangeKernel(render->queue, render->orbitDensityKernel, 1, NULL,
+	                             &densitySize, &(render->localSize), 0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+
+	// Merge the densities into the escape values
+	const int nPixelsInt = (int)nPixels;
+	const float scale = (float)OrbitDensityScale(image, samples);
+	err  = clSetKernelArg(render->orbitDensityMergeKernel, 0, sizeof(cl_mem), &(render->escapeDevice));
+	err |= clSetKernelArg(render->orbitDensityMergeKernel, 1, sizeof(cl_mem), &(render->orbitDensities));
+	err |= clSetKernelArg(render->orbitDensityMergeKernel, 2, sizeof(int), &nDensities);
+	err |= clSetKernelArg(render->orbitDensityMergeKernel, 3, sizeof(int), &nPixelsInt);
+	err |= clSetKernelArg(render->orbitDensityMergeKernel, 4, sizeof(float), &scale);
+	CheckOpenCLError(err, __LINE__);
+	err = clEnqueueNDRangeKernel(render->queue, render->orbitDensityMergeKernel, 1, NULL,
+	                             &(render->globalSize), &(render->localSize), 0, NULL, NULL);
+	CheckOpenCLError(err, __LINE__);
+
+	RecolourMandelbrotOpenCL(render, image);
+}
+#endif
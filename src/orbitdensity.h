@@ -0,0 +1,21 @@
+// Orbit density (Buddhabrot) rendering: the density of the orbits of escaping points over the view,
+// rather than the escape counts of its pixels. See orbitdensity.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "mandelbrot.h"
+#include "config.h"
+
+// Render the orbit density of image's view into image->escape, as for the escape counts, and colour it
+// with RecolourMandelbrotCPU. The render can be cancelled between batches of samples.
+void RenderOrbitDensityCPU(renderStruct *render, imageStruct *image);
+
+#ifdef WITHOPENCL
+// As above, sampling on the device, and colouring with RecolourMandelbrotOpenCL. Devices without double
+// precision sample on the host.
+void RenderOrbitDensityOpenCL(renderStruct *render, imageStruct *image);
+#endif
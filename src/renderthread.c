@@ -0,0 +1,543 @@
+#include "renderthread.h"
+
+// The GL thread makes requests, and the render thread renders them into frames, which the GL thread
+// uploads to the texture. Neither waits for the other: requests and frames are passed through triple
+// buffers, so that a request replaces the one before if the render thread hasn't taken it yet, and the
+// GL thread always presents the newest frame.
+//
+// Each request also sets the cancel flag, which the CPU routines check between rows. The render in
+// progress then stops within a row or so, and its frame is thrown away, so a drag never waits for the
+// render of a position already left behind. The escape counts of the last complete render are kept, so
+// that a change of colouring only needs a recolour, even if the render thread did not see the request
+// which changed the view. So are the orbits of the pixels which reached maxIters, so that raising
+// maxIters for the same view only iterates those pixels on, from where they stopped.
+//
+// Interactive frames are rendered at a resolution chosen to take DYNAMICFRAMETIME, from the time per
+// pixel of the last renders, which is a good guide while the view is changing a little at a time. The
+// texture is then smaller, and the GL texture filtering scales it up to fill the window. Once the
+// frame is out, the same request is rendered again at full resolution, unless a newer one cancels it.
+//
+// Where GL supports it, the frames are pixel buffers, mapped for as long as the thread runs, which the
+// renderers write straight into. The texture has immutable storage of the window's size, and a frame
+// is copied into its corner from the buffer, by the GPU, while the next frame is computed. The texScale
+// uniform tells the shaders how much of the texture the frame fills. A frame's buffer is only handed
+// back to the render thread once the copy is done, which it long since is by the time a newer frame is
+// finished. Otherwise, frames are in host memory, and uploaded with glTexImage2D.
+//
+// Unless supersampling, which needs the colours to find the pixels to refine, frames hold only the
+// escape counts, and the fragment shader colours and blurs them (see shaders.glsl), from the palette
+// LUT, uploaded once, and the frame's histogram. A change of colour period, histogram colouring or blur
+// then only sets a uniform, as long as the frame on screen is of the last request: nothing is
+// recoloured or uploaded, and the render thread is not involved.
+
+// Set in a shared slot index until the slot is taken
+#define RENDERSLOTFRESH 4
+
+
+
+static int AtomicRead(int *shared)
+{
+	int value;
+	#pragma omp atomic read seq_cst
+	value = *shared;
+	return value;
+}
+
+
+
+static int AtomicSwap(int *shared, const int value)
+{
+	int old;
+	#pragma omp atomic capture seq_cst
+	{ old = *shared; *shared = value; }
+	return old;
+}
+
+
+
+// Hand over the slot *own, taking the shared slot in exchange
+static void PublishSlot(int *shared, int *own)
+{
+	*own = AtomicSwap(shared, *own | RENDERSLOTFRESH) & ~RENDERSLOTFRESH;
+}
+
+
+
+// If the shared slot hasn't been taken, take it in exchange for *own and return 1, else return 0
+static int TakeSlot(int *shared, int *own)
+{
+	if (!(AtomicRead(shared) & RENDERSLOTFRESH)) {
+		return 0;
+	}
+	*own = AtomicSwap(shared, *own) & ~RENDERSLOTFRESH;
+	return 1;
+}
+
+
+
+static void FreeFrames(renderThreadStruct *thread)
+{
+	for (int i = 0; i < 3; i++) {
+		renderFrameStruct *frame = &(thread->frames[i]);
+		if (thread->persistent) {
+			if (frame->uploaded != NULL) {
+				glDeleteSync(frame->uploaded);
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame->buffer);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &(frame->buffer));
+		}
+		else {
+			free(frame->pixels);
+		}
+		free(frame->histogramCDF);
+	}
+	glDeleteTextures(1, &(thread->escapeTex));
+	glDeleteTextures(1, &(thread->paletteTex));
+	glDeleteTextures(1, &(thread->cdfTex));
+}
+
+
+
+// Set the uniforms for the colouring options which need no recolour
+static void SetColourUniforms(const renderThreadStruct *thread, const imageStruct *image)
+{
+	glUniform1f(thread->colourPeriodLoc, (float)image->colourPeriod);
+	glUniform1i(thread->histogramColouringLoc, image->histogramColouring);
+	glUniform1i(thread->gaussianBlurLoc, image->gaussianBlur);
+}
+
+
+
+#ifndef WITHOPENCL
+// Create the textures for colouring in the fragment shader, on texture units 1 to 3, and upload the
+// palette LUT. Texture unit 0 keeps the frame texture.
+static void CreateColourTextures(renderThreadStruct *thread, const GLuint program, const float *paletteLUT)
+{
+	GLuint *textures[3] = {&(thread->escapeTex), &(thread->paletteTex), &(thread->cdfTex)};
+	const char *samplers[3] = {"escapeTex", "paletteTex", "cdfTex"};
+	for (int i = 0; i < 3; i++) {
+		glActiveTexture(GL_TEXTURE1 + i);
+		glGenTextures(1, textures[i]);
+		glBindTexture(GL_TEXTURE_2D, *textures[i]);
+		// Read with texelFetch, but without mipmaps the default filter leaves them incomplete
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glUniform1i(glGetUniformLocation(program, samplers[i]), 1 + i);
+	}
+	if (thread->persistent) {
+		glActiveTexture(GL_TEXTURE1);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, thread->texXRes, thread->texYRes);
+	}
+	glActiveTexture(GL_TEXTURE2);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, PALETTELUTSIZE+2, 1, 0, GL_RGB, GL_FLOAT, paletteLUT);
+	glActiveTexture(GL_TEXTURE3);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, HISTOGRAMBINS+1, 1, 0, GL_RED, GL_FLOAT, NULL);
+	glActiveTexture(GL_TEXTURE0);
+
+	thread->shadedLoc = glGetUniformLocation(program, "shaded");
+	thread->escapeRangeLoc = glGetUniformLocation(program, "escapeRange");
+	thread->colourPeriodLoc = glGetUniformLocation(program, "colourPeriod");
+	thread->histogramColouringLoc = glGetUniformLocation(program, "histogramColouring");
+	thread->distanceEstimationLoc = glGetUniformLocation(program, "distanceEstimation");
+	thread->gaussianBlurLoc = glGetUniformLocation(program, "gaussianBlur");
+	thread->shaded = 0;
+}
+
+
+
+// Allocate the frames, as persistently mapped pixel buffers and immutable texture storage of xRes*yRes
+// if we can, or in host memory, and the textures for colouring in the shader. Returns 0, or -1 on error.
+static int AllocateFrames(renderThreadStruct *thread, const unsigned xRes, const unsigned yRes,
+                          const float *paletteLUT)
+{
+	const size_t frameSize = 3*(size_t)xRes*yRes * sizeof *(thread->frames[0].pixels);
+	thread->texXRes = xRes;
+	thread->texYRes = yRes;
+	GLint program;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	thread->texScale = glGetUniformLocation((GLuint)program, "texScale");
+	for (int i = 0; i < 3; i++) {
+		thread->frames[i].histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(thread->frames[i].histogramCDF));
+	}
+
+	// The renderers read the pixels back, to supersample and blur, so ask for cached host memory
+	thread->persistent = (GLEW_ARB_buffer_storage && GLEW_ARB_texture_storage);
+	if (thread->persistent) {
+		const GLbitfield mapFlags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		for (int i = 0; i < 3; i++) {
+			renderFrameStruct *frame = &(thread->frames[i]);
+			frame->uploaded = NULL;
+			glGenBuffers(1, &(frame->buffer));
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame->buffer);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, frameSize, NULL, mapFlags | GL_CLIENT_STORAGE_BIT);
+			frame->pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, frameSize, mapFlags);
+			if (frame->pixels == NULL) {
+				thread->persistent = 0;
+			}
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (!thread->persistent) {
+			fprintf(stderr, "Warning: cannot map pixel buffers, frames will be uploaded from host memory\n");
+			for (int i = 0; i < 3; i++) {
+				// which unmaps them
+				glDeleteBuffers(1, &(thread->frames[i].buffer));
+			}
+		}
+	}
+
+	if (thread->persistent) {
+		// Float r,g,b, as the renderers write, so the copy needs no conversion
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB32F, xRes, yRes);
+	}
+	else {
+		for (int i = 0; i < 3; i++) {
+			thread->frames[i].uploaded = NULL;
+			thread->frames[i].pixels = malloc(frameSize);
+			if (thread->frames[i].pixels == NULL) {
+				fprintf(stderr, "Error: cannot allocate frames (%.2lfMB)\n", 3.0*frameSize/1024.0/1024.0);
+				for (int j = 0; j < 3; j++) {
+					if (j < i) {
+						free(thread->frames[j].pixels);
+					}
+					free(thread->frames[j].histogramCDF);
+				}
+				return -1;
+			}
+		}
+	}
+	CreateColourTextures(thread, (GLuint)program, paletteLUT);
+	return 0;
+}
+
+
+
+// 1 if renders of a and b have the same escape counts, but for maxIters
+static int SameView(const imageStruct *a, const imageStruct *b)
+{
+	return a->xRes == b->xRes && a->yRes == b->yRes
+	    && a->xCentre == b->xCentre && a->xCentreLo == b->xCentreLo && a->yCentre == b->yCentre
+	    && a->yCentreLo == b->yCentreLo && a->xStep == b->xStep && a->yStep == b->yStep
+	    && a->distanceEstimation == b->distanceEstimation && a->orbitDensity == b->orbitDensity
+	    && a->expMap == b->expMap;
+}
+
+
+
+// 1 if renders of a and b have the same escape counts
+static int SameEscape(const imageStruct *a, const imageStruct *b)
+{
+	return SameView(a, b) && a->maxIters == b->maxIters;
+}
+
+
+
+// Reduce image's resolution by scale. Pixels are drawn at the centre of their texels, so the view is
+// shifted by the change in half a pixel, to keep them at the same place in the window.
+static void ScaleResolution(imageStruct *image, const double scale)
+{
+	const unsigned xRes = (unsigned)fmax(1.0, floor(image->xRes*scale));
+	const unsigned yRes = (unsigned)fmax(1.0, floor(image->yRes*scale));
+	const double xStep = image->xStep*image->xRes/xRes;
+	const double yStep = image->yStep*image->yRes/yRes;
+	MoveView(image, 0.5*(xStep - image->xStep), 0.5*(yStep - image->yStep));
+	image->xStep = xStep;
+	image->yStep = yStep;
+	image->xRes = xRes;
+	image->yRes = yRes;
+}
+
+
+
+static void *RenderThread(void *arg)
+{
+	renderThreadStruct *thread = arg;
+	imageStruct *image = &(thread->image);
+	// 1 while the request in requestTaken has not been rendered, as it was cancelled
+	int haveRequest = 0;
+
+	while (1) {
+		if (!haveRequest) {
+			sem_wait(&(thread->wake));
+		}
+		if (AtomicRead(&(thread->stop))) {
+			break;
+		}
+
+		// Clear the flag before taking the request, so that a newer request always cancels this one
+		AtomicSwap(&(thread->cancel), 0);
+		haveRequest |= TakeSlot(&(thread->requestShared), &(thread->requestTaken));
+		if (!haveRequest) {
+			continue;
+		}
+		renderRequestStruct *request = &(thread->requests[thread->requestTaken]);
+		renderFrameStruct *frame = &(thread->frames[thread->frameRendered]);
+
+		// Take the view and options, keeping our own arrays
+		const int kind = request->kind & ~REQUESTINTERACTIVE;
+		const imageStruct last = *image;
+		const int recolour = (kind == REQUESTRECOLOUR && thread->escapeValid && SameEscape(&last, &(request->image)));
+		*image = request->image;
+		image->pixels = frame->pixels;
+		image->escape = last.escape;
+		image->histogramCDF = last.histogramCDF;
+		image->paletteLUT = last.paletteLUT;
+		image->orbits = last.orbits;
+		image->orbitIters = last.orbitIters;
+		thread->render.shaderColouring = !image->supersample;
+
+		double scale = 1.0;
+		if (recolour) {
+			thread->RecolourMandelbrot(&(thread->render), image);
+		}
+		else {
+			if (kind == REQUESTAUTOITERS) {
+				image->maxIters = AutoMaxIters(&(thread->render), image);
+			}
+			if ((request->kind & REQUESTINTERACTIVE) && thread->pixelCost > 0.0) {
+				scale = fmax(DYNAMICMINSCALE, sqrt(DYNAMICFRAMETIME/thread->pixelCost/((double)image->xRes*image->yRes)));
+			}
+			if (scale < 1.0) {
+				ScaleResolution(image, scale);
+			}
+			// A higher maxIters for the same view only continues the pixels which didn't escape before
+			if (!thread->escapeValid || !SameView(&last, image)) {
+				image->orbitIters = 0;
+			}
+
+			const double startTime = GetWallTime();
+			thread->RenderMandelbrot(&(thread->render), image);
+			thread->escapeValid = !RenderCancelled(&(thread->render));
+			if (thread->escapeValid) {
+				// Average with the last, so one unusual frame doesn't throw the next
+				const double pixelCost = (GetWallTime()-startTime)/((double)image->xRes*image->yRes);
+				thread->pixelCost = (thread->pixelCost > 0.0) ? 0.5*(thread->pixelCost+pixelCost) : pixelCost;
+			}
+		}
+		// Take the newer request, or if there isn't one after all, render this one again
+		if (RenderCancelled(&(thread->render))) {
+			continue;
+		}
+
+		frame->xRes = image->xRes;
+		frame->yRes = image->yRes;
+		frame->maxIters = image->maxIters;
+		frame->sequence = request->sequence;
+		frame->reduced = (scale < 1.0);
+		frame->shaded = thread->render.shaderColouring;
+		if (frame->shaded) {
+			memcpy(frame->pixels, image->escape, (size_t)image->xRes*image->yRes * sizeof *(image->escape));
+			memcpy(frame->histogramCDF, image->histogramCDF, (HISTOGRAMBINS+1) * sizeof *(image->histogramCDF));
+			frame->escapeMin = image->escapeMin;
+			frame->escapeMax = image->escapeMax;
+			frame->distanceEstimation = image->distanceEstimation;
+		}
+		PublishSlot(&(thread->frameShared), &(thread->frameRendered));
+		// Follow a reduced resolution frame with a full one, with the same maxIters
+		if (scale < 1.0) {
+			request->kind = REQUESTRENDER;
+			request->image.maxIters = image->maxIters;
+		}
+		else {
+			haveRequest = 0;
+		}
+		// Wake the GL thread from glfwWaitEvents
+		glfwPostEmptyEvent();
+	}
+
+	return NULL;
+}
+#endif
+
+
+
+int StartRenderThread(renderThreadStruct *thread, renderStruct *render, imageStruct *image,
+                      void (*RenderMandelbrot)(renderStruct*, imageStruct*),
+                      void (*RecolourMandelbrot)(renderStruct*, imageStruct*))
+{
+	thread->glRender = render;
+	thread->RenderMandelbrot = RenderMandelbrot;
+	thread->RecolourMandelbrot = RecolourMandelbrot;
+	thread->sequence = 0;
+	thread->presented = 0;
+	thread->presentedReduced = 0;
+	thread->image = *image;
+#ifdef WITHOPENCL
+	// The kernels write to the texture, which only the GL thread may use
+	thread->threaded = 0;
+	return 0;
+#else
+	thread->threaded = 1;
+
+	// Each side starts with a slot of its own, and the third is shared
+	thread->requestMade = 0;
+	thread->requestShared = 1;
+	thread->requestTaken = 2;
+	thread->frameRendered = 0;
+	thread->frameShared = 1;
+	thread->framePresented = 2;
+	thread->stop = 0;
+	thread->cancel = 0;
+
+	const size_t nPixels = (size_t)image->xRes * image->yRes;
+	if (AllocateFrames(thread, image->xRes, image->yRes, image->paletteLUT) != 0) {
+		return -1;
+	}
+	thread->image.escape = malloc(nPixels * sizeof *(thread->image.escape));
+	thread->image.histogramCDF = malloc((HISTOGRAMBINS+1) * sizeof *(thread->image.histogramCDF));
+	// Without the orbits, every render starts from scratch
+	thread->image.orbits = malloc(ORBITVALUES*nPixels * sizeof *(thread->image.orbits));
+	thread->image.orbitIters = 0;
+	thread->escapeValid = 0;
+	thread->pixelCost = 0.0;
+
+	// The render thread's renders don't touch the texture, and can be cancelled
+	thread->render = *render;
+	thread->render.window = NULL;
+	thread->render.coordinator = NULL;
+	thread->render.updateTex = 0;
+	thread->render.cancel = &(thread->cancel);
+
+	if (sem_init(&(thread->wake), 0, 0) != 0 || pthread_create(&(thread->thread), NULL, RenderThread, thread) != 0) {
+		fprintf(stderr, "Error: cannot start the render thread\n");
+		FreeFrames(thread);
+		free(thread->image.escape);
+		free(thread->image.histogramCDF);
+		free(thread->image.orbits);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+
+
+void RequestRender(renderThreadStruct *thread, imageStruct *image, const int kind)
+{
+	// The shader colours the frame on screen with the new options when it is next drawn
+	if (thread->threaded && (kind & ~REQUESTINTERACTIVE) == REQUESTRECOLOUR && thread->shaded
+	 && !image->supersample && thread->presented == thread->sequence) {
+		SetColourUniforms(thread, image);
+		return;
+	}
+
+	thread->sequence++;
+
+	// Without the thread, all frames are at full resolution
+	if (!thread->threaded) {
+		if ((kind & ~REQUESTINTERACTIVE) == REQUESTRECOLOUR) {
+			thread->RecolourMandelbrot(thread->glRender, image);
+		}
+		else {
+			if ((kind & ~REQUESTINTERACTIVE) == REQUESTAUTOITERS) {
+				image->maxIters = AutoMaxIters(thread->glRender, image);
+			}
+			thread->RenderMandelbrot(thread->glRender, image);
+		}
+		return;
+	}
+
+	renderRequestStruct *request = &(thread->requests[thread->requestMade]);
+	request->image = *image;
+	request->kind = kind;
+	request->sequence = thread->sequence;
+	PublishSlot(&(thread->requestShared), &(thread->requestMade));
+	AtomicSwap(&(thread->cancel), 1);
+	sem_post(&(thread->wake));
+}
+
+
+
+int PresentFrame(renderThreadStruct *thread, imageStruct *image)
+{
+	if (!thread->threaded) {
+		// Already in the texture
+		const int fresh = (thread->presented != thread->sequence);
+		thread->presented = thread->sequence;
+		return fresh;
+	}
+
+	if (!(AtomicRead(&(thread->frameShared)) & RENDERSLOTFRESH)) {
+		return 0;
+	}
+	// The frame we hand back will be rendered into, so its copy to the texture must be done
+	renderFrameStruct *frame = &(thread->frames[thread->framePresented]);
+	if (frame->uploaded != NULL) {
+		while (glClientWaitSync(frame->uploaded, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(frame->uploaded);
+		frame->uploaded = NULL;
+	}
+	TakeSlot(&(thread->frameShared), &(thread->framePresented));
+
+	frame = &(thread->frames[thread->framePresented]);
+	if (frame->shaded) {
+		// Escape counts to the escape texture, and the histogram, on texture units 1 and 3
+		glActiveTexture(GL_TEXTURE1);
+		if (thread->persistent) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame->buffer);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->xRes, frame->yRes, GL_RED, GL_FLOAT, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		else {
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, frame->xRes, frame->yRes, 0, GL_RED, GL_FLOAT, frame->pixels);
+		}
+		glActiveTexture(GL_TEXTURE3);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HISTOGRAMBINS+1, 1, GL_RED, GL_FLOAT, frame->histogramCDF);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform2f(thread->escapeRangeLoc, frame->escapeMin, frame->escapeMax);
+		glUniform1i(thread->distanceEstimationLoc, frame->distanceEstimation);
+		SetColourUniforms(thread, image);
+	}
+	else if (thread->persistent) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame->buffer);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->xRes, frame->yRes, GL_RGB, GL_FLOAT, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	else {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame->xRes, frame->yRes, 0, GL_RGB, GL_FLOAT, frame->pixels);
+	}
+	if (thread->persistent) {
+		frame->uploaded = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glUniform2f(thread->texScale, (float)frame->xRes/(float)thread->texXRes, (float)frame->yRes/(float)thread->texYRes);
+	}
+	glUniform1i(thread->shadedLoc, frame->shaded);
+	thread->shaded = frame->shaded;
+	thread->presented = frame->sequence;
+	thread->presentedReduced = frame->reduced;
+	if (frame->sequence == thread->sequence) {
+		image->maxIters = frame->maxIters;
+	}
+	return 1;
+}
+
+
+
+void WaitForFrame(renderThreadStruct *thread, imageStruct *image, const int fullResolution)
+{
+	// The render thread posts an empty event with each frame, which ends glfwWaitEvents
+	while (thread->presented != thread->sequence || (fullResolution && thread->presentedReduced)) {
+		if (!PresentFrame(thread, image)) {
+			glfwWaitEvents();
+		}
+	}
+}
+
+
+
+void StopRenderThread(renderThreadStruct *thread)
+{
+	if (!thread->threaded) {
+		return;
+	}
+	AtomicSwap(&(thread->stop), 1);
+	AtomicSwap(&(thread->cancel), 1);
+	sem_post(&(thread->wake));
+	pthread_join(thread->thread, NULL);
+	sem_destroy(&(thread->wake));
+
+	FreeFrames(thread);
+	free(thread->image.escape);
+	free(thread->image.histogramCDF);
+	free(thread->image.orbits);
+}
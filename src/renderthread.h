@@ -0,0 +1,41 @@
+// Rendering of the interactive view on its own thread, so that the GL thread keeps handling input while
+// a frame is computed. See renderthread.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mandelbrot.h"
+#include "config.h"
+
+// Kinds of request: render the view, render it with maxIters chosen by AutoMaxIters, or only recolour
+// the last render, if it was of the same view
+#define REQUESTRENDER 0
+#define REQUESTAUTOITERS 1
+#define REQUESTRECOLOUR 2
+// Or'd with the kind for frames of a drag or smooth zoom, which are rendered at reduced resolution to
+// take about DYNAMICFRAMETIME, then at full resolution unless another request comes first
+#define REQUESTINTERACTIVE 4
+
+// Start the render thread, rendering frames of image's resolution with RenderMandelbrot and
+// RecolourMandelbrot. With OpenCL, which renders into the GL texture, there is no thread: requests are
+// rendered as they are made, with render and into image. Returns 0, or -1 on error.
+int StartRenderThread(renderThreadStruct *thread, renderStruct *render, imageStruct *image,
+                      void (*RenderMandelbrot)(renderStruct*, imageStruct*),
+                      void (*RecolourMandelbrot)(renderStruct*, imageStruct*));
+
+// Ask for image's view to be rendered (see the kinds above). This replaces any request the render thread
+// has not started on, and cancels the render in progress. Returns at once.
+void RequestRender(renderThreadStruct *thread, imageStruct *image, const int kind);
+
+// If a frame newer than the one on screen is finished, upload it to the texture and return 1, else 0.
+// If it is for the last request, and its maxIters was chosen by the render thread, sets image->maxIters.
+int PresentFrame(renderThreadStruct *thread, imageStruct *image);
+
+// Wait until the frame for the last request is finished, and present it. With fullResolution, if that
+// frame is at reduced resolution, wait for the full resolution frame which follows it too, after which
+// the render thread is idle. Handles GLFW events meanwhile.
+void WaitForFrame(renderThreadStruct *thread, imageStruct *image, const int fullResolution);
+
+// Stop the thread, and free its frames.
+void StopRenderThread(renderThreadStruct *thread);
@@ -3,17 +3,100 @@ const GLchar* vertexSource =
     "in vec2 position;"
     "in vec2 texcoord;"
     "out vec2 Texcoord;"
+    "uniform vec2 texScale;"
     "void main() {"
-    "   Texcoord = texcoord;"
+    "   Texcoord = texcoord*texScale;"
     "   gl_Position = vec4(position, 0.0, 1.0);"
     "}";
 
 
+// The fragment shader takes these from config.h
+#define SHADERSTRING2(x) #x
+#define SHADERSTRING(x) SHADERSTRING2(x)
+
+// Frames are either coloured already, in tex, or (if shaded) are escape counts in escapeTex, coloured
+// here as RecolourMandelbrotCPU would, from the palette LUT in paletteTex and the histogram's cumulative
+// distribution in cdfTex. Texels are coloured then filtered bilinearly, so reduced resolution frames
+// look as they would if coloured by the CPU.
 const GLchar* fragmentSource =
     "#version 150 core\n"
-    "in vec2 Texcoord;"
-    "out vec4 outColor;"
-    "uniform sampler2D tex;"
-    "void main() {"
-    "   outColor = texture(tex, Texcoord);"
-    "}";
+    "#define PALETTELUTSIZE " SHADERSTRING(PALETTELUTSIZE) "\n"
+    "#define HISTOGRAMBINS " SHADERSTRING(HISTOGRAMBINS) "\n"
+    "#define HISTOGRAMCYCLES " SHADERSTRING(HISTOGRAMCYCLES) "\n"
+    "#define DISTANCEWIDTH " SHADERSTRING(DISTANCEWIDTH) "\n"
+    "#define GAUSSIANBLURSIZE " SHADERSTRING(GAUSSIANBLURSIZE) "\n"
+    "in vec2 Texcoord;\n"
+    "out vec4 outColor;\n"
+    "uniform sampler2D tex;\n"
+    "uniform vec2 texScale;\n"
+    "uniform int shaded;\n"
+    "uniform sampler2D escapeTex;\n"
+    "uniform sampler2D paletteTex;\n"
+    "uniform sampler2D cdfTex;\n"
+    "uniform vec2 escapeRange;\n"
+    "uniform float colourPeriod;\n"
+    "uniform int histogramColouring;\n"
+    "uniform int distanceEstimation;\n"
+    "uniform int gaussianBlur;\n"
+    "vec3 EscapeColour(ivec2 texel) {\n"
+    "   float escape = texelFetch(escapeTex, texel, 0).r;\n"
+    "   float position;\n"
+    "   if (distanceEstimation != 0) {\n"
+    "      position = 0.5*sqrt(min(1.0, max(0.0, escape)/DISTANCEWIDTH));\n"
+    "   }\n"
+    "   else if (histogramColouring != 0) {\n"
+    "      float width = (escapeRange.y > escapeRange.x) ? (escapeRange.y-escapeRange.x) : 1.0;\n"
+    "      float bin = clamp((escape-escapeRange.x)/width*float(HISTOGRAMBINS), 0.0, float(HISTOGRAMBINS));\n"
+    "      int lower = min(int(bin), HISTOGRAMBINS-1);\n"
+    "      float cdfLower = texelFetch(cdfTex, ivec2(lower, 0), 0).r;\n"
+    "      float cdfUpper = texelFetch(cdfTex, ivec2(lower+1, 0), 0).r;\n"
+    "      position = fract((cdfLower + (bin-float(lower))*(cdfUpper-cdfLower))*float(HISTOGRAMCYCLES));\n"
+    "   }\n"
+    "   else {\n"
+    "      position = fract(escape/colourPeriod);\n"
+    "   }\n"
+    "   int index = (escape < 0.0) ? PALETTELUTSIZE+1 : int(position*float(PALETTELUTSIZE) + 0.5);\n"
+    "   return texelFetch(paletteTex, ivec2(index, 0), 0).rgb;\n"
+    "}\n"
+    "vec3 TexelColour(ivec2 texel, ivec2 size) {\n"
+    "   if (gaussianBlur == 0) {\n"
+    "      return EscapeColour(texel);\n"
+    "   }\n"
+    // The stencils of GaussianBlur.c, with clamped indices
+    "#if GAUSSIANBLURSIZE == 3 || GAUSSIANBLURSIZE == 5\n"
+    "#if GAUSSIANBLURSIZE == 5\n"
+    "   const int radius = 2;\n"
+    "   const float weights[5] = float[5](1.0/16.0, 4.0/16.0, 6.0/16.0, 4.0/16.0, 1.0/16.0);\n"
+    "#else\n"
+    "   const int radius = 1;\n"
+    "   const float weights[3] = float[3](1.0/4.0, 2.0/4.0, 1.0/4.0);\n"
+    "#endif\n"
+    "   vec3 colour = vec3(0.0);\n"
+    "   for (int j = -radius; j <= radius; j++) {\n"
+    "      for (int i = -radius; i <= radius; i++) {\n"
+    "         colour += weights[i+radius]*weights[j+radius]*EscapeColour(clamp(texel+ivec2(i, j), ivec2(0), size-1));\n"
+    "      }\n"
+    "   }\n"
+    "   return colour;\n"
+    "#else\n"
+    "   return (4.0*EscapeColour(texel)\n"
+    "           + EscapeColour(clamp(texel+ivec2(-1, 0), ivec2(0), size-1)) + EscapeColour(clamp(texel+ivec2(1, 0), ivec2(0), size-1))\n"
+    "           + EscapeColour(clamp(texel+ivec2(0, -1), ivec2(0), size-1)) + EscapeColour(clamp(texel+ivec2(0, 1), ivec2(0), size-1)))/8.0;\n"
+    "#endif\n"
+    "}\n"
+    "void main() {\n"
+    "   if (shaded == 0) {\n"
+    "      vec2 halfTexel = 0.5/vec2(textureSize(tex, 0));\n"
+    "      outColor = texture(tex, clamp(Texcoord, halfTexel, texScale-halfTexel));\n"
+    "      return;\n"
+    "   }\n"
+    "   ivec2 size = ivec2(texScale*vec2(textureSize(escapeTex, 0)) + 0.5);\n"
+    "   vec2 position = Texcoord*vec2(textureSize(escapeTex, 0)) - 0.5;\n"
+    "   ivec2 texel = ivec2(floor(position));\n"
+    "   vec2 frac = position - floor(position);\n"
+    "   vec3 colour00 = TexelColour(clamp(texel, ivec2(0), size-1), size);\n"
+    "   vec3 colour10 = TexelColour(clamp(texel+ivec2(1, 0), ivec2(0), size-1), size);\n"
+    "   vec3 colour01 = TexelColour(clamp(texel+ivec2(0, 1), ivec2(0), size-1), size);\n"
+    "   vec3 colour11 = TexelColour(clamp(texel+ivec2(1, 1), ivec2(0), size-1), size);\n"
+    "   outColor = vec4(mix(mix(colour00, colour10, frac.x), mix(colour01, colour11, frac.x), frac.y), 1.0);\n"
+    "}\n";
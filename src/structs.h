@@ -7,18 +7,47 @@ typedef struct {
 	unsigned xRes;			// x axis (horiz.) resolution
 	unsigned yRes;			// y axis (vert.) resolution
 
-	double xMin;		// lower and upper image boundaries,
-	double xMax;		// in "fractal coordinates", ie, the
-	double yMin;		// complex plane.
-	double yMax;
+	double xCentre;		// centre of the view in "fractal coordinates", ie, the complex plane, held
+	double xCentreLo;	// as the unevaluated sums xCentre+xCentreLo and yCentre+yCentreLo, so that
+	double yCentre;		// it keeps its place in deep zooms, and the spacing of the pixels. Pixel x,y
+	double yCentreLo;	// is at xCentre + (x - xRes/2)*xStep, yCentre + (y - yRes/2)*yStep. See
+	double xStep;		// SetView, MoveView and ViewX, ViewY.
+	double yStep;
+
+	int expMap;			// 1 or 0: the view is an exponential map about the origin, with x the angle and
+	double xOrigin;		// y the log of the distance from (xOrigin, yOrigin). Only the CPU renderers
+	double yOrigin;		// support these, for offline animations (see animation.c).
 
 	unsigned maxIters;		// max iteration count before a pixel
 							// is considered converged. Changes with zoom.
 
+	int autoIters;		// 1 or 0, choose maxIters automatically from the view, or scale by ITERSFACTOR.
+
 	float * pixels;	// array of r,g,b colour values in [0.0,1.0].
 
+	float * escape;	// array of smoothed escape counts (or distance estimates, in pixels),
+					// negative for pixels inside the set.
+
+	double * orbits;		// if not NULL, the CPU renderers leave here z (and dz/dc) of each pixel, ORBITVALUES
+	unsigned orbitIters;	// each, and set orbitIters to maxIters. A render with a higher maxIters then only
+							// continues the pixels which reached orbitIters. Set it to 0 if the view changes.
+
+	int distanceEstimation;	// 1 or 0, colour by estimated distance to the set, or by escape count.
+
+	int orbitDensity;	// 1 or 0, colour by the density of escaping orbits (see orbitdensity.c), or by escape
+						// count. Not with distanceEstimation or expMap.
+
+	int histogramColouring;	// 1 or 0, colour by the distribution of escape counts, or every colourPeriod.
+	float * histogramCDF;	// HISTOGRAMBINS+1 values of the cumulative distribution of escape counts,
+	float escapeMin;		// binned between escapeMin and escapeMax.
+	float escapeMax;
+
+	float * paletteLUT;	// r,g,b values of the palette, see BuildPaletteLUT
+
 	int gaussianBlur;	// 1 or 0, for gaussian blur or not.
 
+	int supersample;	// 1 or 0, for adaptive supersampling of edge pixels or not.
+
 	int zoomSteps;		// number of interpolated frames to render in SmoothZoom function
 
 	double colourPeriod;	// Number of diverging iterations in colour cycle.
@@ -27,25 +56,178 @@ typedef struct {
 
 
 
+// Coordinates of the columns and rows of a frame, computed once per frame for the CPU renderers (see
+// FrameCoordinates). For exponential maps, the cos and sin of each column's angle, and the distance of
+// each row from the origin.
+typedef struct {
+	double *Re;			// xRes values: real part of each column, or the cos of its angle
+	double *Im;			// yRes values: imaginary part of each row, or its distance from the origin
+	double *sinAngle;	// xRes values, for exponential maps
+} coordinatesStruct;
+
+
+
+// These hold the state of a coordinator of distributed high resolution renders, and its workers
+// (see distributed.c)
+typedef struct {
+	int fd;
+	int state;			// WORKERHELLO, WORKERIDLE or WORKERBUSY
+	double rate;		// pixels per second of its tiles so far, 0 until the first is back
+
+	unsigned job;		// the tile it is rendering: rows rowStart to rowStart+rows-1,
+	unsigned rowStart;	// handed out at startTime, resubmitted if not back by deadline,
+	unsigned rows;		// after which it is overdue. The rows had been resubmitted
+	double startTime;	// resubmissions times before.
+	double deadline;
+	int overdue;
+	unsigned resubmissions;
+
+	double header[8];	// the message being received, and the number of bytes
+	size_t received;	// of it (and of the tile's pixels) so far
+} workerStruct;
+
+typedef struct {
+	int listenFd;
+	int nWorkers;
+	workerStruct *workers;
+	unsigned nextJob;
+} coordinatorStruct;
+
+
+
+// This holds a high resolution image in a file mapped into memory, with a journal of the tiles done
+// (see canvas.c)
+typedef struct {
+	const char *fileName;
+	char *journalFileName;
+	int fd;
+	size_t mapSize;
+	void *map;
+	float *escape;		// the image's escape counts and r,g,b pixels, in the mapped file
+	float *pixels;
+
+	FILE *journal;
+	unsigned tiles;		// tiles of CANVASTILEROWS rows, and 1 or 0 for each: done, or not
+	unsigned char *tileDone;
+} canvasStruct;
+
+
+
 // This struct holds variables needed for rendering the image
 typedef struct {
 	GLFWwindow *window;
 
+	coordinatorStruct *coordinator;	// if not NULL, high resolution renders are split between its workers
+
 	int updateTex;		// if this is 0, don't update the GL texture.
 	                  // Used in high-resolution render, as we can't
 	                  // draw it to screen.
+
+	int *cancel;		// if not NULL, the CPU routines stop between rows once this is non-zero, as a newer
+	                  // frame has been asked for (see renderthread.c)
+
+	int shaderColouring;	// if 1, RecolourMandelbrotCPU only builds the histogram, and the escape counts
+	                  // are coloured by the fragment shader (see renderthread.c)
 #ifdef WITHOPENCL
 	cl_command_queue queue;
 	cl_context contextCL;
 	cl_kernel renderMandelbrotKernel;
+	cl_kernel renderMandelbrotPersistentKernel;
 	cl_kernel gaussianBlurKernel;
 	cl_kernel gaussianBlurKernel2;
+	cl_kernel colourKernel;
+	cl_kernel escapeRangeKernel;
+	cl_kernel histogramKernel;
+	cl_kernel histogramCDFKernel;
 	cl_mem pixelsDevice;
 	cl_mem pixelsTex;
+	cl_mem escapeDevice;	// smoothed escape counts, coloured into pixelsDevice
+	cl_mem escapeRange;		// min and max escape counts, for histogram colouring
+	cl_mem histograms;		// OPENCLHISTOGRAMGROUPS histograms of escape counts
+	cl_mem histogramCDF;	// their cumulative distribution
+	cl_mem paletteLUT;		// copy of image->paletteLUT
 	size_t globalSize;
 	size_t localSize;
 	int glclInterop;
+	int emulateDouble;	// 1 if the device lacks cl_khr_fp64, and we use the float-float kernel
 	size_t deviceMaxAlloc;
+	cl_uint deviceComputeUnits;
+	cl_mem workCounter;		// work queue counter for the persistent-threads kernel
+	cl_kernel orbitDensityKernel;
+	cl_kernel orbitDensityMergeKernel;
+	cl_mem orbitDensities;	// per work-group orbit densities, allocated on first use, of orbitDensitiesSize bytes
+	size_t orbitDensitiesSize;
+	cl_mem orbitCells;		// cumulative probabilities and sample weights of the orbit density grid's cells
 #endif
 
 } renderStruct;
+
+
+
+// These hold the state of the thread which renders the interactive view, and the requests and frames
+// passed to and from it (see renderthread.c)
+typedef struct {
+	imageStruct image;	// the view and options to render; its arrays are unused
+	int kind;			// REQUESTRENDER, REQUESTAUTOITERS or REQUESTRECOLOUR, and REQUESTINTERACTIVE
+	unsigned sequence;
+} renderRequestStruct;
+
+typedef struct {
+	float *pixels;		// in buffer, if the render thread's frames are persistent
+	GLuint buffer;
+	GLsync uploaded;	// fence for the copy from buffer to the texture, used by the GL thread only
+	unsigned xRes;		// less than the window's, for interactive frames
+	unsigned yRes;
+	unsigned maxIters;	// as rendered, chosen by the render thread for REQUESTAUTOITERS
+	unsigned sequence;	// of the request it was rendered for
+	int reduced;		// 1 if at reduced resolution, to be followed by a full resolution frame
+	int shaded;			// 1 if pixels holds escape counts, to be coloured by the fragment shader with
+	int distanceEstimation;	// these and histogramCDF
+	float escapeMin;
+	float escapeMax;
+	float *histogramCDF;
+} renderFrameStruct;
+
+typedef struct {
+	int threaded;		// 0 if requests are rendered as they are made, on the GL thread
+	int persistent;		// 1 if frames are rendered into persistently mapped pixel buffers
+	renderStruct *glRender;
+	GLint texScale;		// location of the shader's texScale uniform, and the texture's size
+	unsigned texXRes;
+	unsigned texYRes;
+	GLuint escapeTex;	// textures and uniform locations for colouring in the fragment shader
+	GLuint paletteTex;
+	GLuint cdfTex;
+	GLint shadedLoc;
+	GLint escapeRangeLoc;
+	GLint colourPeriodLoc;
+	GLint histogramColouringLoc;
+	GLint distanceEstimationLoc;
+	GLint gaussianBlurLoc;
+	int shaded;			// 1 if the frame on screen is coloured by the fragment shader
+	void (*RenderMandelbrot)(renderStruct*, imageStruct*);
+	void (*RecolourMandelbrot)(renderStruct*, imageStruct*);
+	unsigned sequence;	// of the last request, and of the frame last presented
+	unsigned presented;
+	int presentedReduced;	// 1 if the frame last presented is at reduced resolution
+
+	// Triple buffers of requests and frames. Each side owns a slot, and swaps it for the shared one to
+	// hand it over, or to take what it holds. RENDERSLOTFRESH is set in the shared index until then.
+	renderRequestStruct requests[3];
+	int requestShared;
+	int requestMade;	// owned by the GL thread
+	int requestTaken;	// owned by the render thread
+	renderFrameStruct frames[3];
+	int frameShared;
+	int frameRendered;	// owned by the render thread
+	int framePresented;	// owned by the GL thread
+
+	pthread_t thread;
+	sem_t wake;			// posted with each request
+	int stop;
+	int cancel;			// set with each request, for the render in progress
+	renderStruct render;	// the render thread's, and the image of its last frame, whose escape
+	imageStruct image;		// counts are kept for recolouring if escapeValid is 1
+	int escapeValid;
+	double pixelCost;		// seconds per pixel of recent renders, 0 until the first is done
+} renderThreadStruct;